@@ -0,0 +1,264 @@
+/*
+ * Pin/unpin stress test for ashmem.
+ *
+ * Unpins every other page of a large region to create thousands of
+ * fragmented ranges, then runs random pin and unpin calls against a
+ * bitmap model and checks ASHMEM_GET_PIN_STATUS against it. Prints the
+ * time taken by each phase. Then checks purge cost hints and, when run
+ * as root, that a purge is reported through the purge eventfd. Exits
+ * non-zero if any check fails.
+ *
+ * usage: ashmem-test [-n pages] [-i iterations] [-s seed]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/types.h>
+#include <linux/ashmem.h>
+
+#define ASHMEM_DEVICE	"/dev/ashmem"
+
+static unsigned int npages = 16384;
+static unsigned int iterations = 100000;
+static size_t page_size;
+static unsigned char *unpinned;	/* the model, one byte per page */
+static int failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (cond) {						\
+			printf("[ OK ] ");				\
+		} else {						\
+			printf("[FAIL] ");				\
+			failures++;					\
+		}							\
+		printf(__VA_ARGS__);					\
+		printf("\n");						\
+	} while (0)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int pin_ioctl(int fd, int cmd, unsigned int start, unsigned int len)
+{
+	struct ashmem_pin pin;
+
+	pin.offset = start * page_size;
+	pin.len = len * page_size;
+	return ioctl(fd, cmd, &pin);
+}
+
+/* applies a pin or unpin to the driver and the model */
+static int pin_pages(int fd, int pin, unsigned int start, unsigned int len)
+{
+	int ret = pin_ioctl(fd, pin ? ASHMEM_PIN : ASHMEM_UNPIN, start, len);
+
+	if (ret < 0)
+		return -1;
+	if (pin && ret != ASHMEM_NOT_PURGED && ret != ASHMEM_WAS_PURGED)
+		return -1;
+	memset(unpinned + start, !pin, len);
+	return 0;
+}
+
+/* returns the number of windows whose pin status disagrees with the model */
+static unsigned int verify(int fd, unsigned int window)
+{
+	unsigned int start, i, bad = 0;
+
+	for (start = 0; start < npages; start += window) {
+		unsigned int len = window;
+		int expect = ASHMEM_IS_PINNED;
+
+		if (len > npages - start)
+			len = npages - start;
+		for (i = 0; i < len; i++)
+			if (unpinned[start + i])
+				expect = ASHMEM_IS_UNPINNED;
+		if (pin_ioctl(fd, ASHMEM_GET_PIN_STATUS, start, len) != expect)
+			bad++;
+	}
+	return bad;
+}
+
+static int set_purge_cost(int fd, unsigned int start, unsigned int len,
+			  unsigned int cost)
+{
+	struct ashmem_purge_cost pc;
+
+	pc.offset = start * page_size;
+	pc.len = len * page_size;
+	pc.cost = cost;
+	return ioctl(fd, ASHMEM_SET_PURGE_COST, &pc);
+}
+
+static void test_purge_cost(int fd)
+{
+	CHECK(set_purge_cost(fd, 0, 4, ASHMEM_PURGE_COST_LOW) == 0 &&
+	      set_purge_cost(fd, 4, 4, ASHMEM_PURGE_COST_HIGH) == 0,
+	      "setting purge cost hints");
+	CHECK(set_purge_cost(fd, 0, 4, ASHMEM_PURGE_COST_HIGH + 1) < 0 &&
+	      errno == EINVAL, "an unknown purge cost is refused");
+	/* the hint must not change what is pinned */
+	CHECK(verify(fd, 1) == 0, "purge cost hints keep the pin status");
+}
+
+static void test_purge_event(int fd)
+{
+	uint64_t count = 0;
+	int efd, ret;
+
+	/* the glibc of the day may not wrap eventfd() yet */
+	efd = syscall(__NR_eventfd, 0);
+	if (efd < 0) {
+		printf("       no eventfd, skipping purge notification\n");
+		return;
+	}
+	CHECK(ioctl(fd, ASHMEM_SET_PURGE_EVENTFD, efd) == 0,
+	      "registering a purge eventfd");
+	CHECK(ioctl(fd, ASHMEM_SET_PURGE_EVENTFD, fd) < 0,
+	      "a non-eventfd descriptor is refused");
+	if (geteuid() != 0) {
+		printf("       not root, skipping ASHMEM_PURGE_ALL_CACHES\n");
+		close(efd);
+		return;
+	}
+
+	pin_pages(fd, 0, 0, npages);
+	ioctl(fd, ASHMEM_PURGE_ALL_CACHES);
+	ret = read(efd, &count, sizeof(count));
+	CHECK(ret == sizeof(count) && count >= 1,
+	      "purging is signalled on the eventfd (%llu)",
+	      (unsigned long long)count);
+	ret = pin_ioctl(fd, ASHMEM_PIN, 0, npages);
+	memset(unpinned, 0, npages);
+	CHECK(ret == ASHMEM_WAS_PURGED, "the purged region pins as purged");
+	ioctl(fd, ASHMEM_SET_PURGE_EVENTFD, -1);
+	close(efd);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, bad;
+	unsigned int seed = time(NULL);
+	int fd, ret = 0, opt;
+	double t;
+	void *map;
+
+	while ((opt = getopt(argc, argv, "n:i:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			npages = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n pages] [-i iterations] "
+				"[-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (npages < 2)
+		return 1;
+	page_size = sysconf(_SC_PAGESIZE);
+	unpinned = calloc(npages, 1);
+	srand(seed);
+	printf("%u pages, %u iterations, seed %u\n", npages, iterations,
+	       seed);
+
+	fd = open(ASHMEM_DEVICE, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "ashmem: cannot open %s: %s\n", ASHMEM_DEVICE,
+			strerror(errno));
+		return 1;
+	}
+	/* the backing file, and so pinning, only exists after mmap */
+	if (ioctl(fd, ASHMEM_SET_SIZE, (size_t)npages * page_size) < 0)
+		return 1;
+	map = mmap(NULL, (size_t)npages * page_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "ashmem: cannot map region: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	t = now();
+	for (i = 0; i < npages && !ret; i += 2)
+		ret = pin_pages(fd, 0, i, 1);
+	t = now() - t;
+	CHECK(!ret, "unpinned %u single pages in %.3f s", (npages + 1) / 2, t);
+
+	t = now();
+	bad = verify(fd, 1);
+	t = now() - t;
+	CHECK(!bad, "status of every page matches (%u wrong) in %.3f s", bad,
+	      t);
+
+	/* unpinned neighbours must not be merged across a pinned page */
+	CHECK(pin_ioctl(fd, ASHMEM_GET_PIN_STATUS, 1, 1) == ASHMEM_IS_PINNED,
+	      "the page between two unpinned pages stays pinned");
+
+	t = now();
+	for (i = 0; i < iterations && !ret; i++) {
+		unsigned int start = rand() % npages;
+		unsigned int len = 1 + rand() % 8;
+
+		if (len > npages - start)
+			len = npages - start;
+		ret = pin_pages(fd, rand() & 1, start, len);
+	}
+	t = now() - t;
+	CHECK(!ret, "%u random pins and unpins in %.3f s", iterations, t);
+
+	t = now();
+	bad = verify(fd, 1) + verify(fd, 7) + verify(fd, 64);
+	t = now() - t;
+	CHECK(!bad, "status of pages and windows matches (%u wrong) in %.3f s",
+	      bad, t);
+
+	/* a zero length means everything onward */
+	ret = pin_ioctl(fd, ASHMEM_PIN, 0, 0);
+	memset(unpinned, 0, npages);
+	CHECK(ret == ASHMEM_NOT_PURGED || ret == ASHMEM_WAS_PURGED,
+	      "pinning the whole region");
+	CHECK(pin_ioctl(fd, ASHMEM_GET_PIN_STATUS, 0, 0) == ASHMEM_IS_PINNED,
+	      "the whole region is pinned");
+
+	t = now();
+	ret = pin_pages(fd, 0, 0, npages);
+	for (i = 1; i < npages && !ret; i += 3)
+		ret = pin_pages(fd, 1, i, 1);
+	t = now() - t;
+	bad = verify(fd, 1);
+	CHECK(!ret && !bad, "punching %u holes into one range in %.3f s "
+	      "(%u wrong)", (npages + 1) / 3, t, bad);
+
+	test_purge_cost(fd);
+	test_purge_event(fd);
+
+	munmap(map, (size_t)npages * page_size);
+	close(fd);
+
+	printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Binder IPC latency and throughput benchmark.
+ *
+ * Forks a server that registers itself as the context manager, then
+ * calls it from one or more client threads and prints latency
+ * percentiles and throughput for each payload size.
+ *
+ * usage: binder-bench [-n iterations] [-t client threads]
+ *		       [-T server threads] [-o objects] [-a] [-e] [-g]
+ *		       [size ...]
+ *
+ *   -a  oneway transactions, timed until BR_TRANSACTION_COMPLETE
+ *   -e  the server echoes the payload back
+ *   -g  send the payload with BC_TRANSACTION_SG in four pieces
+ *   -o  number of local binder objects passed with each call
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "binder-util.h"
+
+static unsigned int iterations = 10000;
+static unsigned int client_threads = 1;
+static unsigned int server_threads = 1;
+static unsigned int objects;
+static int oneway;
+static int echo;
+static int sg;
+
+struct client {
+	pthread_t thread;
+	struct binder_state *bs;
+	size_t size;
+	uint64_t *latency;	/* ns, one per iteration */
+	int failed;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *client_run(void *arg)
+{
+	struct client *c = arg;
+	size_t data_size = c->size + objects * sizeof(struct flat_binder_object);
+	char *data = calloc(1, data_size + 1);
+	size_t *offsets = calloc(objects + 1, sizeof(*offsets));
+	struct flat_binder_object *obj;
+	struct binder_reply reply;
+	struct iovec iov[4];
+	uint32_t code = echo ? BT_ECHO : BT_NOP;
+	unsigned int i;
+
+	for (i = 0; i < objects; i++) {
+		offsets[i] = c->size + i * sizeof(*obj);
+		obj = (struct flat_binder_object *)(data + offsets[i]);
+		obj->type = BINDER_TYPE_BINDER;
+		obj->flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+		obj->binder = (void *)(unsigned long)(i + 1);
+	}
+	for (i = 0; i < 4; i++) {
+		iov[i].iov_base = data + data_size * i / 4;
+		iov[i].iov_len = data_size * (i + 1) / 4 - data_size * i / 4;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+		int ret;
+
+		ret = binder_call(c->bs, 0, code, oneway ? TF_ONE_WAY : 0,
+				  sg ? NULL : data, data_size, offsets,
+				  objects, sg ? iov : NULL, 4,
+				  oneway ? NULL : &reply);
+		if (ret) {
+			c->failed = 1;
+			break;
+		}
+		if (!oneway)
+			binder_free_buffer(c->bs, reply.tr.data.ptr.buffer);
+		c->latency[i] = now_ns() - start;
+	}
+	free(data);
+	free(offsets);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(struct binder_state *bs, size_t size)
+{
+	struct client *clients = calloc(client_threads, sizeof(*clients));
+	size_t total = (size_t)iterations * client_threads;
+	uint64_t *all = malloc(total * sizeof(*all));
+	uint64_t start, elapsed, sum = 0;
+	unsigned int i;
+	int failed = 0;
+
+	start = now_ns();
+	for (i = 0; i < client_threads; i++) {
+		clients[i].bs = bs;
+		clients[i].size = size;
+		clients[i].latency = all + (size_t)i * iterations;
+		pthread_create(&clients[i].thread, NULL, client_run,
+			       &clients[i]);
+	}
+	for (i = 0; i < client_threads; i++) {
+		pthread_join(clients[i].thread, NULL);
+		failed |= clients[i].failed;
+	}
+	elapsed = now_ns() - start;
+	if (failed) {
+		printf("%8zu  transactions failed\n", size);
+		goto out;
+	}
+
+	qsort(all, total, sizeof(*all), cmp_u64);
+	for (i = 0; i < total; i++)
+		sum += all[i];
+	printf("%8zu %8llu %8llu %8llu %8llu %8llu %10.0f %8.1f\n", size,
+	       (unsigned long long)(sum / total / 1000),
+	       (unsigned long long)(all[total / 2] / 1000),
+	       (unsigned long long)(all[total * 90 / 100] / 1000),
+	       (unsigned long long)(all[total * 99 / 100] / 1000),
+	       (unsigned long long)(all[total - 1] / 1000),
+	       total * 1e9 / elapsed,
+	       (double)total * size * (echo ? 2 : 1) * 1e9 / elapsed /
+	       (1024 * 1024));
+out:
+	free(all);
+	free(clients);
+}
+
+static void *server_thread(void *arg)
+{
+	struct binder_state *bs = arg;
+	struct binder_server_stats stats = { 0, 0 };
+
+	binder_serve(bs, &stats);
+	/* whichever thread got BT_EXIT ends the server */
+	_exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t default_sizes[] = { 0, 64, 1024, 4096, 16384,
+						65536 };
+	struct binder_state *bs;
+	int pipefd[2];
+	pid_t server;
+	char c = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:t:T:o:aeg")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			client_threads = atoi(optarg);
+			break;
+		case 'T':
+			server_threads = atoi(optarg);
+			break;
+		case 'o':
+			objects = atoi(optarg);
+			break;
+		case 'a':
+			oneway = 1;
+			break;
+		case 'e':
+			echo = 1;
+			break;
+		case 'g':
+			sg = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] "
+				"[-t client threads] [-T server threads] "
+				"[-o objects] [-a] [-e] [-g] [size ...]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (!iterations || !client_threads || !server_threads)
+		return 1;
+
+	if (pipe(pipefd))
+		return 1;
+	server = fork();
+	if (server == 0) {
+		pthread_t thread;
+		unsigned int n;
+
+		close(pipefd[0]);
+		bs = binder_open(BINDER_MAP_SIZE);
+		if (!bs || binder_become_context_manager(bs)) {
+			perror("binder: BINDER_SET_CONTEXT_MGR");
+			return 1;
+		}
+		for (n = 1; n < server_threads; n++)
+			pthread_create(&thread, NULL, server_thread, bs);
+		write(pipefd[1], &c, 1);
+		server_thread(bs);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		fprintf(stderr, "binder: server did not start\n");
+		waitpid(server, NULL, 0);
+		return 1;
+	}
+
+	bs = binder_open(BINDER_MAP_SIZE);
+	if (!bs) {
+		kill(server, SIGKILL);
+		return 1;
+	}
+	if (sg && !(binder_features(bs) & BINDER_FEATURE_TRANSACTION_SG)) {
+		fprintf(stderr, "binder: driver has no BC_TRANSACTION_SG\n");
+		sg = 0;
+	}
+
+	printf("%s, %u x %u iterations, %u server threads, %u objects%s%s\n",
+	       oneway ? "oneway" : "sync", client_threads, iterations,
+	       server_threads, objects, echo ? ", echo" : "",
+	       sg ? ", scatter-gather" : "");
+	printf("    size  avg(us)  p50(us)  p90(us)  p99(us)  max(us)"
+	       "    calls/s     MB/s\n");
+	if (optind < argc) {
+		for (i = optind; i < argc; i++)
+			run(bs, strtoul(argv[i], NULL, 0));
+	} else {
+		for (i = 0; i < (int)(sizeof(default_sizes) /
+				      sizeof(default_sizes[0])); i++)
+			run(bs, default_sizes[i]);
+	}
+
+	binder_call(bs, 0, BT_EXIT, 0, NULL, 0, NULL, 0, NULL, 0, NULL);
+	binder_close(bs);
+	waitpid(server, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Functional test for the binder driver.
+ *
+ * Forks a server that registers itself as the context manager and runs
+ * basic transactions against it. Needs a kernel with
+ * CONFIG_ANDROID_BINDER_IPC and no other context manager running.
+ * Exits non-zero if any check fails.
+ */
+
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "binder-util.h"
+
+static int failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (cond) {						\
+			printf("[ OK ] ");				\
+		} else {						\
+			printf("[FAIL] ");				\
+			failures++;					\
+		}							\
+		printf(__VA_ARGS__);					\
+		printf("\n");						\
+	} while (0)
+
+static uint32_t reply_u32(struct binder_state *bs, uint32_t code)
+{
+	struct binder_reply reply;
+	uint32_t value = ~0U;
+
+	if (binder_call(bs, 0, code, 0, NULL, 0, NULL, 0, NULL, 0, &reply))
+		return value;
+	if (reply.tr.data_size == sizeof(value))
+		memcpy(&value, reply.tr.data.ptr.buffer, sizeof(value));
+	binder_free_buffer(bs, reply.tr.data.ptr.buffer);
+	return value;
+}
+
+static void test_version(struct binder_state *bs)
+{
+	struct binder_version version;
+	int ret;
+
+	ret = ioctl(bs->fd, BINDER_VERSION, &version);
+	CHECK(ret == 0 && version.protocol_version ==
+	      BINDER_CURRENT_PROTOCOL_VERSION,
+	      "BINDER_VERSION reports protocol %ld",
+	      ret ? -1L : version.protocol_version);
+	printf("       features %lx\n", binder_features(bs));
+}
+
+static void test_echo(struct binder_state *bs, size_t size, int sg)
+{
+	struct binder_reply reply;
+	struct iovec iov[3];
+	char *data = malloc(size + 1);
+	size_t i;
+	int ret;
+
+	for (i = 0; i < size; i++)
+		data[i] = (char)(i * 7 + size);
+	if (sg) {
+		/* three uneven pieces, the first may be empty */
+		iov[0].iov_base = data;
+		iov[0].iov_len = size / 3;
+		iov[1].iov_base = data + size / 3;
+		iov[1].iov_len = size / 2;
+		iov[2].iov_base = data + size / 3 + size / 2;
+		iov[2].iov_len = size - size / 3 - size / 2;
+	}
+	ret = binder_call(bs, 0, BT_ECHO, 0, sg ? NULL : data, size, NULL, 0,
+			  sg ? iov : NULL, 3, &reply);
+	CHECK(ret == 0 && reply.tr.data_size == size &&
+	      !memcmp(reply.tr.data.ptr.buffer, data, size),
+	      "%s round trip of %zu bytes", sg ? "scatter-gather" : "sync",
+	      size);
+	if (ret == 0)
+		binder_free_buffer(bs, reply.tr.data.ptr.buffer);
+	free(data);
+}
+
+static void test_sg_bad_length(struct binder_state *bs)
+{
+	struct binder_reply reply;
+	char data[64];
+	struct iovec iov = { data, sizeof(data) };
+	int ret;
+
+	/* the iovecs must add up to data_size exactly */
+	ret = binder_call(bs, 0, BT_ECHO, 0, NULL, sizeof(data) + 8, NULL, 0,
+			  &iov, 1, &reply);
+	CHECK(ret < 0 && reply.cmd == BR_FAILED_REPLY,
+	      "scatter-gather with short iovecs is refused");
+}
+
+static void test_oneway(struct binder_state *bs, unsigned int count)
+{
+	uint32_t before = reply_u32(bs, BT_COUNT);
+	uint32_t misordered = reply_u32(bs, BT_MISORDERED);
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < count && !ret; i++)
+		ret = binder_call(bs, 0, BT_SEQUENCE, TF_ONE_WAY, &i,
+				  sizeof(i), NULL, 0, NULL, 0, NULL);
+	/* queued oneway calls can be overtaken by the sync BT_COUNT */
+	for (i = 0; i < 1000 && !ret; i++) {
+		if (reply_u32(bs, BT_COUNT) - before == count)
+			break;
+		usleep(1000);
+	}
+	CHECK(ret == 0 && i < 1000, "%u oneway transactions delivered",
+	      count);
+	CHECK(ret == 0 && reply_u32(bs, BT_MISORDERED) == misordered,
+	      "oneway transactions delivered in order");
+}
+
+static void test_objects(struct binder_state *bs, unsigned int count)
+{
+	struct flat_binder_object *objs;
+	size_t *offsets;
+	uint32_t before = reply_u32(bs, BT_OBJECTS);
+	unsigned int i;
+	int ret;
+
+	objs = calloc(count, sizeof(*objs));
+	offsets = calloc(count, sizeof(*offsets));
+	for (i = 0; i < count; i++) {
+		objs[i].type = BINDER_TYPE_BINDER;
+		objs[i].flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+		objs[i].binder = &objs[i];
+		objs[i].cookie = NULL;
+		offsets[i] = i * sizeof(*objs);
+	}
+	ret = binder_call(bs, 0, BT_NOP, 0, objs, count * sizeof(*objs),
+			  offsets, count, NULL, 0, NULL);
+	CHECK(ret == 0 && reply_u32(bs, BT_OBJECTS) - before == count,
+	      "%u local objects arrive as handles", count);
+	free(objs);
+	free(offsets);
+}
+
+static void test_bad_handle(struct binder_state *bs)
+{
+	struct binder_reply reply;
+	int ret;
+
+	ret = binder_call(bs, 12345, BT_NOP, 0, NULL, 0, NULL, 0, NULL, 0,
+			  &reply);
+	CHECK(ret < 0 && reply.cmd == BR_FAILED_REPLY,
+	      "transaction to an invalid handle fails");
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 0, 4, 100, 4096, 4097, 65536 };
+	struct binder_server_stats stats = { 0, 0 };
+	struct binder_state *bs;
+	int pipefd[2];
+	pid_t server;
+	char c = 0;
+	unsigned int i;
+	int status;
+
+	if (pipe(pipefd))
+		return 1;
+	server = fork();
+	if (server == 0) {
+		close(pipefd[0]);
+		bs = binder_open(BINDER_MAP_SIZE);
+		if (!bs || binder_become_context_manager(bs)) {
+			perror("binder: BINDER_SET_CONTEXT_MGR");
+			return 1;
+		}
+		write(pipefd[1], &c, 1);
+		binder_serve(bs, &stats);
+		binder_close(bs);
+		return 0;
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		fprintf(stderr, "binder: server did not start\n");
+		waitpid(server, NULL, 0);
+		return 1;
+	}
+
+	bs = binder_open(BINDER_MAP_SIZE);
+	if (!bs) {
+		kill(server, SIGKILL);
+		return 1;
+	}
+	test_version(bs);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		test_echo(bs, sizes[i], 0);
+	if (binder_features(bs) & BINDER_FEATURE_TRANSACTION_SG) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+			test_echo(bs, sizes[i], 1);
+		test_sg_bad_length(bs);
+	}
+	test_oneway(bs, 100);
+	test_objects(bs, 1);
+	test_objects(bs, 16);
+	test_bad_handle(bs);
+
+	binder_call(bs, 0, BT_EXIT, 0, NULL, 0, NULL, 0, NULL, 0, NULL);
+	binder_close(bs);
+	waitpid(server, &status, 0);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+	      "server exited cleanly");
+
+	printf("%d failure%s\n", failures, failures == 1 ? "" : "s");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,390 @@
+/*
+ * Minimal userspace side of the binder protocol, shared by binder-test.c
+ * and binder-bench.c. One process becomes the context manager and serves
+ * transactions on handle 0; the other process calls it.
+ */
+
+#ifndef _BINDER_UTIL_H
+#define _BINDER_UTIL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <linux/binder.h>
+
+#define BINDER_DEVICE	"/dev/binder"
+#define BINDER_MAP_SIZE	(1024 * 1024 - 2 * 4096)
+
+/* transaction codes understood by binder_serve() */
+enum {
+	BT_NOP = 1,	/* empty reply */
+	BT_ECHO,	/* reply with the received data */
+	BT_COUNT,	/* reply with the number of oneway calls so far */
+	BT_OBJECTS,	/* reply with the number of handles received */
+	BT_EXIT,	/* reply, then stop serving */
+	BT_SEQUENCE,	/* oneway, carries a sequence number starting at 0 */
+	BT_MISORDERED,	/* reply with the number of BT_SEQUENCE calls that
+			 * did not arrive in order */
+};
+
+struct binder_state {
+	int fd;
+	void *mapped;
+	size_t mapsize;
+};
+
+struct binder_reply {
+	struct binder_transaction_data tr;
+	uint32_t cmd;		/* BR_REPLY, BR_DEAD_REPLY, BR_FAILED_REPLY */
+};
+
+static inline struct binder_state *binder_open(size_t mapsize)
+{
+	struct binder_state *bs = calloc(1, sizeof(*bs));
+
+	if (!bs)
+		return NULL;
+	bs->fd = open(BINDER_DEVICE, O_RDWR);
+	if (bs->fd < 0) {
+		fprintf(stderr, "binder: cannot open %s: %s\n",
+			BINDER_DEVICE, strerror(errno));
+		free(bs);
+		return NULL;
+	}
+	bs->mapsize = mapsize;
+	bs->mapped = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, bs->fd, 0);
+	if (bs->mapped == MAP_FAILED) {
+		fprintf(stderr, "binder: cannot map device: %s\n",
+			strerror(errno));
+		close(bs->fd);
+		free(bs);
+		return NULL;
+	}
+	return bs;
+}
+
+static inline void binder_close(struct binder_state *bs)
+{
+	munmap(bs->mapped, bs->mapsize);
+	close(bs->fd);
+	free(bs);
+}
+
+static inline int binder_write_read(struct binder_state *bs,
+				    void *wbuf, size_t wlen,
+				    void *rbuf, size_t rlen, size_t *consumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	bwr.write_size = wlen;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.read_size = rlen;
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)rbuf;
+	do {
+		ret = ioctl(bs->fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return ret;
+}
+
+static inline int binder_write(struct binder_state *bs, void *data,
+			       size_t len)
+{
+	return binder_write_read(bs, data, len, NULL, 0, NULL);
+}
+
+static inline int binder_cmd(struct binder_state *bs, uint32_t cmd)
+{
+	return binder_write(bs, &cmd, sizeof(cmd));
+}
+
+static inline int binder_free_buffer(struct binder_state *bs,
+				     const void *buffer)
+{
+	struct {
+		uint32_t cmd;
+		const void *buffer;
+	} __attribute__((packed)) data;
+
+	data.cmd = BC_FREE_BUFFER;
+	data.buffer = buffer;
+	return binder_write(bs, &data, sizeof(data));
+}
+
+/*
+ * Answers node reference requests so nodes for objects we send do not
+ * stay pending. Returns the size of the command at ptr, or 0 if it is
+ * not a node command.
+ */
+static inline size_t binder_handle_node_cmd(struct binder_state *bs,
+					    uint32_t cmd, void *ptr)
+{
+	struct {
+		uint32_t cmd;
+		void *ptr;
+		void *cookie;
+	} __attribute__((packed)) done;
+	struct binder_ptr_cookie *pc = ptr;
+
+	switch (cmd) {
+	case BR_INCREFS:
+	case BR_ACQUIRE:
+		done.cmd = cmd == BR_INCREFS ? BC_INCREFS_DONE :
+			BC_ACQUIRE_DONE;
+		done.ptr = pc->ptr;
+		done.cookie = pc->cookie;
+		binder_write(bs, &done, sizeof(done));
+		return sizeof(*pc);
+	case BR_RELEASE:
+	case BR_DECREFS:
+		return sizeof(*pc);
+	}
+	return 0;
+}
+
+/*
+ * Sends a transaction to @handle and waits for its reply, or only for
+ * BR_TRANSACTION_COMPLETE with TF_ONE_WAY. With @iov set the data is sent
+ * with BC_TRANSACTION_SG. The reply buffer must be released with
+ * binder_free_buffer(). Returns 0 or -1.
+ */
+static inline int binder_call(struct binder_state *bs, uint32_t handle,
+			      uint32_t code, uint32_t flags,
+			      const void *data, size_t data_size,
+			      const size_t *offsets, size_t offsets_count,
+			      const struct iovec *iov, size_t iov_count,
+			      struct binder_reply *reply)
+{
+	struct binder_transaction_data_sg sg;
+	struct binder_transaction_data *tr = &sg.transaction_data;
+	char writebuf[sizeof(uint32_t) + sizeof(sg)];
+	uint32_t cmd = iov ? BC_TRANSACTION_SG : BC_TRANSACTION;
+	uint32_t readbuf[128];
+	size_t wlen;
+	int done = 0;
+
+	memset(&sg, 0, sizeof(sg));
+	tr->target.handle = handle;
+	tr->code = code;
+	tr->flags = flags;
+	tr->data_size = data_size;
+	tr->offsets_size = offsets_count * sizeof(size_t);
+	tr->data.ptr.buffer = data;
+	tr->data.ptr.offsets = offsets;
+	sg.data_iov = iov;
+	sg.data_iov_count = iov_count;
+	/* the command is followed by its argument without padding */
+	wlen = sizeof(cmd) + (iov ? sizeof(sg) : sizeof(*tr));
+	memcpy(writebuf, &cmd, sizeof(cmd));
+	memcpy(writebuf + sizeof(cmd), &sg, wlen - sizeof(cmd));
+
+	while (!done) {
+		size_t consumed;
+		char *ptr, *end;
+
+		if (binder_write_read(bs, writebuf, wlen, readbuf,
+				      sizeof(readbuf), &consumed) < 0) {
+			perror("binder: BINDER_WRITE_READ");
+			return -1;
+		}
+		wlen = 0;
+		ptr = (char *)readbuf;
+		end = ptr + consumed;
+		while (ptr < end) {
+			size_t len;
+
+			memcpy(&cmd, ptr, sizeof(cmd));
+			ptr += sizeof(uint32_t);
+			len = binder_handle_node_cmd(bs, cmd, ptr);
+			if (len) {
+				ptr += len;
+				continue;
+			}
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_TRANSACTION_COMPLETE:
+				if (flags & TF_ONE_WAY)
+					done = 1;
+				break;
+			case BR_REPLY:
+				if (reply) {
+					reply->cmd = cmd;
+					memcpy(&reply->tr, ptr,
+					       sizeof(reply->tr));
+				} else {
+					binder_free_buffer(bs,
+						((struct binder_transaction_data *)
+						 ptr)->data.ptr.buffer);
+				}
+				ptr += sizeof(struct binder_transaction_data);
+				done = 1;
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				if (reply)
+					reply->cmd = cmd;
+				return -1;
+			default:
+				fprintf(stderr, "binder: unexpected command "
+					"%08x\n", cmd);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static inline int binder_become_context_manager(struct binder_state *bs)
+{
+	return ioctl(bs->fd, BINDER_SET_CONTEXT_MGR, 0);
+}
+
+/* returns the BINDER_FEATURE_* flags, 0 for drivers without them */
+static inline unsigned long binder_features(struct binder_state *bs)
+{
+	struct binder_version_features vf;
+
+	if (ioctl(bs->fd, BINDER_VERSION_FEATURES, &vf) < 0)
+		return 0;
+	return vf.features;
+}
+
+struct binder_server_stats {
+	unsigned int oneway;
+	unsigned int handles;
+	unsigned int next_sequence;
+	unsigned int misordered;
+};
+
+/*
+ * Handles one received transaction for the codes above. Returns 0 to go
+ * on serving or 1 after BT_EXIT.
+ */
+static inline int binder_serve_one(struct binder_state *bs,
+				   struct binder_transaction_data *txn,
+				   struct binder_server_stats *stats)
+{
+	struct {
+		uint32_t cmd_reply;
+		struct binder_transaction_data tr;
+		uint32_t cmd_free;
+		const void *buffer;
+	} __attribute__((packed)) writebuf;
+	const size_t *offs = txn->data.ptr.offsets;
+	uint32_t value = 0;
+	size_t i;
+
+	for (i = 0; i < txn->offsets_size / sizeof(size_t); i++) {
+		const struct flat_binder_object *obj = (const void *)
+			((const char *)txn->data.ptr.buffer + offs[i]);
+
+		if (obj->type == BINDER_TYPE_HANDLE)
+			__sync_fetch_and_add(&stats->handles, 1);
+	}
+	if (txn->flags & TF_ONE_WAY) {
+		if (txn->code == BT_SEQUENCE &&
+		    txn->data_size == sizeof(value)) {
+			memcpy(&value, txn->data.ptr.buffer, sizeof(value));
+			if (value && value != stats->next_sequence)
+				stats->misordered++;
+			stats->next_sequence = value + 1;
+		}
+		__sync_fetch_and_add(&stats->oneway, 1);
+		binder_free_buffer(bs, txn->data.ptr.buffer);
+		return 0;
+	}
+
+	memset(&writebuf, 0, sizeof(writebuf));
+	writebuf.cmd_reply = BC_REPLY;
+	writebuf.cmd_free = BC_FREE_BUFFER;
+	writebuf.buffer = txn->data.ptr.buffer;
+	switch (txn->code) {
+	case BT_ECHO:
+		writebuf.tr.data_size = txn->data_size;
+		writebuf.tr.data.ptr.buffer = txn->data.ptr.buffer;
+		break;
+	case BT_COUNT:
+		value = stats->oneway;
+		break;
+	case BT_OBJECTS:
+		value = stats->handles;
+		break;
+	case BT_MISORDERED:
+		value = stats->misordered;
+		break;
+	}
+	if (txn->code == BT_COUNT || txn->code == BT_OBJECTS ||
+	    txn->code == BT_MISORDERED) {
+		writebuf.tr.data_size = sizeof(value);
+		writebuf.tr.data.ptr.buffer = &value;
+	}
+	/* the reply is copied before the request buffer is freed */
+	binder_write(bs, &writebuf, sizeof(writebuf));
+	return txn->code == BT_EXIT;
+}
+
+/* serves transactions on the calling thread until BT_EXIT */
+static inline void binder_serve(struct binder_state *bs,
+				struct binder_server_stats *stats)
+{
+	uint32_t readbuf[128];
+	int exit = 0;
+
+	binder_cmd(bs, BC_ENTER_LOOPER);
+	while (!exit) {
+		size_t consumed;
+		char *ptr, *end;
+
+		if (binder_write_read(bs, NULL, 0, readbuf, sizeof(readbuf),
+				      &consumed) < 0) {
+			perror("binder: BINDER_WRITE_READ");
+			break;
+		}
+		ptr = (char *)readbuf;
+		end = ptr + consumed;
+		while (ptr < end) {
+			uint32_t cmd = *(uint32_t *)ptr;
+			size_t len;
+
+			ptr += sizeof(uint32_t);
+			len = binder_handle_node_cmd(bs, cmd, ptr);
+			if (len) {
+				ptr += len;
+				continue;
+			}
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_SPAWN_LOOPER:
+			case BR_TRANSACTION_COMPLETE:
+				break;
+			case BR_TRANSACTION:
+				exit |= binder_serve_one(bs, (void *)ptr,
+							 stats);
+				ptr += sizeof(struct binder_transaction_data);
+				break;
+			default:
+				fprintf(stderr, "binder: server got unexpected "
+					"command %08x\n", cmd);
+				return;
+			}
+		}
+	}
+	binder_cmd(bs, BC_EXIT_LOOPER);
+}
+
+#endif
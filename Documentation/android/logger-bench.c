@@ -0,0 +1,380 @@
+/*
+ * Logger write benchmark.
+ *
+ * Writes entries in the liblog format (priority, tag, message) to a log
+ * device from several threads at once and prints write latency
+ * percentiles and throughput. With -r a reader drains the log at the same
+ * time and checks every entry it gets: the header must match the payload
+ * and the entries of each writer thread must come in order. Exits
+ * non-zero if a corrupt or reordered entry was read.
+ *
+ * usage: logger-bench [-d device] [-n writes per thread] [-t threads]
+ *		       [-s message size] [-r | -b | -m]
+ *
+ *   -r  verify with one read() per entry
+ *   -b  verify with batched reads, LOGGER_SET_BATCHED_READ
+ *   -m  verify by reading the mapped ring, without syscalls
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <linux/logger.h>
+
+#define BENCH_TAG	"logger-bench"
+#define MAX_THREADS	256
+#define BATCH_SIZE	(16 * LOGGER_ENTRY_MAX_LEN)
+
+static const char *device = "/dev/log/main";
+static unsigned int iterations = 100000;
+static unsigned int threads = 4;
+static size_t msg_size = 64;
+static int verify;	/* 0, 'r', 'b' or 'm' */
+
+static volatile int writers_done;
+
+struct writer {
+	pthread_t thread;
+	unsigned int index;
+	uint64_t *latency;	/* ns, one per write */
+	int failed;
+};
+
+struct reader_stats {
+	unsigned long entries;
+	unsigned long lost;
+	unsigned long corrupt;
+	unsigned long reordered;
+	unsigned long reads;	/* syscalls or, mapped, polls of w_off */
+	long overwritten;	/* as counted by the driver, -1 if unknown */
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *writer_run(void *arg)
+{
+	struct writer *w = arg;
+	char *msg = malloc(msg_size + 1);
+	unsigned char prio = 4;	/* ANDROID_LOG_INFO */
+	struct iovec iov[3];
+	unsigned int i;
+	int fd;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0 || !msg) {
+		fprintf(stderr, "logger: cannot open %s: %s\n", device,
+			strerror(errno));
+		w->failed = 1;
+		free(msg);
+		return NULL;
+	}
+	memset(msg, 'x', msg_size);
+	msg[msg_size] = '\0';
+
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = BENCH_TAG;
+	iov[1].iov_len = sizeof(BENCH_TAG);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = msg_size + 1;
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+
+		/* "thread sequence", padded with the x's set above */
+		snprintf(msg, msg_size + 1, "%u %u ", w->index, i);
+		msg[strlen(msg)] = 'x';
+		if (writev(fd, iov, 3) < 0) {
+			perror("logger: writev");
+			w->failed = 1;
+			break;
+		}
+		w->latency[i] = now_ns() - start;
+	}
+	close(fd);
+	free(msg);
+	return NULL;
+}
+
+static void check_entry(struct logger_entry *e, ssize_t len,
+			unsigned int *next_seq, struct reader_stats *st)
+{
+	unsigned int index, seq;
+	const char *msg;
+
+	if (e->pid != getpid())
+		return;		/* somebody else's entry */
+	st->entries++;
+	if ((size_t)len != sizeof(*e) + e->len) {
+		st->corrupt++;
+		return;
+	}
+	if (e->len < 1 + sizeof(BENCH_TAG) ||
+	    memcmp(e->msg + 1, BENCH_TAG, sizeof(BENCH_TAG))) {
+		st->corrupt++;
+		return;
+	}
+	msg = e->msg + 1 + sizeof(BENCH_TAG);
+	if (e->msg[e->len - 1] != '\0' ||
+	    sscanf(msg, "%u %u", &index, &seq) != 2 || index >= threads) {
+		st->corrupt++;
+		return;
+	}
+	if (seq < next_seq[index])
+		st->reordered++;
+	else
+		st->lost += seq - next_seq[index];
+	next_seq[index] = seq + 1;
+}
+
+/* drains the log with read(), one entry or a batch per call */
+static void read_log(int fd, unsigned int *next_seq, struct reader_stats *st)
+{
+	static char buf[BATCH_SIZE];
+	size_t size = verify == 'b' ? BATCH_SIZE : LOGGER_ENTRY_MAX_LEN;
+
+	if (verify == 'b' && ioctl(fd, LOGGER_SET_BATCHED_READ, 1) < 0) {
+		perror("logger: LOGGER_SET_BATCHED_READ");
+		st->corrupt++;
+		return;
+	}
+	for (;;) {
+		ssize_t ret = read(fd, buf, size);
+		ssize_t off = 0;
+
+		st->reads++;
+		if (ret < 0 && errno == EAGAIN) {
+			if (writers_done)
+				break;
+			usleep(1000);
+			continue;
+		}
+		if (ret < 0) {
+			perror("logger: read");
+			st->corrupt++;
+			break;
+		}
+		while (off < ret) {
+			struct logger_entry *e = (void *)(buf + off);
+			ssize_t len = sizeof(*e) + e->len;
+
+			if (off + len > ret)
+				len = ret - off;
+			check_entry(e, len, next_seq, st);
+			off += len;
+		}
+	}
+}
+
+/* copies 'len' bytes at position 'pos' out of the mapped ring */
+static void copy_ring(void *dst, const char *ring, uint32_t size,
+		      uint32_t pos, size_t len)
+{
+	size_t off = pos & (size - 1);
+	size_t first = len < size - off ? len : size - off;
+
+	memcpy(dst, ring + off, first);
+	memcpy((char *)dst + first, ring, len - first);
+}
+
+/* drains the log through a read-only mapping of the ring */
+static void map_log(int fd, unsigned int *next_seq, struct reader_stats *st)
+{
+	static char buf[LOGGER_ENTRY_MAX_LEN];
+	volatile struct logger_mmap_ctl *ctl;
+	long page = sysconf(_SC_PAGESIZE);
+	uint32_t size, pos;
+	const char *ring;
+	void *map;
+
+	size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	map = mmap(NULL, page + size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("logger: mmap");
+		st->corrupt++;
+		return;
+	}
+	ctl = map;
+	ring = (const char *)map + page;
+	pos = ctl->tail;
+	for (;;) {
+		struct logger_entry *e = (void *)buf;
+		uint32_t w_off = ctl->w_off;
+		uint16_t len;
+
+		st->reads++;
+		__sync_synchronize();
+		if (pos == w_off) {
+			if (writers_done)
+				break;
+			usleep(1000);
+			continue;
+		}
+		if ((int32_t)(pos - ctl->tail) < 0)
+			pos = ctl->tail;	/* lapped */
+		__sync_synchronize();
+		copy_ring(&len, ring, size, pos, sizeof(len));
+		if (sizeof(*e) + len > sizeof(buf))
+			continue;	/* torn, the tail check retries */
+		copy_ring(buf, ring, size, pos, sizeof(*e) + len);
+		__sync_synchronize();
+		if ((int32_t)(pos - ctl->tail) < 0)
+			continue;	/* overwritten while copied */
+		pos += sizeof(*e) + len;
+		check_entry(e, sizeof(*e) + e->len, next_seq, st);
+	}
+	munmap(map, page + size);
+}
+
+static void *reader_run(void *arg)
+{
+	struct reader_stats *st = arg;
+	unsigned int *next_seq = calloc(threads, sizeof(*next_seq));
+	int fd;
+
+	fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (fd < 0 || !next_seq) {
+		fprintf(stderr, "logger: cannot open %s for reading: %s\n",
+			device, strerror(errno));
+		st->corrupt++;
+		free(next_seq);
+		return NULL;
+	}
+	if (verify == 'm')
+		map_log(fd, next_seq, st);
+	else
+		read_log(fd, next_seq, st);
+	st->overwritten = ioctl(fd, LOGGER_GET_OVERWRITTEN);
+	close(fd);
+	free(next_seq);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	struct reader_stats st = { 0, 0, 0, 0, 0, -1 };
+	struct writer *writers;
+	pthread_t reader;
+	uint64_t *all, start, elapsed, sum = 0;
+	size_t total;
+	unsigned int i;
+	int failed = 0;
+	int opt, fd;
+	long size;
+
+	while ((opt = getopt(argc, argv, "d:n:t:s:rbm")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 's':
+			msg_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+		case 'b':
+		case 'm':
+			verify = opt;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] "
+				"[-n writes per thread] [-t threads] "
+				"[-s message size] [-r | -b | -m]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!iterations || !threads || threads > MAX_THREADS ||
+	    msg_size < 16 || msg_size > LOGGER_ENTRY_MAX_PAYLOAD / 2)
+		return 1;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "logger: cannot open %s: %s\n", device,
+			strerror(errno));
+		return 1;
+	}
+	size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	close(fd);
+
+	total = (size_t)iterations * threads;
+	writers = calloc(threads, sizeof(*writers));
+	all = malloc(total * sizeof(*all));
+	if (!writers || !all)
+		return 1;
+
+	if (verify)
+		pthread_create(&reader, NULL, reader_run, &st);
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		writers[i].index = i;
+		writers[i].latency = all + (size_t)i * iterations;
+		pthread_create(&writers[i].thread, NULL, writer_run,
+			       &writers[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		failed |= writers[i].failed;
+	}
+	elapsed = now_ns() - start;
+	writers_done = 1;
+	if (verify)
+		pthread_join(reader, NULL);
+	if (failed)
+		return 1;
+
+	qsort(all, total, sizeof(*all), cmp_u64);
+	for (i = 0; i < total; i++)
+		sum += all[i];
+	printf("%s, %ld byte log, %u threads x %u writes of %zu bytes\n",
+	       device, size, threads, iterations, msg_size);
+	printf(" avg(ns)  p50(ns)  p90(ns)  p99(ns)  max(ns)   writes/s\n");
+	printf("%8llu %8llu %8llu %8llu %8llu %10.0f\n",
+	       (unsigned long long)(sum / total),
+	       (unsigned long long)all[total / 2],
+	       (unsigned long long)all[total * 90 / 100],
+	       (unsigned long long)all[total * 99 / 100],
+	       (unsigned long long)all[total - 1],
+	       total * 1e9 / elapsed);
+	if (verify) {
+		printf("read %lu entries in %lu %s, %lu lost to overwrites, "
+		       "%lu corrupt, %lu out of order\n", st.entries, st.reads,
+		       verify == 'm' ? "polls" : "reads", st.lost,
+		       st.corrupt, st.reordered);
+		if (st.overwritten >= 0)
+			printf("driver counted %ld entries overwritten before "
+			       "they were read\n", st.overwritten);
+		if (st.corrupt || st.reordered)
+			return 1;
+	}
+	free(all);
+	free(writers);
+	return 0;
+}
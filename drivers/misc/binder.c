@@ -15,8 +15,34 @@
  *
  */
 
+/*
+ * Locking overview
+ *
+ * There is no global lock serializing binder operations. Instead:
+ *
+ * 1) proc->outer_lock (mutex): protects the refs_by_desc and refs_by_node
+ *    rbtrees of a process and the fields of the binder_refs in them.
+ * 2) node->lock (spinlock): protects node->proc, node->refs and, once the
+ *    owning process is gone, all other fields of a dead node.
+ * 3) proc->inner_lock (spinlock): protects the todo lists of a process and
+ *    its threads, the threads and nodes rbtrees, thread state and
+ *    transaction stacks, and the fields of the nodes owned by the process.
+ *
+ * Locks must be taken in the order above when nested. At most one
+ * inner_lock is held at a time. proc->alloc_lock (mutex) protects the
+ * buffer allocator of a process and is never held while taking any of
+ * the locks above. t->lock protects t->from and nests inside inner_lock.
+ *
+ * binder_procs_lock, binder_context_mgr_node_lock and
+ * binder_dead_nodes_lock protect the corresponding global state.
+ * binder_dead_nodes_lock nests inside node->lock.
+ */
+
 #include <asm/cacheflush.h>
+#ifdef CONFIG_CPU_CACHE_VIPT
 #include <asm/cachetype.h>
+#endif
+#include <linux/debugfs.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
@@ -30,12 +56,18 @@
 #include <linux/proc_fs.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/vmalloc.h>
 #include <linux/binder.h>
+#include <trace/binder.h>
 
-static DEFINE_MUTEX(binder_lock);
+static DEFINE_MUTEX(binder_procs_lock);
+static DEFINE_MUTEX(binder_context_mgr_node_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
@@ -43,13 +75,14 @@ static HLIST_HEAD(binder_dead_nodes);
 
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_root;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
+static atomic_t binder_lru_count;
 static struct workqueue_struct *binder_deferred_workqueue;
 
-static int binder_read_proc_proc(char *page, char **start, off_t off,
-				 int count, int *eof, void *data);
+static const struct file_operations binder_proc_fops;
 
 /* This is only defined in include/asm-arm/sizes.h */
 #ifndef SZ_1K
@@ -64,6 +97,19 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/*
+ * The top 1/(1 << BINDER_SLAB_AREA_SHIFT) of the mmap area is carved into
+ * one page slabs of fixed size slots for small transactions, the rest is
+ * managed by the best-fit allocator.
+ */
+#define BINDER_SLAB_AREA_SHIFT 3
+#define BINDER_SIZE_CLASS_COUNT 4
+
+/* payload sizes of the slab size classes, excluding the buffer header */
+static const size_t binder_size_classes[BINDER_SIZE_CLASS_COUNT] = {
+	32, 64, 128, 256
+};
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -89,6 +135,14 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/*
+ * Transactions have to wait this long on the proc todo list before
+ * additional looper threads are requested while others are still pending.
+ */
+static uint binder_spawn_backlog_us = 2000;
+module_param_named(spawn_backlog_us, binder_spawn_backlog_us, uint,
+		   S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -130,22 +184,95 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_RETIRE_LOOPER) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
+}
+
+enum binder_lock_class {
+	BINDER_LOCK_INNER,
+	BINDER_LOCK_OUTER,
+	BINDER_LOCK_NODE,
+	BINDER_LOCK_ALLOC,
+	BINDER_LOCK_COUNT
+};
+
+/* bucket n counts hold times below (256 << n) ns, the last one the rest */
+#define BINDER_LOCK_HIST_BUCKETS 16
+#define BINDER_LOCK_HIST_SHIFT   8
+
+struct binder_lock_stats {
+	atomic_t contended;
+	atomic_t hold_time[BINDER_LOCK_HIST_BUCKETS];
+};
+
+static struct binder_lock_stats binder_lock_stats[BINDER_LOCK_COUNT];
+
+static inline void binder_lock_contended(enum binder_lock_class class)
+{
+	atomic_inc(&binder_lock_stats[class].contended);
+}
+
+static inline int binder_hist_bucket(u64 ns, int shift, int buckets)
+{
+	int bucket = fls64(ns) - shift;
+
+	if (bucket < 0)
+		return 0;
+	if (bucket >= buckets)
+		return buckets - 1;
+	return bucket;
+}
+
+static inline void binder_lock_held(enum binder_lock_class class, u64 held)
+{
+	int bucket = binder_hist_bucket(held, BINDER_LOCK_HIST_SHIFT,
+					BINDER_LOCK_HIST_BUCKETS);
+
+	atomic_inc(&binder_lock_stats[class].hold_time[bucket]);
+}
+
+enum binder_latency_phase {
+	BINDER_LATENCY_WAKEUP,	/* send until the target thread woke up */
+	BINDER_LATENCY_READ,	/* send until the target read it */
+	BINDER_LATENCY_REPLY,	/* send until the reply was sent */
+	BINDER_LATENCY_COUNT
+};
+
+static const char *binder_latency_strings[] = {
+	"wakeup",
+	"read",
+	"reply"
+};
+
+/* bucket n counts latencies below (1024 << n) ns, the last one the rest */
+#define BINDER_LATENCY_HIST_BUCKETS 20
+#define BINDER_LATENCY_HIST_SHIFT   10
+
+struct binder_latency_stats {
+	atomic_t hist[BINDER_LATENCY_COUNT][BINDER_LATENCY_HIST_BUCKETS];
+};
+
+static inline void binder_latency_add(struct binder_latency_stats *ls,
+				      enum binder_latency_phase phase, u64 ns)
+{
+	int bucket = binder_hist_bucket(ns, BINDER_LATENCY_HIST_SHIFT,
+					BINDER_LATENCY_HIST_BUCKETS);
+
+	atomic_inc(&ls->hist[phase][bucket]);
 }
 
 struct binder_transaction_log_entry {
@@ -161,24 +288,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry))
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -194,8 +324,19 @@ struct binder_work {
 	} type;
 };
 
+/*
+ * A scheduling policy and the matching kernel priority (normal_prio of a
+ * task), so that lower values mean higher priority for every policy.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;
+	u64 lock_start;
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -206,6 +347,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -214,8 +356,11 @@ struct binder_node {
 	unsigned pending_weak_ref:1;
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
-	unsigned min_priority:8;
+	unsigned inherit_rt:1;
+	unsigned sched_policy:2;
+	int min_priority;
 	struct list_head async_todo;
+	struct binder_latency_stats latency;
 };
 
 struct binder_ref_death {
@@ -257,6 +402,26 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+struct binder_slab {
+	struct list_head entry; /* on the partial list of the size class */
+	struct list_head free;	/* free slots */
+	void *page;
+	int size_class;
+	int in_use;
+};
+
+struct binder_lru_page {
+	struct list_head lru;	/* on proc->lru_pages while free */
+	struct page *page_ptr;
+};
+
+struct binder_size_class {
+	struct list_head partial; /* slabs with free slots */
+	int slabs;
+	unsigned int hits;
+	unsigned int misses;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -273,28 +438,51 @@ struct binder_proc {
 	struct vm_area_struct *vma;
 	struct task_struct *tsk;
 	struct files_struct *files;
+	struct mutex files_lock;
 	struct hlist_node deferred_work_node;
 	int deferred_work;
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	spinlock_t inner_lock;
+	struct mutex outer_lock;
+	struct mutex alloc_lock;
+	u64 inner_lock_start;
+	u64 outer_lock_start;
+	u64 alloc_lock_start;
+	int tmp_ref;
+	int is_dead;
+
 	struct list_head buffers;
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
-
-	struct page **pages;
+	void *slab_area;
+	int slab_pages;
+	struct binder_slab **slabs;
+	struct binder_size_class size_classes[BINDER_SIZE_CLASS_COUNT];
+
+	struct binder_lru_page *pages;
+	struct list_head lru_pages;
+	int lru_count;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_latency_stats latency;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	unsigned long idle_timeout;	/* jiffies, 0 keeps idle loopers */
+	int todo_transactions;		/* transactions on todo */
+	u64 todo_since;			/* todo_transactions became non-zero */
+	int max_todo_transactions;
+	int backlog_spawns;
+	int retired_threads;
+	struct binder_priority default_priority;
 };
 
 enum {
@@ -303,7 +491,8 @@ enum {
 	BINDER_LOOPER_STATE_EXITED      = 0x04,
 	BINDER_LOOPER_STATE_INVALID     = 0x08,
 	BINDER_LOOPER_STATE_WAITING     = 0x10,
-	BINDER_LOOPER_STATE_NEED_RETURN = 0x20
+	BINDER_LOOPER_STATE_NEED_RETURN = 0x20,
+	BINDER_LOOPER_STATE_RETIRED     = 0x40
 };
 
 struct binder_thread {
@@ -319,6 +508,8 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	atomic_t tmp_ref;
+	int is_dead;
 };
 
 struct binder_transaction {
@@ -335,11 +526,111 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	u64	start_time;
+	/* tmp ref, set for transactions that are not replies */
+	struct binder_node *target_node;
+	spinlock_t lock;
 };
 
+static void binder_inner_proc_lock(struct binder_proc *proc)
+{
+	if (!spin_trylock(&proc->inner_lock)) {
+		binder_lock_contended(BINDER_LOCK_INNER);
+		spin_lock(&proc->inner_lock);
+	}
+	proc->inner_lock_start = sched_clock();
+}
+
+static void binder_inner_proc_unlock(struct binder_proc *proc)
+{
+	u64 held = sched_clock() - proc->inner_lock_start;
+
+	spin_unlock(&proc->inner_lock);
+	binder_lock_held(BINDER_LOCK_INNER, held);
+}
+
+static void binder_proc_lock(struct binder_proc *proc)
+{
+	if (!mutex_trylock(&proc->outer_lock)) {
+		binder_lock_contended(BINDER_LOCK_OUTER);
+		mutex_lock(&proc->outer_lock);
+	}
+	proc->outer_lock_start = sched_clock();
+}
+
+static void binder_proc_unlock(struct binder_proc *proc)
+{
+	u64 held = sched_clock() - proc->outer_lock_start;
+
+	mutex_unlock(&proc->outer_lock);
+	binder_lock_held(BINDER_LOCK_OUTER, held);
+}
+
+static void binder_alloc_lock(struct binder_proc *proc)
+{
+	if (!mutex_trylock(&proc->alloc_lock)) {
+		binder_lock_contended(BINDER_LOCK_ALLOC);
+		mutex_lock(&proc->alloc_lock);
+	}
+	proc->alloc_lock_start = sched_clock();
+}
+
+static int binder_alloc_trylock(struct binder_proc *proc)
+{
+	if (!mutex_trylock(&proc->alloc_lock))
+		return 0;
+	proc->alloc_lock_start = sched_clock();
+	return 1;
+}
+
+static void binder_alloc_unlock(struct binder_proc *proc)
+{
+	u64 held = sched_clock() - proc->alloc_lock_start;
+
+	mutex_unlock(&proc->alloc_lock);
+	binder_lock_held(BINDER_LOCK_ALLOC, held);
+}
+
+static void binder_node_lock(struct binder_node *node)
+{
+	if (!spin_trylock(&node->lock)) {
+		binder_lock_contended(BINDER_LOCK_NODE);
+		spin_lock(&node->lock);
+	}
+	node->lock_start = sched_clock();
+}
+
+static void binder_node_unlock(struct binder_node *node)
+{
+	u64 held = sched_clock() - node->lock_start;
+
+	spin_unlock(&node->lock);
+	binder_lock_held(BINDER_LOCK_NODE, held);
+}
+
+/*
+ * Takes node->lock and, while the node is alive, the inner lock of the
+ * process that owns it.
+ */
+static void binder_node_inner_lock(struct binder_node *node)
+{
+	binder_node_lock(node);
+	if (node->proc)
+		binder_inner_proc_lock(node->proc);
+}
+
+static void binder_node_inner_unlock(struct binder_node *node)
+{
+	struct binder_proc *proc = node->proc;
+
+	if (proc)
+		binder_inner_proc_unlock(proc);
+	binder_node_unlock(node);
+}
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
@@ -348,14 +639,18 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
  */
 int task_get_unused_fd_flags(struct binder_proc *proc, int flags)
 {
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	int fd, error;
 	struct fdtable *fdt;
 	unsigned long rlim_cur;
 	unsigned long irqs;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return -ESRCH;
+	}
 
 	error = -EMFILE;
 	spin_lock(&files->file_lock);
@@ -408,6 +703,7 @@ repeat:
 
 out:
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 	return error;
 }
 
@@ -417,17 +713,22 @@ out:
 static void task_fd_install(
 	struct binder_proc *proc, unsigned int fd, struct file *file)
 {
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	struct fdtable *fdt;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return;
+	}
 
 	spin_lock(&files->file_lock);
 	fdt = files_fdtable(files);
 	BUG_ON(fdt->fd[fd] != NULL);
 	rcu_assign_pointer(fdt->fd[fd], file);
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 }
 
 /*
@@ -447,12 +748,16 @@ static void __put_unused_fd(struct files_struct *files, unsigned int fd)
 static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 {
 	struct file *filp;
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	struct fdtable *fdt;
 	int retval;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return -ESRCH;
+	}
 
 	spin_lock(&files->file_lock);
 	fdt = files_fdtable(files);
@@ -466,6 +771,7 @@ static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 	__put_unused_fd(files, fd);
 	spin_unlock(&files->file_lock);
 	retval = filp_close(filp, files);
+	mutex_unlock(&proc->files_lock);
 
 	/* can't restart close syscall because file table entry was cleared */
 	if (unlikely(retval == -ERESTARTSYS ||
@@ -478,31 +784,170 @@ static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 
 out_unlock:
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 	return -EBADF;
 }
 
-static void binder_set_nice(long nice)
+#ifndef NICE_TO_PRIO
+#define NICE_TO_PRIO(nice)	(MAX_RT_PRIO + (nice) + 20)
+#define PRIO_TO_NICE(prio)	((prio) - MAX_RT_PRIO - 20)
+#endif
+
+static bool is_rt_policy(int policy)
 {
-	long min_nice;
-	if (can_nice(current, nice)) {
-		set_user_nice(current, nice);
-		return;
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static bool is_fair_policy(int policy)
+{
+	return policy == SCHED_NORMAL || policy == SCHED_BATCH;
+}
+
+static bool binder_supported_policy(int policy)
+{
+	return is_fair_policy(policy) || is_rt_policy(policy);
+}
+
+static int to_userspace_prio(int policy, int kernel_priority)
+{
+	if (is_fair_policy(policy))
+		return PRIO_TO_NICE(kernel_priority);
+	else
+		return MAX_USER_RT_PRIO - 1 - kernel_priority;
+}
+
+static int to_kernel_prio(int policy, int user_priority)
+{
+	if (is_fair_policy(policy))
+		return NICE_TO_PRIO(user_priority);
+	else
+		return MAX_USER_RT_PRIO - 1 - user_priority;
+}
+
+static struct binder_priority binder_current_priority(void)
+{
+	struct binder_priority prio;
+
+	if (binder_supported_policy(current->policy)) {
+		prio.sched_policy = current->policy;
+		prio.prio = current->normal_prio;
+	} else {
+		prio.sched_policy = SCHED_NORMAL;
+		prio.prio = NICE_TO_PRIO(0);
 	}
-	min_nice = 20 - current->signal->rlim[RLIMIT_NICE].rlim_cur;
-	binder_debug(BINDER_DEBUG_PRIORITY_CAP,
-		     "binder: %d: nice value %ld not allowed use "
-		     "%ld instead\n", current->pid, nice, min_nice);
-	set_user_nice(current, min_nice);
-	if (min_nice < 20)
+	return prio;
+}
+
+/*
+ * Switches the current thread to @desired. With @verify set the request
+ * is capped to what RLIMIT_RTPRIO and RLIMIT_NICE allow unless the
+ * thread has CAP_SYS_NICE; restoring a priority the thread had before
+ * is never capped.
+ */
+static void binder_do_set_priority(struct binder_priority desired,
+				   bool verify)
+{
+	int priority;
+	unsigned int policy = desired.sched_policy;
+	bool has_cap_nice;
+
+	if (current->policy == policy && current->normal_prio == desired.prio)
 		return;
-	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
+
+	has_cap_nice = capable(CAP_SYS_NICE);
+	priority = to_userspace_prio(policy, desired.prio);
+
+	if (verify && is_rt_policy(policy) && !has_cap_nice) {
+		long max_rtprio =
+			current->signal->rlim[RLIMIT_RTPRIO].rlim_cur;
+
+		if (max_rtprio == 0) {
+			policy = SCHED_NORMAL;
+			priority = -20;
+		} else if (priority > max_rtprio) {
+			priority = max_rtprio;
+		}
+	}
+
+	if (verify && is_fair_policy(policy) && !has_cap_nice) {
+		long min_nice =
+			20 - current->signal->rlim[RLIMIT_NICE].rlim_cur;
+
+		if (min_nice > 19) {
+			binder_user_error("binder: %d RLIMIT_NICE not set\n",
+					  current->pid);
+			return;
+		} else if (priority < min_nice) {
+			priority = min_nice;
+		}
+	}
+
+	if (policy != desired.sched_policy ||
+	    to_kernel_prio(policy, priority) != desired.prio)
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: priority %d not allowed, "
+			     "using %d instead\n", current->pid,
+			     desired.prio, to_kernel_prio(policy, priority));
+
+	if (current->policy != policy || is_rt_policy(policy)) {
+		struct sched_param params;
+
+		params.sched_priority = is_rt_policy(policy) ? priority : 0;
+		sched_setscheduler_nocheck(current, policy, &params);
+	}
+	if (is_fair_policy(policy))
+		set_user_nice(current, priority);
+}
+
+static void binder_set_priority(struct binder_priority desired)
+{
+	binder_do_set_priority(desired, true);
+}
+
+static void binder_restore_priority(struct binder_priority desired)
+{
+	binder_do_set_priority(desired, false);
+}
+
+/*
+ * Picks the priority the current thread runs @t with: the priority of
+ * the caller for synchronous transactions (its rt policy only if the
+ * node allows it) or the thread's own one for oneway transactions, but
+ * never below the minimum priority of the node.
+ */
+static void binder_transaction_priority(struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired;
+	struct binder_priority node_prio;
+
+	node_prio.sched_policy = node->sched_policy;
+	node_prio.prio = node->min_priority;
+
+	if (t->flags & TF_ONE_WAY) {
+		desired = t->saved_priority;
+	} else {
+		desired = t->priority;
+		if (!node->inherit_rt &&
+		    is_rt_policy(desired.sched_policy)) {
+			desired.sched_policy = SCHED_NORMAL;
+			desired.prio = NICE_TO_PRIO(0);
+		}
+	}
+
+	if (node_prio.prio < desired.prio ||
+	    (node_prio.prio == desired.prio &&
+	     node_prio.sched_policy == SCHED_FIFO))
+		desired = node_prio;
+
+	binder_set_priority(desired);
 }
 
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
 	if (list_is_last(&buffer->entry, &proc->buffers))
-		return proc->buffer + proc->buffer_size - (void *)buffer->data;
+		return proc->slab_area - (void *)buffer->data;
 	else
 		return (size_t)list_entry(buffer->entry.next,
 			struct binder_buffer, entry) - (size_t)buffer->data;
@@ -566,6 +1011,50 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 	rb_insert_color(&new_buffer->rb_node, &proc->allocated_buffers);
 }
 
+static size_t binder_slot_size(int size_class)
+{
+	return ALIGN(sizeof(struct binder_buffer) +
+		     binder_size_classes[size_class], sizeof(void *));
+}
+
+static int binder_size_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < BINDER_SIZE_CLASS_COUNT; i++)
+		if (size <= binder_size_classes[i])
+			return i;
+	return -1;
+}
+
+static struct binder_slab *binder_slot_slab(struct binder_proc *proc,
+					    struct binder_buffer *buffer)
+{
+	return proc->slabs[((void *)buffer - proc->slab_area) / PAGE_SIZE];
+}
+
+static struct binder_buffer *binder_slot_lookup(struct binder_proc *proc,
+						struct binder_buffer *kern_ptr)
+{
+	struct binder_slab *slab;
+	size_t offset, slot_size;
+	struct binder_buffer *buffer;
+
+	if ((void *)kern_ptr >= proc->buffer + proc->buffer_size)
+		return NULL;
+	slab = binder_slot_slab(proc, kern_ptr);
+	if (slab == NULL)
+		return NULL;
+	offset = (void *)kern_ptr - slab->page;
+	slot_size = binder_slot_size(slab->size_class);
+	if (offset % slot_size || offset + slot_size > PAGE_SIZE)
+		return NULL;
+	buffer = kern_ptr;
+	if (buffer->free)
+		return NULL;
+	return buffer;
+}
+
 static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 						  void __user *user_ptr)
 {
@@ -576,6 +1065,9 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	kern_ptr = user_ptr - proc->user_buffer_offset
 		- offsetof(struct binder_buffer, data);
 
+	if ((void *)kern_ptr >= proc->slab_area)
+		return binder_slot_lookup(proc, kern_ptr);
+
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
@@ -590,6 +1082,28 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_lru_add(struct binder_proc *proc,
+			   struct binder_lru_page *page)
+{
+	list_add(&page->lru, &proc->lru_pages);
+	proc->lru_count++;
+	atomic_inc(&binder_lru_count);
+}
+
+static void binder_lru_del(struct binder_proc *proc,
+			   struct binder_lru_page *page)
+{
+	list_del_init(&page->lru);
+	proc->lru_count--;
+	atomic_dec(&binder_lru_count);
+}
+
+/*
+ * Pages are populated when a buffer that covers them is allocated. When
+ * they become free they stay mapped on the per-proc lru so that the next
+ * allocation can reuse them without touching the mm, and are only
+ * unmapped and freed by binder_shrink() or when the proc goes away.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -597,8 +1111,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int need_mm = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -607,20 +1122,26 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
+	if (allocate == 0)
+		goto free_range;
 
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!page->page_ptr) {
+			need_mm = 1;
+			break;
+		}
 	}
 
-	if (allocate == 0)
-		goto free_range;
+	if (need_mm && !vma) {
+		mm = get_task_mm(proc->tsk);
+		if (mm) {
+			down_write(&mm->mmap_sem);
+			vma = proc->vma;
+		}
+	}
 
-	if (vma == NULL) {
+	if (need_mm && vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
 		goto err_no_vma;
@@ -631,16 +1152,20 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr) {
+			/* still mapped from an earlier use */
+			binder_lru_del(proc, page);
+			continue;
+		}
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -650,7 +1175,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -669,16 +1194,21 @@ free_range:
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		binder_lru_add(proc, page);
+	}
+	return 0;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
+	/* the pages set up so far stay mapped on the lru */
+	while (page_addr > start) {
+		page_addr -= PAGE_SIZE;
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		binder_lru_add(proc, page);
 	}
 err_no_vma:
 	if (mm) {
@@ -688,26 +1218,202 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * Unmaps and frees up to @nr_to_scan of the least recently freed pages of
+ * @proc. Called with proc->alloc_lock held.
+ */
+static int binder_shrink_proc(struct binder_proc *proc, int nr_to_scan)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
-	void *has_page_addr;
-	void *end_page_addr;
-	size_t size;
+	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	void *page_addr;
+	int freed = 0;
 
-	if (proc->vma == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
-		       proc->pid);
-		return NULL;
+	mm = get_task_mm(proc->tsk);
+	if (mm == NULL)
+		return 0;
+	if (!down_read_trylock(&mm->mmap_sem)) {
+		mmput(mm);
+		return 0;
+	}
+	while (freed < nr_to_scan && !list_empty(&proc->lru_pages)) {
+		page = list_entry(proc->lru_pages.prev,
+				  struct binder_lru_page, lru);
+		binder_lru_del(proc, page);
+		page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+		if (proc->vma)
+			zap_page_range(proc->vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+		freed++;
 	}
+	up_read(&mm->mmap_sem);
+	mmput(mm);
 
-	size = ALIGN(data_size, sizeof(void *)) +
-		ALIGN(offsets_size, sizeof(void *));
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: shrink freed %d pages\n", proc->pid, freed);
+	return freed;
+}
+
+/*
+ * binder_shrink - cache shrinker for the free pages of all binder procs
+ *
+ * 'nr_to_scan' is the number of pages to free, or 0 to query how many
+ * pages are on the lrus. Returns the number of pages left on the lrus, or
+ * -1 if we cannot proceed without risk of deadlock.
+ */
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+
+	if (!nr_to_scan)
+		return atomic_read(&binder_lru_count);
+	if (!mutex_trylock(&binder_procs_lock))
+		return -1;
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (nr_to_scan <= 0)
+			break;
+		if (!proc->lru_count || !binder_alloc_trylock(proc))
+			continue;
+		nr_to_scan -= binder_shrink_proc(proc, nr_to_scan);
+		binder_alloc_unlock(proc);
+	}
+	mutex_unlock(&binder_procs_lock);
+
+	return atomic_read(&binder_lru_count);
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS * 4,
+};
+
+static struct binder_slab *binder_new_slab(struct binder_proc *proc,
+					   int size_class)
+{
+	struct binder_slab *slab;
+	size_t slot_size = binder_slot_size(size_class);
+	void *page, *slot;
+	int i;
+
+	for (i = 0; i < proc->slab_pages; i++)
+		if (proc->slabs[i] == NULL)
+			break;
+	if (i == proc->slab_pages)
+		return NULL;
+
+	slab = kzalloc(sizeof(*slab), GFP_KERNEL);
+	if (slab == NULL)
+		return NULL;
+	page = proc->slab_area + i * PAGE_SIZE;
+	if (binder_update_page_range(proc, 1, page, page + PAGE_SIZE, NULL)) {
+		kfree(slab);
+		return NULL;
+	}
+	slab->page = page;
+	slab->size_class = size_class;
+	INIT_LIST_HEAD(&slab->free);
+	for (slot = page; slot + slot_size <= page + PAGE_SIZE;
+	     slot += slot_size) {
+		struct binder_buffer *buffer = slot;
+
+		buffer->free = 1;
+		list_add_tail(&buffer->entry, &slab->free);
+	}
+	list_add(&slab->entry, &proc->size_classes[size_class].partial);
+	proc->size_classes[size_class].slabs++;
+	proc->slabs[i] = slab;
+
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: new slab %p for size class %zd\n",
+		     proc->pid, page, binder_size_classes[size_class]);
+	return slab;
+}
+
+static void binder_free_slab(struct binder_proc *proc,
+			     struct binder_slab *slab)
+{
+	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+		     "binder: %d: free slab %p for size class %zd\n",
+		     proc->pid, slab->page,
+		     binder_size_classes[slab->size_class]);
+
+	list_del(&slab->entry);
+	proc->size_classes[slab->size_class].slabs--;
+	proc->slabs[(slab->page - proc->slab_area) / PAGE_SIZE] = NULL;
+	binder_update_page_range(proc, 0, slab->page,
+				 slab->page + PAGE_SIZE, NULL);
+	kfree(slab);
+}
+
+static struct binder_buffer *binder_alloc_slot(struct binder_proc *proc,
+					       int size_class)
+{
+	struct binder_size_class *sc = &proc->size_classes[size_class];
+	struct binder_slab *slab;
+	struct binder_buffer *buffer;
+
+	if (list_empty(&sc->partial)) {
+		slab = binder_new_slab(proc, size_class);
+		if (slab == NULL)
+			return NULL;
+	} else
+		slab = list_first_entry(&sc->partial, struct binder_slab,
+					entry);
+
+	buffer = list_first_entry(&slab->free, struct binder_buffer, entry);
+	list_del(&buffer->entry);
+	if (list_empty(&slab->free))
+		list_del_init(&slab->entry);
+	slab->in_use++;
+	buffer->free = 0;
+	return buffer;
+}
+
+static void binder_free_slot(struct binder_proc *proc,
+			     struct binder_buffer *buffer)
+{
+	struct binder_slab *slab = binder_slot_slab(proc, buffer);
+	struct binder_size_class *sc = &proc->size_classes[slab->size_class];
+
+	buffer->free = 1;
+	if (list_empty(&slab->free))
+		list_add(&slab->entry, &sc->partial);
+	list_add(&buffer->entry, &slab->free);
+	slab->in_use--;
+	/* keep the last partial slab of a class around for reuse */
+	if (slab->in_use == 0 && !list_is_singular(&sc->partial))
+		binder_free_slab(proc, slab);
+}
+
+static struct binder_buffer *binder_alloc_buf_locked(struct binder_proc *proc,
+						     size_t data_size,
+						     size_t offsets_size,
+						     int is_async)
+{
+	struct rb_node *n;
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+	struct rb_node *best_fit = NULL;
+	void *has_page_addr;
+	void *end_page_addr;
+	size_t size;
+	int size_class;
+
+	if (proc->vma == NULL) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
+		       proc->pid);
+		return NULL;
+	}
+	/* pairs with smp_wmb() in binder_mmap() */
+	smp_rmb();
+	n = proc->free_buffers.rb_node;
+
+	size = ALIGN(data_size, sizeof(void *)) +
+		ALIGN(offsets_size, sizeof(void *));
 
 	if (size < data_size || size < offsets_size) {
 		binder_user_error("binder: %d: got transaction with invalid "
@@ -723,6 +1429,19 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	size_class = binder_size_class(size);
+	if (size_class >= 0) {
+		buffer = binder_alloc_slot(proc, size_class);
+		if (buffer) {
+			proc->size_classes[size_class].hits++;
+			binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+				     "binder: %d: binder_alloc_buf size %zd "
+				     "got slot %p\n", proc->pid, size, buffer);
+			goto done;
+		}
+		proc->size_classes[size_class].misses++;
+	}
+
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
@@ -780,6 +1499,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
+done:
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
@@ -851,12 +1571,18 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void binder_free_buf_locked(struct binder_proc *proc,
+				   struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
+	int is_slot = (void *)buffer >= proc->slab_area;
 
-	buffer_size = binder_buffer_size(proc, buffer);
+	if (is_slot)
+		buffer_size = binder_slot_size(
+			binder_slot_slab(proc, buffer)->size_class) -
+			sizeof(*buffer);
+	else
+		buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
 		ALIGN(buffer->offsets_size, sizeof(void *));
@@ -880,6 +1606,11 @@ static void binder_free_buf(struct binder_proc *proc,
 			     proc->free_async_space);
 	}
 
+	if (is_slot) {
+		binder_free_slot(proc, buffer);
+		return;
+	}
+
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
@@ -906,8 +1637,29 @@ static void binder_free_buf(struct binder_proc *proc,
 	binder_insert_free_buffer(proc, buffer);
 }
 
-static struct binder_node *binder_get_node(struct binder_proc *proc,
-					   void __user *ptr)
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	binder_alloc_lock(proc);
+	buffer = binder_alloc_buf_locked(proc, data_size, offsets_size,
+					 is_async);
+	binder_alloc_unlock(proc);
+	return buffer;
+}
+
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	binder_alloc_lock(proc);
+	binder_free_buf_locked(proc, buffer);
+	binder_alloc_unlock(proc);
+}
+
+static struct binder_node *binder_get_node_ilocked(struct binder_proc *proc,
+						   void __user *ptr)
 {
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
@@ -919,15 +1671,34 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 			n = n->rb_left;
 		else if (ptr > node->ptr)
 			n = n->rb_right;
-		else
+		else {
+			/*
+			 * take a temporary reference so the node survives
+			 * until the caller is done with it
+			 */
+			node->tmp_refs++;
 			return node;
+		}
 	}
 	return NULL;
 }
 
-static struct binder_node *binder_new_node(struct binder_proc *proc,
-					   void __user *ptr,
-					   void __user *cookie)
+static struct binder_node *binder_get_node(struct binder_proc *proc,
+					   void __user *ptr)
+{
+	struct binder_node *node;
+
+	binder_inner_proc_lock(proc);
+	node = binder_get_node_ilocked(proc, ptr);
+	binder_inner_proc_unlock(proc);
+	return node;
+}
+
+static struct binder_node *binder_init_node_ilocked(
+						struct binder_proc *proc,
+						struct binder_node *new_node,
+						void __user *ptr,
+						void __user *cookie)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
@@ -941,23 +1712,28 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			/* lost a race against another thread of this proc */
+			node->tmp_refs++;
+			return node;
+		}
 	}
 
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
+	node->tmp_refs++;
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
+	spin_lock_init(&node->lock);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
 	node->work.type = BINDER_WORK_NODE;
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	node->sched_policy = SCHED_NORMAL;
+	node->min_priority = NICE_TO_PRIO(0);
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -965,8 +1741,36 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+/*
+ * Returns the node with a temporary reference held, the caller drops it
+ * with binder_put_node().
+ */
+static struct binder_node *binder_new_node(struct binder_proc *proc,
+					   void __user *ptr,
+					   void __user *cookie)
+{
+	struct binder_node *node;
+	struct binder_node *new_node = kzalloc(sizeof(*node), GFP_KERNEL);
+
+	if (new_node == NULL)
+		return NULL;
+	binder_inner_proc_lock(proc);
+	node = binder_init_node_ilocked(proc, new_node, ptr, cookie);
+	binder_inner_proc_unlock(proc);
+	if (node != new_node)
+		kfree(new_node);
+	return node;
+}
+
+static void binder_free_node(struct binder_node *node)
+{
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+static int binder_inc_node_nilocked(struct binder_node *node, int strong,
+				    int internal,
+				    struct list_head *target_list)
 {
 	if (strong) {
 		if (internal) {
@@ -1000,8 +1804,26 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
+{
+	int ret;
+
+	binder_node_inner_lock(node);
+	ret = binder_inc_node_nilocked(node, strong, internal, target_list);
+	binder_node_inner_unlock(node);
+	return ret;
+}
+
+/*
+ * Returns nonzero when the last reference is gone and the node has been
+ * unlinked; the caller frees it after dropping the locks.
+ */
+static int binder_dec_node_nilocked(struct binder_node *node,
+				    int strong, int internal)
 {
+	struct binder_proc *proc = node->proc;
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
@@ -1012,40 +1834,106 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
 			return 0;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			list_add_tail(&node->work.entry, &proc->todo);
+			wake_up_interruptible(&proc->wait);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
+		    !node->local_weak_refs && !node->tmp_refs) {
+			if (proc) {
+				list_del_init(&node->work.entry);
+				rb_erase(&node->rb_node, &proc->nodes);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: refless node %d deleted\n",
 					     node->debug_id);
 			} else {
+				BUG_ON(!list_empty(&node->work.entry));
+				spin_lock(&binder_dead_nodes_lock);
+				/* tmp_refs of dead nodes may change under us */
+				if (node->tmp_refs) {
+					spin_unlock(&binder_dead_nodes_lock);
+					return 0;
+				}
 				hlist_del(&node->dead_node);
+				spin_unlock(&binder_dead_nodes_lock);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			return 1;
 		}
 	}
 
 	return 0;
 }
 
+static void binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	int free_node;
+
+	binder_node_inner_lock(node);
+	free_node = binder_dec_node_nilocked(node, strong, internal);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+static void binder_inc_node_tmpref_ilocked(struct binder_node *node)
+{
+	node->tmp_refs++;
+}
 
-static struct binder_ref *binder_get_ref(struct binder_proc *proc,
-					 uint32_t desc)
+/*
+ * Temporary references keep a node alive while it is used without
+ * holding any lock. They are protected by the inner lock of the owning
+ * process, or by binder_dead_nodes_lock once the node is dead.
+ */
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	binder_node_lock(node);
+	if (node->proc)
+		binder_inner_proc_lock(node->proc);
+	else
+		spin_lock(&binder_dead_nodes_lock);
+	binder_inc_node_tmpref_ilocked(node);
+	if (node->proc)
+		binder_inner_proc_unlock(node->proc);
+	else
+		spin_unlock(&binder_dead_nodes_lock);
+	binder_node_unlock(node);
+}
+
+static void binder_dec_node_tmpref(struct binder_node *node)
+{
+	int free_node;
+
+	binder_node_inner_lock(node);
+	if (!node->proc)
+		spin_lock(&binder_dead_nodes_lock);
+	node->tmp_refs--;
+	BUG_ON(node->tmp_refs < 0);
+	if (!node->proc)
+		spin_unlock(&binder_dead_nodes_lock);
+	/* drops no reference, only frees the node if it became unused */
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+static void binder_put_node(struct binder_node *node)
+{
+	binder_dec_node_tmpref(node);
+}
+
+static struct binder_ref *binder_get_ref_olocked(struct binder_proc *proc,
+						 uint32_t desc)
 {
 	struct rb_node *n = proc->refs_by_desc.rb_node;
 	struct binder_ref *ref;
@@ -1063,8 +1951,9 @@ static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 	return NULL;
 }
 
-static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
-						  struct binder_node *node)
+static struct binder_ref *binder_get_ref_for_node_olocked(
+					struct binder_proc *proc,
+					struct binder_node *node)
 {
 	struct rb_node *n;
 	struct rb_node **p = &proc->refs_by_node.rb_node;
@@ -1086,7 +1975,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1114,24 +2003,22 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	}
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
-	if (node) {
-		hlist_add_head(&new_ref->node_entry, &node->refs);
 
-		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-			     "binder: %d new ref %d desc %d for "
-			     "node %d\n", proc->pid, new_ref->debug_id,
-			     new_ref->desc, node->debug_id);
-	} else {
-		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-			     "binder: %d new ref %d desc %d for "
-			     "dead node\n", proc->pid, new_ref->debug_id,
-			      new_ref->desc);
-	}
+	binder_node_inner_lock(node);
+	hlist_add_head(&new_ref->node_entry, &node->refs);
+	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+		     "binder: %d new ref %d desc %d for "
+		     "%snode %d\n", proc->pid, new_ref->debug_id,
+		     new_ref->desc, node->proc ? "" : "dead ",
+		     node->debug_id);
+	binder_node_inner_unlock(node);
 	return new_ref;
 }
 
-static void binder_delete_ref(struct binder_ref *ref)
+static void binder_delete_ref_olocked(struct binder_ref *ref)
 {
+	int free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
@@ -1139,16 +2026,24 @@ static void binder_delete_ref(struct binder_ref *ref)
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+
+	binder_node_inner_lock(ref->node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_nilocked(ref->node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_nilocked(ref->node, 0, 1);
+	binder_node_inner_unlock(ref->node);
+	if (free_node)
+		binder_free_node(ref->node);
+
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
+		binder_inner_proc_lock(ref->proc);
 		list_del(&ref->death->work.entry);
+		binder_inner_proc_unlock(ref->proc);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1156,8 +2051,8 @@ static void binder_delete_ref(struct binder_ref *ref)
 	binder_stats_deleted(BINDER_STAT_REF);
 }
 
-static int binder_inc_ref(struct binder_ref *ref, int strong,
-			  struct list_head *target_list)
+static int binder_inc_ref_olocked(struct binder_ref *ref, int strong,
+				  struct list_head *target_list)
 {
 	int ret;
 	if (strong) {
@@ -1179,7 +2074,7 @@ static int binder_inc_ref(struct binder_ref *ref, int strong,
 }
 
 
-static int binder_dec_ref(struct binder_ref *ref, int strong)
+static int binder_dec_ref_olocked(struct binder_ref *ref, int strong)
 {
 	if (strong) {
 		if (ref->strong == 0) {
@@ -1190,12 +2085,8 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 			return -EINVAL;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
@@ -1207,34 +2098,196 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 		ref->weak--;
 	}
 	if (ref->strong == 0 && ref->weak == 0)
-		binder_delete_ref(ref);
+		binder_delete_ref_olocked(ref);
 	return 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+/*
+ * Looks up the ref for @node in @proc, creating it if needed, and takes a
+ * strong or weak reference on it. The descriptor is returned in @desc.
+ */
+static int binder_inc_ref_for_node(struct binder_proc *proc,
+				   struct binder_node *node, int strong,
+				   struct list_head *target_list,
+				   uint32_t *desc, int *debug_id)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	struct binder_ref *ref;
+	int ret;
+
+	binder_proc_lock(proc);
+	ref = binder_get_ref_for_node_olocked(proc, node);
+	if (ref == NULL) {
+		binder_proc_unlock(proc);
+		return -ENOMEM;
+	}
+	ret = binder_inc_ref_olocked(ref, strong, target_list);
+	*desc = ref->desc;
+	if (debug_id)
+		*debug_id = ref->debug_id;
+	if (ret && ref->strong == 0 && ref->weak == 0)
+		binder_delete_ref_olocked(ref);
+	binder_proc_unlock(proc);
+	return ret;
+}
+
+/*
+ * Returns the node referenced by @desc in @proc with a temporary reference
+ * held, or NULL if there is no such ref.
+ */
+static struct binder_node *binder_get_node_from_ref(struct binder_proc *proc,
+						    uint32_t desc,
+						    int *ref_debug_id)
+{
+	struct binder_ref *ref;
+	struct binder_node *node = NULL;
+
+	binder_proc_lock(proc);
+	ref = binder_get_ref_olocked(proc, desc);
+	if (ref) {
+		node = ref->node;
+		binder_inc_node_tmpref(node);
+		if (ref_debug_id)
+			*ref_debug_id = ref->debug_id;
 	}
+	binder_proc_unlock(proc);
+	return node;
+}
+
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
+{
+	BUG_ON(!target_thread);
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	spin_lock(&t->lock);
+	t->from = NULL;
+	spin_unlock(&t->lock);
+}
+
+static void binder_dec_node_tmpref(struct binder_node *node);
+
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc = t->to_proc;
+	struct binder_node *target_node = t->target_node;
+
 	t->need_reply = 0;
-	if (t->buffer)
+	if (target_proc) {
+		binder_inner_proc_lock(target_proc);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		binder_inner_proc_unlock(target_proc);
+	} else if (t->buffer)
 		t->buffer->transaction = NULL;
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
+	if (target_node)
+		binder_dec_node_tmpref(target_node);
+}
+
+static void binder_txn_latency(struct binder_transaction *t,
+			       struct binder_proc *proc,
+			       enum binder_latency_phase phase, u64 now)
+{
+	/* sched_clock() is not synchronized between cpus */
+	u64 latency = now > t->start_time ? now - t->start_time : 0;
+
+	binder_latency_add(&proc->latency, phase, latency);
+	if (t->target_node)
+		binder_latency_add(&t->target_node->latency, phase, latency);
+
+	switch (phase) {
+	case BINDER_LATENCY_WAKEUP:
+		trace_binder_transaction_wakeup(t->debug_id, proc->pid,
+						latency);
+		break;
+	case BINDER_LATENCY_READ:
+		trace_binder_transaction_read(t->debug_id, proc->pid, latency);
+		break;
+	default:
+		trace_binder_transaction_reply(t->debug_id, proc->pid,
+					       latency);
+		break;
+	}
+}
+
+static void binder_free_thread(struct binder_thread *thread);
+static void binder_free_proc(struct binder_proc *proc);
+
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
+{
+	binder_inner_proc_lock(thread->proc);
+	atomic_dec(&thread->tmp_ref);
+	if (thread->is_dead && !atomic_read(&thread->tmp_ref)) {
+		binder_inner_proc_unlock(thread->proc);
+		binder_free_thread(thread);
+		return;
+	}
+	binder_inner_proc_unlock(thread->proc);
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	binder_inner_proc_lock(proc);
+	proc->tmp_ref--;
+	if (proc->is_dead && RB_EMPTY_ROOT(&proc->threads) &&
+	    !proc->tmp_ref) {
+		binder_inner_proc_unlock(proc);
+		binder_free_proc(proc);
+		return;
+	}
+	binder_inner_proc_unlock(proc);
+}
+
+/*
+ * Returns t->from with a temporary reference held, the caller drops it
+ * with binder_thread_dec_tmpref().
+ */
+static struct binder_thread *binder_get_txn_from(struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	spin_lock(&t->lock);
+	from = t->from;
+	if (from)
+		atomic_inc(&from->tmp_ref);
+	spin_unlock(&t->lock);
+	return from;
+}
+
+/*
+ * Like binder_get_txn_from(), but also returns with the inner lock of the
+ * sending process held if t->from is still set.
+ */
+static struct binder_thread *binder_get_txn_from_and_acq_inner(
+		struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	from = binder_get_txn_from(t);
+	if (!from)
+		return NULL;
+	binder_inner_proc_lock(from->proc);
+	if (t->from) {
+		BUG_ON(from != t->from);
+		return from;
+	}
+	binder_inner_proc_unlock(from->proc);
+	binder_thread_dec_tmpref(from);
+	return NULL;
 }
 
 static void binder_send_failed_reply(struct binder_transaction *t,
 				     uint32_t error_code)
 {
 	struct binder_thread *target_thread;
+	struct binder_transaction *next;
+
 	BUG_ON(t->flags & TF_ONE_WAY);
 	while (1) {
-		target_thread = t->from;
+		target_thread = binder_get_txn_from_and_acq_inner(t);
 		if (target_thread) {
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
@@ -1249,26 +2302,31 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					      t->debug_id, target_thread->proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				binder_inner_proc_unlock(target_thread->proc);
+				binder_thread_dec_tmpref(target_thread);
+				binder_free_transaction(t);
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
 					"already\n", target_thread->proc->pid,
 					target_thread->pid,
 					target_thread->return_error);
+				binder_inner_proc_unlock(target_thread->proc);
+				binder_thread_dec_tmpref(target_thread);
 			}
 			return;
 		} else {
-			struct binder_transaction *next = t->from_parent;
+			next = t->from_parent;
 
 			binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 				     "binder: send failed reply "
 				     "for transaction %d, target dead\n",
 				     t->debug_id);
 
-			binder_pop_transaction(target_thread, t);
+			binder_free_transaction(t);
 			if (next == NULL) {
 				binder_debug(BINDER_DEBUG_DEAD_BINDER,
 					     "binder: reply failed,"
@@ -1283,6 +2341,34 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	}
 }
 
+/*
+ * Changes the refcount of the ref with descriptor @desc in @proc. Returns
+ * -ENOENT if @proc has no such ref.
+ */
+static int binder_update_ref_for_handle(struct binder_proc *proc,
+					uint32_t desc, int increment,
+					int strong)
+{
+	struct binder_ref *ref;
+	int ret;
+
+	binder_proc_lock(proc);
+	ref = binder_get_ref_olocked(proc, desc);
+	if (ref == NULL) {
+		binder_proc_unlock(proc);
+		return -ENOENT;
+	}
+	binder_debug(BINDER_DEBUG_TRANSACTION,
+		     "        ref %d desc %d (node %d)\n",
+		     ref->debug_id, ref->desc, ref->node->debug_id);
+	if (increment)
+		ret = binder_inc_ref_olocked(ref, strong, NULL);
+	else
+		ret = binder_dec_ref_olocked(ref, strong);
+	binder_proc_unlock(proc);
+	return ret;
+}
+
 static void binder_transaction_buffer_release(struct binder_proc *proc,
 					      struct binder_buffer *buffer,
 					      size_t *failed_at)
@@ -1327,52 +2413,171 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
-			if (ref == NULL) {
+			if (binder_update_ref_for_handle(proc, fp->handle, 0,
+				fp->type == BINDER_TYPE_HANDLE) == -ENOENT)
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad handle %ld\n", debug_id,
 				       fp->handle);
-				break;
-			}
-			binder_debug(BINDER_DEBUG_TRANSACTION,
-				     "        ref %d desc %d (node %d)\n",
-				     ref->debug_id, ref->desc, ref->node->debug_id);
-			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
 		} break;
 
-		case BINDER_TYPE_FD:
-			binder_debug(BINDER_DEBUG_TRANSACTION,
-				     "        fd %ld\n", fp->handle);
-			if (failed_at)
-				task_close_fd(proc, fp->handle);
-			break;
+		case BINDER_TYPE_FD:
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        fd %ld\n", fp->handle);
+			if (failed_at)
+				task_close_fd(proc, fp->handle);
+			break;
+
+		default:
+			printk(KERN_ERR "binder: transaction release %d bad "
+			       "object type %lx\n", debug_id, fp->type);
+			break;
+		}
+	}
+}
+
+/*
+ * Takes a strong reference on @node for a new transaction and a temporary
+ * reference on the node and its process. Returns NULL if the node is dead.
+ */
+static struct binder_node *binder_get_node_refs_for_txn(
+		struct binder_node *node,
+		struct binder_proc **procp,
+		uint32_t *error)
+{
+	struct binder_node *target_node = NULL;
+
+	binder_node_inner_lock(node);
+	if (node->proc) {
+		target_node = node;
+		binder_inc_node_nilocked(node, 1, 0, NULL);
+		binder_inc_node_tmpref_ilocked(node);
+		node->proc->tmp_ref++;
+		*procp = node->proc;
+	} else
+		*error = BR_DEAD_REPLY;
+	binder_node_inner_unlock(node);
+
+	return target_node;
+}
+
+/*
+ * Queues @t on @thread, or on the process if @thread is NULL. Returns
+ * zero if the target process or thread died in the meantime.
+ */
+static int binder_proc_transaction(struct binder_transaction *t,
+				   struct binder_proc *proc,
+				   struct binder_thread *thread)
+{
+	struct binder_node *node = t->buffer->target_node;
+	int oneway = !!(t->flags & TF_ONE_WAY);
+	struct list_head *target_list;
+	wait_queue_head_t *target_wait;
+
+	BUG_ON(!node);
+	binder_node_lock(node);
+	binder_inner_proc_lock(proc);
+	if (proc->is_dead || (thread && thread->is_dead)) {
+		binder_inner_proc_unlock(proc);
+		binder_node_unlock(node);
+		return 0;
+	}
+	if (thread) {
+		target_list = &thread->todo;
+		target_wait = &thread->wait;
+	} else {
+		target_list = &proc->todo;
+		target_wait = &proc->wait;
+	}
+	if (oneway) {
+		BUG_ON(thread);
+		if (node->has_async_transaction) {
+			target_list = &node->async_todo;
+			target_wait = NULL;
+		} else
+			node->has_async_transaction = 1;
+	}
+	list_add_tail(&t->work.entry, target_list);
+	if (target_list == &proc->todo) {
+		if (!proc->todo_transactions++)
+			proc->todo_since = sched_clock();
+		if (proc->todo_transactions > proc->max_todo_transactions)
+			proc->max_todo_transactions = proc->todo_transactions;
+	}
+	if (target_wait)
+		wake_up_interruptible(target_wait);
+	binder_inner_proc_unlock(proc);
+	binder_node_unlock(node);
+	return 1;
+}
+
+/*
+ * Takes the minimum priority of a new node from the flags it is first
+ * sent with. Fair policies are all treated as SCHED_NORMAL and out of
+ * range priorities are clamped, so the customary 0x7f means no minimum.
+ */
+static void binder_node_set_priority(struct binder_node *node,
+				     unsigned long flags)
+{
+	int policy = (flags & FLAT_BINDER_FLAG_SCHED_POLICY_MASK) >>
+		FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT;
+	int priority = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
 
-		default:
-			printk(KERN_ERR "binder: transaction release %d bad "
-			       "object type %lx\n", debug_id, fp->type);
-			break;
-		}
+	if (is_rt_policy(policy)) {
+		priority = clamp(priority, 1, MAX_USER_RT_PRIO - 1);
+	} else {
+		policy = SCHED_NORMAL;
+		priority = clamp_t(int, (s8)priority, -20, 19);
+	}
+	node->sched_policy = policy;
+	node->min_priority = to_kernel_prio(policy, priority);
+	node->inherit_rt = !!(flags & FLAT_BINDER_FLAG_INHERIT_RT);
+}
+
+/*
+ * Gathers exactly @size bytes from the user iovecs at @uiov into @dst in a
+ * single pass, so the sender does not have to flatten its data first.
+ */
+static int binder_gather_from_user(void *dst,
+				   const struct iovec __user *uiov,
+				   size_t count, size_t size)
+{
+	struct iovec iov;
+	size_t i;
+
+	if (count > UIO_MAXIOV)
+		return -EINVAL;
+	for (i = 0; i < count; i++) {
+		if (copy_from_user(&iov, &uiov[i], sizeof(iov)))
+			return -EFAULT;
+		if (iov.iov_len > size)
+			return -EINVAL;
+		if (copy_from_user(dst, iov.iov_base, iov.iov_len))
+			return -EFAULT;
+		dst += iov.iov_len;
+		size -= iov.iov_len;
 	}
+	return size ? -EINVAL : 0;
 }
 
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       const struct iovec __user *data_iov,
+			       size_t data_iov_count)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
-	struct list_head *target_list;
-	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
-	uint32_t return_error;
+	uint32_t return_error = BR_OK;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1383,15 +2588,16 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		binder_inner_proc_lock(proc);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			binder_inner_proc_unlock(proc);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1401,12 +2607,15 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			binder_inner_proc_unlock(proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
-		target_thread = in_reply_to->from;
+		binder_inner_proc_unlock(proc);
+		binder_restore_priority(in_reply_to->saved_priority);
+		target_thread = binder_get_txn_from_and_acq_inner(in_reply_to);
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
@@ -1419,37 +2628,47 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			binder_inner_proc_unlock(target_thread->proc);
+			binder_thread_dec_tmpref(target_thread);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		target_proc->tmp_ref++;
+		binder_inner_proc_unlock(target_thread->proc);
 	} else {
 		if (tr->target.handle) {
-			struct binder_ref *ref;
-			ref = binder_get_ref(proc, tr->target.handle);
-			if (ref == NULL) {
+			struct binder_node *ref_node;
+
+			ref_node = binder_get_node_from_ref(proc,
+						tr->target.handle, NULL);
+			if (ref_node == NULL) {
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
 				return_error = BR_FAILED_REPLY;
 				goto err_invalid_target_handle;
 			}
-			target_node = ref->node;
+			target_node = binder_get_node_refs_for_txn(ref_node,
+					&target_proc, &return_error);
+			binder_put_node(ref_node);
 		} else {
+			mutex_lock(&binder_context_mgr_node_lock);
 			target_node = binder_context_mgr_node;
-			if (target_node == NULL) {
+			if (target_node)
+				target_node = binder_get_node_refs_for_txn(
+						target_node, &target_proc,
+						&return_error);
+			else
 				return_error = BR_DEAD_REPLY;
-				goto err_no_context_mgr_node;
-			}
+			mutex_unlock(&binder_context_mgr_node_lock);
 		}
-		e->to_node = target_node->debug_id;
-		target_proc = target_node->proc;
-		if (target_proc == NULL) {
-			return_error = BR_DEAD_REPLY;
+		if (target_node == NULL)
 			goto err_dead_binder;
-		}
+		e->to_node = target_node->debug_id;
+		binder_inner_proc_lock(proc);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
@@ -1461,24 +2680,29 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				binder_inner_proc_unlock(proc);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
 			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
+				struct binder_thread *from;
+
+				spin_lock(&tmp->lock);
+				from = tmp->from;
+				if (from && from->proc == target_proc) {
+					atomic_inc(&from->tmp_ref);
+					target_thread = from;
+					spin_unlock(&tmp->lock);
+					break;
+				}
+				spin_unlock(&tmp->lock);
 				tmp = tmp->from_parent;
 			}
 		}
+		binder_inner_proc_unlock(proc);
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1488,6 +2712,7 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_alloc_t_failed;
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION);
+	spin_lock_init(&t->lock);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
@@ -1496,8 +2721,12 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
+	t->start_time = sched_clock();
+	trace_binder_transaction_send(t->debug_id, reply, proc->pid,
+				      target_proc->pid,
+				      target_node ? target_node->debug_id : 0);
 
 	if (reply)
 		binder_debug(BINDER_DEBUG_TRANSACTION,
@@ -1525,7 +2754,7 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_current_priority();
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
@@ -1536,12 +2765,20 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (data_iov) {
+		if (binder_gather_from_user(t->buffer->data, data_iov,
+					    data_iov_count, tr->data_size)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid data iovecs\n", proc->pid,
+				thread->pid);
+			return_error = BR_FAILED_REPLY;
+			goto err_copy_data_failed;
+		}
+	} else if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				  tr->data_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"data ptr\n", proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
@@ -1576,16 +2813,21 @@ static void binder_transaction(struct binder_proc *proc,
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
 		case BINDER_TYPE_WEAK_BINDER: {
-			struct binder_ref *ref;
-			struct binder_node *node = binder_get_node(proc, fp->binder);
+			struct binder_node *node;
+			uint32_t desc;
+			int ref_debug_id;
+
+			node = binder_get_node(proc, fp->binder);
 			if (node == NULL) {
 				node = binder_new_node(proc, fp->binder, fp->cookie);
 				if (node == NULL) {
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+				binder_node_inner_lock(node);
+				binder_node_set_priority(node, fp->flags);
 				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+				binder_node_inner_unlock(node);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1593,10 +2835,14 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				binder_put_node(node);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
-			ref = binder_get_ref_for_node(target_proc, node);
-			if (ref == NULL) {
+			if (binder_inc_ref_for_node(target_proc, node,
+					fp->type == BINDER_TYPE_BINDER,
+					&thread->todo, &desc, &ref_debug_id)) {
+				binder_put_node(node);
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
@@ -1604,19 +2850,22 @@ static void binder_transaction(struct binder_proc *proc,
 				fp->type = BINDER_TYPE_HANDLE;
 			else
 				fp->type = BINDER_TYPE_WEAK_HANDLE;
-			fp->handle = ref->desc;
-			binder_inc_ref(ref, fp->type == BINDER_TYPE_HANDLE,
-				       &thread->todo);
+			fp->handle = desc;
 
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        node %d u%p -> ref %d desc %d\n",
-				     node->debug_id, node->ptr, ref->debug_id,
-				     ref->desc);
+				     node->debug_id, node->ptr, ref_debug_id,
+				     desc);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
-			if (ref == NULL) {
+			struct binder_node *node;
+			int ref_debug_id;
+
+			node = binder_get_node_from_ref(proc, fp->handle,
+							&ref_debug_id);
+			if (node == NULL) {
 				binder_user_error("binder: %d:%d got "
 					"transaction with invalid "
 					"handle, %ld\n", proc->pid,
@@ -1624,32 +2873,42 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_failed;
 			}
-			if (ref->node->proc == target_proc) {
+			binder_node_lock(node);
+			if (node->proc == target_proc) {
 				if (fp->type == BINDER_TYPE_HANDLE)
 					fp->type = BINDER_TYPE_BINDER;
 				else
 					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				fp->binder = node->ptr;
+				fp->cookie = node->cookie;
+				binder_inner_proc_lock(node->proc);
+				binder_inc_node_nilocked(node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
+				binder_inner_proc_unlock(node->proc);
+				binder_node_unlock(node);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
+					     "        ref %d desc %ld -> node %d u%p\n",
+					     ref_debug_id, fp->handle, node->debug_id,
+					     node->ptr);
 			} else {
-				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
-				if (new_ref == NULL) {
+				uint32_t desc;
+				int new_ref_debug_id;
+
+				binder_node_unlock(node);
+				if (binder_inc_ref_for_node(target_proc, node,
+						fp->type == BINDER_TYPE_HANDLE,
+						NULL, &desc,
+						&new_ref_debug_id)) {
+					binder_put_node(node);
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_get_ref_for_node_failed;
 				}
-				fp->handle = new_ref->desc;
-				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
 				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+					     "        ref %d desc %ld -> ref %d desc %d (node %d)\n",
+					     ref_debug_id, fp->handle, new_ref_debug_id,
+					     desc, node->debug_id);
+				fp->handle = desc;
 			}
+			binder_put_node(node);
 		} break;
 
 		case BINDER_TYPE_FD: {
@@ -1698,31 +2957,60 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	/*
+	 * Once queued, the transaction owns our tmp ref on target_node. It
+	 * is only set here so the error paths below can keep dropping it.
+	 */
+	t->target_node = target_node;
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	binder_inner_proc_lock(proc);
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	binder_inner_proc_unlock(proc);
+
 	if (reply) {
+		binder_inner_proc_lock(target_proc);
+		if (target_thread->is_dead) {
+			binder_inner_proc_unlock(target_proc);
+			goto err_dead_proc_or_thread;
+		}
 		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+		list_add_tail(&t->work.entry, &target_thread->todo);
+		wake_up_interruptible(&target_thread->wait);
+		binder_inner_proc_unlock(target_proc);
+		binder_txn_latency(in_reply_to, proc, BINDER_LATENCY_REPLY,
+				   t->start_time);
+		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		binder_inner_proc_lock(proc);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		binder_inner_proc_unlock(proc);
+		if (!binder_proc_transaction(t, target_proc, target_thread)) {
+			binder_inner_proc_lock(proc);
+			binder_pop_transaction_ilocked(thread, t);
+			binder_inner_proc_unlock(proc);
+			goto err_dead_proc_or_thread;
+		}
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
-		if (target_node->has_async_transaction) {
-			target_list = &target_node->async_todo;
-			target_wait = NULL;
-		} else
-			target_node->has_async_transaction = 1;
+		if (!binder_proc_transaction(t, target_proc, NULL))
+			goto err_dead_proc_or_thread;
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
+err_dead_proc_or_thread:
+	return_error = BR_DEAD_REPLY;
+	binder_inner_proc_lock(proc);
+	list_del_init(&tcomplete->entry);
+	binder_inner_proc_unlock(proc);
 err_get_unused_fd_failed:
 err_fget_failed:
 err_fd_not_allowed:
@@ -1733,6 +3021,10 @@ err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	/* the strong node ref went away with the buffer */
+	if (target_node)
+		binder_dec_node_tmpref(target_node);
+	target_node = NULL;
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
@@ -1746,7 +3038,15 @@ err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
-err_no_context_mgr_node:
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
+	if (target_node) {
+		binder_dec_node(target_node, 1, 0);
+		binder_dec_node_tmpref(target_node);
+	}
+
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1758,12 +3058,21 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	binder_inner_proc_lock(proc);
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		/* a failed reply raced in for an outgoing transaction */
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
 	BUG_ON(thread->return_error != BR_OK);
-	if (in_reply_to) {
+	if (in_reply_to)
 		thread->return_error = BR_TRANSACTION_COMPLETE;
-		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	else
 		thread->return_error = return_error;
+	binder_inner_proc_unlock(proc);
+	if (in_reply_to)
+		binder_send_failed_reply(in_reply_to, return_error);
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1778,9 +3087,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1789,16 +3098,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		case BC_DECREFS: {
 			uint32_t target;
 			struct binder_ref *ref;
+			struct binder_node *ctx_mgr_node = NULL;
 			const char *debug_string;
+			int ref_debug_id, node_debug_id;
+			uint32_t desc;
+			int ret;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (target == 0 && binder_context_mgr_node &&
+			if (target == 0 &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
-				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
-				if (ref->desc != target) {
+				mutex_lock(&binder_context_mgr_node_lock);
+				ctx_mgr_node = binder_context_mgr_node;
+				if (ctx_mgr_node)
+					binder_inc_node_tmpref(ctx_mgr_node);
+				mutex_unlock(&binder_context_mgr_node_lock);
+			}
+			binder_proc_lock(proc);
+			if (ctx_mgr_node) {
+				ref = binder_get_ref_for_node_olocked(proc,
+							ctx_mgr_node);
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1807,36 +3128,54 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						ref->desc);
 				}
 			} else
-				ref = binder_get_ref(proc, target);
+				ref = binder_get_ref_olocked(proc, target);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
+				if (ctx_mgr_node)
+					binder_put_node(ctx_mgr_node);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
 				break;
 			}
+			ref_debug_id = ref->debug_id;
+			node_debug_id = ref->node->debug_id;
+			desc = ref->desc;
 			switch (cmd) {
 			case BC_INCREFS:
 				debug_string = "IncRefs";
-				binder_inc_ref(ref, 0, NULL);
+				ret = binder_inc_ref_olocked(ref, 0, NULL);
 				break;
 			case BC_ACQUIRE:
 				debug_string = "Acquire";
-				binder_inc_ref(ref, 1, NULL);
+				ret = binder_inc_ref_olocked(ref, 1, NULL);
 				break;
 			case BC_RELEASE:
 				debug_string = "Release";
-				binder_dec_ref(ref, 1);
+				ret = binder_dec_ref_olocked(ref, 1);
 				break;
 			case BC_DECREFS:
 			default:
 				debug_string = "DecRefs";
-				binder_dec_ref(ref, 0);
+				ret = binder_dec_ref_olocked(ref, 0);
 				break;
 			}
-			binder_debug(BINDER_DEBUG_USER_REFS,
-				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
-				     proc->pid, thread->pid, debug_string, ref->debug_id,
-				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			/* ref is gone if the last reference was dropped */
+			if (ret == 0 && (cmd == BC_INCREFS || cmd == BC_ACQUIRE))
+				binder_debug(BINDER_DEBUG_USER_REFS,
+					     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
+					     proc->pid, thread->pid, debug_string, ref_debug_id,
+					     desc, ref->strong, ref->weak, node_debug_id);
+			else if (ret == 0)
+				binder_debug(BINDER_DEBUG_USER_REFS,
+					     "binder: %d:%d %s ref %d desc %d for node %d\n",
+					     proc->pid, thread->pid, debug_string, ref_debug_id,
+					     desc, node_debug_id);
+			else if (ref->strong == 0 && ref->weak == 0)
+				binder_delete_ref_olocked(ref);
+			binder_proc_unlock(proc);
+			if (ctx_mgr_node)
+				binder_put_node(ctx_mgr_node);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1870,8 +3209,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_put_node(node);
 				break;
 			}
+			binder_node_inner_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
 					binder_user_error("binder: %d:%d "
@@ -1879,6 +3220,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1889,16 +3232,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			binder_dec_node_nilocked(node, cmd == BC_ACQUIRE_DONE, 0);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_node_inner_unlock(node);
+			binder_put_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1916,35 +3263,48 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			binder_alloc_lock(proc);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				binder_alloc_unlock(proc);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				binder_alloc_unlock(proc);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* only one thread gets to free the buffer */
+			buffer->allow_user_free = 0;
+			binder_alloc_unlock(proc);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
 				     buffer->transaction ? "active" : "finished");
 
+			binder_inner_proc_lock(proc);
 			if (buffer->transaction) {
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			binder_inner_proc_unlock(proc);
 			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
+				struct binder_node *buf_node = buffer->target_node;
+
+				binder_node_inner_lock(buf_node);
+				BUG_ON(!buf_node->has_async_transaction);
+				BUG_ON(buf_node->proc != proc);
+				if (list_empty(&buf_node->async_todo))
+					buf_node->has_async_transaction = 0;
 				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+					list_move_tail(buf_node->async_todo.next, &thread->todo);
+				binder_node_inner_unlock(buf_node);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
@@ -1958,7 +3318,29 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   NULL, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			if (tr.data_iov == NULL) {
+				binder_user_error("binder: %d:%d %s without "
+					"data iovecs\n", proc->pid,
+					thread->pid, cmd == BC_REPLY_SG ?
+					"BC_REPLY_SG" : "BC_TRANSACTION_SG");
+				return -EINVAL;
+			}
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG,
+					   (const struct iovec __user *)
+					   tr.data_iov, tr.data_iov_count);
 			break;
 		}
 
@@ -1966,6 +3348,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1983,11 +3366,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			binder_inner_proc_unlock(proc);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -1996,12 +3381,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			binder_inner_proc_unlock(proc);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			binder_inner_proc_unlock(proc);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2009,7 +3397,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			uint32_t target;
 			void __user *cookie;
 			struct binder_ref *ref;
-			struct binder_ref_death *death;
+			struct binder_ref_death *death = NULL;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2017,8 +3405,25 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
-			ref = binder_get_ref(proc, target);
+			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+				/* allocate before taking the spinlocks below */
+				death = kzalloc(sizeof(*death), GFP_KERNEL);
+				if (death == NULL) {
+					binder_inner_proc_lock(proc);
+					thread->return_error = BR_ERROR;
+					binder_inner_proc_unlock(proc);
+					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+						     "binder: %d:%d "
+						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
+						     proc->pid, thread->pid);
+					break;
+				}
+			}
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, target);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
+				kfree(death);
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
 					proc->pid, thread->pid,
@@ -2038,6 +3443,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     cookie, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak, ref->node->debug_id);
 
+			binder_node_lock(ref->node);
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
 					binder_user_error("binder: %d:%"
@@ -2045,15 +3451,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
-					break;
-				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-						     "binder: %d:%d "
-						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
-						     proc->pid, thread->pid);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
+					kfree(death);
 					break;
 				}
 				binder_stats_created(BINDER_STAT_DEATH);
@@ -2062,12 +3462,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					binder_inner_proc_lock(proc);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
 						wake_up_interruptible(&proc->wait);
 					}
+					binder_inner_proc_unlock(proc);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2076,6 +3478,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
 					break;
 				}
 				death = ref->death;
@@ -2087,9 +3491,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
 					break;
 				}
 				ref->death = NULL;
+				binder_inner_proc_lock(proc);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
@@ -2102,7 +3509,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				binder_inner_proc_unlock(proc);
 			}
+			binder_node_unlock(ref->node);
+			binder_proc_unlock(proc);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
@@ -2112,6 +3522,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_inner_proc_lock(proc);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2123,6 +3534,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				binder_inner_proc_unlock(proc);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
@@ -2139,6 +3551,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					wake_up_interruptible(&proc->wait);
 				}
 			}
+			binder_inner_proc_unlock(proc);
 		} break;
 
 		default:
@@ -2155,9 +3568,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2174,6 +3587,96 @@ static int binder_has_thread_work(struct binder_thread *thread)
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+/*
+ * Like wait_event_interruptible_exclusive() on proc->wait, but looper
+ * threads that were spawned on request give up with -ETIMEDOUT once they
+ * have been idle for proc->idle_timeout.
+ */
+static int binder_wait_for_proc_work(struct binder_proc *proc,
+				     struct binder_thread *thread)
+{
+	DEFINE_WAIT(wait);
+	long timeout = MAX_SCHEDULE_TIMEOUT;
+	int ret = 0;
+
+	if (proc->idle_timeout &&
+	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
+			       BINDER_LOOPER_STATE_ENTERED)) ==
+	    BINDER_LOOPER_STATE_REGISTERED)
+		timeout = proc->idle_timeout;
+
+	for (;;) {
+		prepare_to_wait_exclusive(&proc->wait, &wait,
+					  TASK_INTERRUPTIBLE);
+		if (binder_has_proc_work(proc, thread))
+			break;
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		if (!timeout) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
+	}
+	finish_wait(&proc->wait, &wait);
+	return ret;
+}
+
+static int binder_put_node_cmd(struct binder_proc *proc,
+			       struct binder_thread *thread,
+			       void __user **ptrp,
+			       void __user *node_ptr,
+			       void __user *node_cookie,
+			       int node_debug_id,
+			       uint32_t cmd, const char *cmd_name)
+{
+	void __user *ptr = *ptrp;
+
+	if (put_user(cmd, (uint32_t __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(uint32_t);
+	if (put_user(node_ptr, (void * __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(void *);
+	if (put_user(node_cookie, (void * __user *)ptr))
+		return -EFAULT;
+	ptr += sizeof(void *);
+
+	binder_stat_br(proc, thread, cmd);
+	binder_debug(BINDER_DEBUG_USER_REFS,
+		     "binder: %d:%d %s %d u%p c%p\n",
+		     proc->pid, thread->pid, cmd_name, node_debug_id,
+		     node_ptr, node_cookie);
+
+	*ptrp = ptr;
+	return 0;
+}
+
+/*
+ * A new looper is requested when no thread is waiting for or about to
+ * start handling proc work, and additionally while transactions have
+ * been queued on proc->todo for longer than spawn_backlog_us without
+ * enough requested threads to take them.
+ */
+static int binder_need_looper_ilocked(struct binder_proc *proc)
+{
+	if (proc->ready_threads)
+		return 0;
+	if (proc->requested_threads == 0)
+		return proc->requested_threads_started < proc->max_threads;
+	if (proc->requested_threads >= proc->todo_transactions ||
+	    proc->requested_threads + proc->requested_threads_started >=
+	    proc->max_threads)
+		return 0;
+	if (sched_clock() - proc->todo_since <
+	    (u64)binder_spawn_backlog_us * NSEC_PER_USEC)
+		return 0;
+	proc->backlog_spawns++;
+	return 1;
+}
+
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
@@ -2184,6 +3687,8 @@ static int binder_thread_read(struct binder_proc *proc,
 
 	int ret = 0;
 	int wait_for_proc_work;
+	int retired = 0;
+	u64 wait_end = 0;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2192,22 +3697,32 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error2 = thread->return_error2;
+		uint32_t return_error = thread->return_error;
+
+		thread->return_error2 = BR_OK;
+		if (return_error2 != BR_OK &&
+		    end - ptr < 2 * sizeof(uint32_t))
+			return_error = BR_OK;	/* keep it for the next read */
+		else
+			thread->return_error = BR_OK;
+		binder_inner_proc_unlock(proc);
+
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(uint32_t);
+		}
+		if (return_error != BR_OK) {
+			if (put_user(return_error, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (ptr == end)
-				goto done;
-			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2215,7 +3730,12 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	if (wait_for_proc_work && (thread->looper & BINDER_LOOPER_STATE_RETIRED)) {
+		/* it did not exit after all, count it again */
+		thread->looper &= ~BINDER_LOOPER_STATE_RETIRED;
+		proc->requested_threads_started++;
+	}
+	binder_inner_proc_unlock(proc);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2226,12 +3746,12 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_restore_priority(proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
 		} else
-			ret = wait_event_interruptible_exclusive(proc->wait, binder_has_proc_work(proc, thread));
+			ret = binder_wait_for_proc_work(proc, thread);
 	} else {
 		if (non_block) {
 			if (!binder_has_thread_work(thread))
@@ -2239,10 +3759,32 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	wait_end = sched_clock();
+	binder_inner_proc_lock(proc);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	if (ret == -ETIMEDOUT) {
+		/* keep a waiting thread around so we do not respawn at once */
+		if (proc->ready_threads && list_empty(&proc->todo)) {
+			thread->looper |= BINDER_LOOPER_STATE_RETIRED;
+			proc->requested_threads_started--;
+			proc->retired_threads++;
+			retired = 1;
+		}
+		binder_inner_proc_unlock(proc);
+		if (!retired)
+			goto retry;
+		binder_debug(BINDER_DEBUG_THREADS,
+			     "binder: %d:%d BR_RETIRE_LOOPER\n",
+			     proc->pid, thread->pid);
+		if (put_user(BR_RETIRE_LOOPER, (uint32_t __user *)ptr))
+			return -EFAULT;
+		ptr += sizeof(uint32_t);
+		binder_stat_br(proc, thread, BR_RETIRE_LOOPER);
+		goto done;
+	}
+	binder_inner_proc_unlock(proc);
 
 	if (ret)
 		return ret;
@@ -2252,26 +3794,41 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		struct binder_thread *t_from;
+		int proc_work = 0;
 
+		binder_inner_proc_lock(proc);
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
-		else if (!list_empty(&proc->todo) && wait_for_proc_work)
+		else if (!list_empty(&proc->todo) && wait_for_proc_work) {
 			w = list_first_entry(&proc->todo, struct binder_work, entry);
-		else {
+			proc_work = 1;
+		} else {
+			binder_inner_proc_unlock(proc);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			binder_inner_proc_unlock(proc);
 			break;
+		}
+		/* the work item is ours once it is off the list */
+		list_del_init(&w->entry);
+		if (proc_work && w->type == BINDER_WORK_TRANSACTION)
+			proc->todo_transactions--;
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
+			binder_inner_proc_unlock(proc);
 			t = container_of(w, struct binder_transaction, work);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			binder_inner_proc_unlock(proc);
 			cmd = BR_TRANSACTION_COMPLETE;
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
@@ -2280,75 +3837,88 @@ retry:
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
-			uint32_t cmd = BR_NOOP;
-			const char *cmd_name;
-			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
-			if (weak && !node->has_weak_ref) {
-				cmd = BR_INCREFS;
-				cmd_name = "BR_INCREFS";
+			int strong, weak;
+			int has_strong_ref, has_weak_ref;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
+			void __user *orig_ptr = ptr;
+
+			strong = node->internal_strong_refs || node->local_strong_refs;
+			weak = !hlist_empty(&node->refs) || node->local_weak_refs ||
+				node->tmp_refs || strong;
+			has_strong_ref = node->has_strong_ref;
+			has_weak_ref = node->has_weak_ref;
+
+			if (weak && !has_weak_ref) {
 				node->has_weak_ref = 1;
 				node->pending_weak_ref = 1;
 				node->local_weak_refs++;
-			} else if (strong && !node->has_strong_ref) {
-				cmd = BR_ACQUIRE;
-				cmd_name = "BR_ACQUIRE";
+			}
+			if (strong && !has_strong_ref) {
 				node->has_strong_ref = 1;
 				node->pending_strong_ref = 1;
 				node->local_strong_refs++;
-			} else if (!strong && node->has_strong_ref) {
-				cmd = BR_RELEASE;
-				cmd_name = "BR_RELEASE";
+			}
+			if (!strong && has_strong_ref)
 				node->has_strong_ref = 0;
-			} else if (!weak && node->has_weak_ref) {
-				cmd = BR_DECREFS;
-				cmd_name = "BR_DECREFS";
+			if (!weak && has_weak_ref)
 				node->has_weak_ref = 0;
-			}
-			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-
-				binder_stat_br(proc, thread, cmd);
-				binder_debug(BINDER_DEBUG_USER_REFS,
-					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
-			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p deleted\n",
-						     proc->pid, thread->pid, node->debug_id,
-						     node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
-				} else {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p state unchanged\n",
-						     proc->pid, thread->pid, node->debug_id, node->ptr,
-						     node->cookie);
-				}
-			}
+			if (!weak && !strong) {
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p deleted\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
+				rb_erase(&node->rb_node, &proc->nodes);
+				binder_inner_proc_unlock(proc);
+				/*
+				 * Serialize with a thread that dropped the
+				 * last reference and may still be releasing
+				 * node->lock.
+				 */
+				binder_node_lock(node);
+				binder_node_unlock(node);
+				binder_free_node(node);
+			} else
+				binder_inner_proc_unlock(proc);
+
+			ret = 0;
+			if (weak && !has_weak_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id,
+						BR_INCREFS, "BR_INCREFS");
+			if (!ret && strong && !has_strong_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id,
+						BR_ACQUIRE, "BR_ACQUIRE");
+			if (!ret && !strong && has_strong_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id,
+						BR_RELEASE, "BR_RELEASE");
+			if (!ret && !weak && has_weak_ref)
+				ret = binder_put_node_cmd(proc, thread, &ptr,
+						node_ptr, node_cookie,
+						node_debug_id,
+						BR_DECREFS, "BR_DECREFS");
+			if (orig_ptr == ptr)
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p state unchanged\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
+			if (ret)
+				return ret;
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
@@ -2356,29 +3926,36 @@ retry:
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
+			cookie = death->cookie;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
+				binder_inner_proc_unlock(proc);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
+				list_add_tail(&w->entry, &proc->delivered_death);
+				binder_inner_proc_unlock(proc);
+			}
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_stat_br(proc, thread, cmd);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
 				     "binder: %d:%d %s %p\n",
 				      proc->pid, thread->pid,
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			binder_inner_proc_unlock(proc);
+			break;
 		}
 
 		if (!t)
@@ -2389,13 +3966,8 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			t->saved_priority = binder_current_priority();
+			binder_transaction_priority(t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2406,8 +3978,9 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
-		if (t->from) {
-			struct task_struct *sender = t->from->proc->tsk;
+		t_from = binder_get_txn_from(t);
+		if (t_from) {
+			struct task_struct *sender = t_from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
 							current->nsproxy->pid_ns);
 		} else {
@@ -2422,13 +3995,27 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
+		if (put_user(cmd, (uint32_t __user *)ptr)) {
+			if (t_from)
+				binder_thread_dec_tmpref(t_from);
 			return -EFAULT;
+		}
 		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
+		if (copy_to_user(ptr, &tr, sizeof(tr))) {
+			if (t_from)
+				binder_thread_dec_tmpref(t_from);
 			return -EFAULT;
+		}
 		ptr += sizeof(tr);
 
+		/* only a transaction we were waiting for counts as wakeup */
+		if (wait_end && wait_end > t->start_time) {
+			binder_txn_latency(t, proc, BINDER_LATENCY_WAKEUP,
+					   wait_end);
+		}
+		wait_end = 0;
+		binder_txn_latency(t, proc, BINDER_LATENCY_READ, sched_clock());
+
 		binder_stat_br(proc, thread, cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
@@ -2436,21 +4023,22 @@ retry:
 			     proc->pid, thread->pid,
 			     (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" :
 			     "BR_REPLY",
-			     t->debug_id, t->from ? t->from->proc->pid : 0,
-			     t->from ? t->from->pid : 0, cmd,
+			     t->debug_id, t_from ? t_from->proc->pid : 0,
+			     t_from ? t_from->pid : 0, cmd,
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		if (t_from)
+			binder_thread_dec_tmpref(t_from);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			binder_inner_proc_lock(thread->proc);
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			binder_inner_proc_unlock(thread->proc);
 		} else {
-			t->buffer->transaction = NULL;
-			kfree(t);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION);
+			binder_free_transaction(t);
 		}
 		break;
 	}
@@ -2458,27 +4046,42 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
-	if (proc->requested_threads + proc->ready_threads == 0 &&
-	    proc->requested_threads_started < proc->max_threads &&
-	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
-	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
-	     /*spawn a new thread if we leave this out */) {
+	if (retired)
+		return 0;
+	binder_inner_proc_lock(proc);
+	if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
+	      BINDER_LOOPER_STATE_ENTERED))) {
+		/* the user-space code fails to spawn a new thread */
+		binder_inner_proc_unlock(proc);
+		return 0;
+	}
+	if (binder_need_looper_ilocked(proc)) {
 		proc->requested_threads++;
+		binder_inner_proc_unlock(proc);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
-	}
+	} else
+		binder_inner_proc_unlock(proc);
 	return 0;
 }
 
-static void binder_release_work(struct list_head *list)
+static void binder_release_work(struct binder_proc *proc,
+				struct list_head *list)
 {
 	struct binder_work *w;
-	while (!list_empty(list)) {
+
+	while (1) {
+		binder_inner_proc_lock(proc);
+		if (list_empty(list)) {
+			binder_inner_proc_unlock(proc);
+			break;
+		}
 		w = list_first_entry(list, struct binder_work, entry);
 		list_del_init(&w->entry);
+		binder_inner_proc_unlock(proc);
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
 			struct binder_transaction *t;
@@ -2498,7 +4101,8 @@ static void binder_release_work(struct list_head *list)
 
 }
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+static struct binder_thread *binder_get_thread_ilocked(
+		struct binder_proc *proc, struct binder_thread *new_thread)
 {
 	struct binder_thread *thread = NULL;
 	struct rb_node *parent = NULL;
@@ -2513,38 +4117,85 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		else if (current->pid > thread->pid)
 			p = &(*p)->rb_right;
 		else
-			break;
+			return thread;
 	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
+	if (!new_thread)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	atomic_set(&thread->tmp_ref, 0);
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	binder_inner_proc_lock(proc);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	binder_inner_proc_unlock(proc);
+	if (!thread) {
+		new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+		if (new_thread == NULL)
 			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
+		binder_inner_proc_lock(proc);
+		thread = binder_get_thread_ilocked(proc, new_thread);
+		binder_inner_proc_unlock(proc);
+		if (thread != new_thread)
+			kfree(new_thread);
 	}
 	return thread;
 }
 
-static int binder_free_thread(struct binder_proc *proc,
-			      struct binder_thread *thread)
+static void binder_free_proc(struct binder_proc *proc)
+{
+	BUG_ON(!list_empty(&proc->todo));
+	BUG_ON(!list_empty(&proc->delivered_death));
+	put_task_struct(proc->tsk);
+	binder_stats_deleted(BINDER_STAT_PROC);
+	kfree(proc);
+}
+
+static void binder_free_thread(struct binder_thread *thread)
+{
+	BUG_ON(!list_empty(&thread->todo));
+	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_proc_dec_tmpref(thread->proc);
+	kfree(thread);
+}
+
+static int binder_thread_release(struct binder_proc *proc,
+				 struct binder_thread *thread)
 {
 	struct binder_transaction *t;
 	struct binder_transaction *send_reply = NULL;
+	struct binder_transaction *last_t;
 	int active_transactions = 0;
 
+	binder_inner_proc_lock(proc);
+	/* the thread and proc outlive the cleanup below */
+	proc->tmp_ref++;
+	atomic_inc(&thread->tmp_ref);
 	rb_erase(&thread->rb_node, &proc->threads);
+	thread->is_dead = 1;
 	t = thread->transaction_stack;
-	if (t && t->to_thread == thread)
-		send_reply = t;
+	if (t) {
+		spin_lock(&t->lock);
+		if (t->to_thread == thread)
+			send_reply = t;
+	}
 	while (t) {
+		last_t = t;
 		active_transactions++;
 		binder_debug(BINDER_DEBUG_DEAD_TRANSACTION,
 			     "binder: release %d:%d transaction %d "
@@ -2565,12 +4216,16 @@ static int binder_free_thread(struct binder_proc *proc,
 			t = t->from_parent;
 		} else
 			BUG();
+		spin_unlock(&last_t->lock);
+		if (t)
+			spin_lock(&t->lock);
 	}
+	binder_inner_proc_unlock(proc);
+
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_release_work(proc, &thread->todo);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2581,12 +4236,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL)
+		return POLLERR;
 
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2601,7 +4258,47 @@ static unsigned int binder_poll(struct file *filp,
 		if (binder_has_thread_work(thread))
 			return POLLIN;
 	}
-	return 0;
+	return 0;
+}
+
+static int binder_ioctl_set_ctx_mgr(struct binder_proc *proc)
+{
+	int ret = 0;
+	struct binder_node *new_node;
+
+	mutex_lock(&binder_context_mgr_node_lock);
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->euid,
+			       binder_context_mgr_uid);
+			ret = -EPERM;
+			goto out;
+		}
+	} else
+		binder_context_mgr_uid = current->euid;
+	new_node = binder_new_node(proc, NULL, NULL);
+	if (new_node == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	binder_node_inner_lock(new_node);
+	new_node->local_weak_refs++;
+	new_node->local_strong_refs++;
+	new_node->has_strong_ref = 1;
+	new_node->has_weak_ref = 1;
+	binder_context_mgr_node = new_node;
+	binder_node_inner_unlock(new_node);
+	binder_put_node(new_node);
+out:
+	mutex_unlock(&binder_context_mgr_node_lock);
+	return ret;
 }
 
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -2618,7 +4315,6 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2652,8 +4348,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			binder_inner_proc_lock(proc);
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
+			binder_inner_proc_unlock(proc);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2670,43 +4368,47 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		binder_inner_proc_lock(proc);
+		proc->max_threads = max_threads;
+		binder_inner_proc_unlock(proc);
 		break;
-	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
+	}
+	case BINDER_SET_IDLE_TIMEOUT: {
+		int64_t idle_timeout;
+
+		if (copy_from_user(&idle_timeout, ubuf,
+				   sizeof(idle_timeout)) ||
+		    idle_timeout < 0 ||
+		    idle_timeout > (int64_t)jiffies_to_msecs(MAX_JIFFY_OFFSET) *
+				   NSEC_PER_MSEC) {
+			ret = -EINVAL;
 			goto err;
 		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
+		/* in ns, rounded up so that a short timeout is not 0 */
+		binder_inner_proc_lock(proc);
+		proc->idle_timeout = idle_timeout ?
+			msecs_to_jiffies(div_u64(idle_timeout +
+						 NSEC_PER_MSEC - 1,
+						 NSEC_PER_MSEC)) : 0;
+		binder_inner_proc_unlock(proc);
+		break;
+	}
+	case BINDER_SET_CONTEXT_MGR:
+		ret = binder_ioctl_set_ctx_mgr(proc);
+		if (ret)
 			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
-		binder_free_thread(proc, thread);
+		binder_thread_release(proc, thread);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2719,15 +4421,33 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			goto err;
 		}
 		break;
+	case BINDER_VERSION_FEATURES: {
+		struct binder_version_features __user *vf = ubuf;
+
+		if (size != sizeof(struct binder_version_features)) {
+			ret = -EINVAL;
+			goto err;
+		}
+		if (put_user(BINDER_CURRENT_PROTOCOL_VERSION,
+			     &vf->protocol_version) ||
+		    put_user(BINDER_FEATURE_TRANSACTION_SG |
+			     BINDER_FEATURE_RETIRE_LOOPER, &vf->features)) {
+			ret = -EINVAL;
+			goto err;
+		}
+		break;
+	}
 	default:
 		ret = -EINVAL;
 		goto err;
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		binder_inner_proc_lock(proc);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		binder_inner_proc_unlock(proc);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2786,6 +4506,11 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	}
 	vma->vm_flags = (vma->vm_flags | VM_DONTCOPY) & ~VM_MAYWRITE;
 
+	/*
+	 * The caller holds mmap_sem, which nests inside alloc_lock in
+	 * binder_update_page_range(), so the allocator is set up without
+	 * alloc_lock and published by setting proc->vma last.
+	 */
 	if (proc->buffer) {
 		ret = -EBUSY;
 		failure_string = "already mapped";
@@ -2816,6 +4541,16 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	proc->slab_pages = (proc->buffer_size >> BINDER_SLAB_AREA_SHIFT) / PAGE_SIZE;
+	proc->slab_area = proc->buffer + proc->buffer_size -
+		proc->slab_pages * PAGE_SIZE;
+	proc->slabs = kzalloc(sizeof(proc->slabs[0]) * proc->slab_pages,
+			      GFP_KERNEL);
+	if (proc->slabs == NULL && proc->slab_pages) {
+		ret = -ENOMEM;
+		failure_string = "alloc slab array";
+		goto err_alloc_slabs_failed;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2831,8 +4566,11 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
-	barrier();
+	mutex_lock(&proc->files_lock);
 	proc->files = get_files_struct(current);
+	mutex_unlock(&proc->files_lock);
+	/* pairs with smp_rmb() in binder_alloc_buf_locked() */
+	smp_wmb();
 	proc->vma = vma;
 
 	/*printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p\n",
@@ -2840,6 +4578,9 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 
 err_alloc_small_buf_failed:
+	kfree(proc->slabs);
+	proc->slabs = NULL;
+err_alloc_slabs_failed:
 	kfree(proc->pages);
 	proc->pages = NULL;
 err_alloc_pages_failed:
@@ -2856,6 +4597,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2863,26 +4605,33 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc = kzalloc(sizeof(*proc), GFP_KERNEL);
 	if (proc == NULL)
 		return -ENOMEM;
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->outer_lock);
+	mutex_init(&proc->alloc_lock);
+	mutex_init(&proc->files_lock);
 	get_task_struct(current);
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
+	INIT_LIST_HEAD(&proc->lru_pages);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	proc->default_priority = binder_current_priority();
 	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
+	for (i = 0; i < BINDER_SIZE_CLASS_COUNT; i++)
+		INIT_LIST_HEAD(&proc->size_classes[i].partial);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
 		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
 		remove_proc_entry(strbuf, binder_proc_dir_entry_proc);
-		create_proc_read_entry(strbuf, S_IRUGO,
-				       binder_proc_dir_entry_proc,
-				       binder_read_proc_proc, proc);
+		proc_create_data(strbuf, S_IRUGO, binder_proc_dir_entry_proc,
+				 &binder_proc_fops, proc);
 	}
 
 	return 0;
@@ -2901,6 +4650,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2909,6 +4660,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	binder_inner_proc_unlock(proc);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2930,30 +4682,113 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
-static void binder_deferred_release(struct binder_proc *proc)
+/*
+ * Called with a temporary reference held on @node, which has already
+ * been removed from the nodes tree of its process. Either frees the node
+ * or moves it to binder_dead_nodes and drops the temporary reference.
+ */
+static int binder_node_release(struct binder_node *node, int refs)
 {
+	struct binder_ref *ref;
 	struct hlist_node *pos;
-	struct binder_transaction *t;
+	int death = 0;
+	struct binder_proc *proc = node->proc;
+
+	binder_release_work(proc, &node->async_todo);
+
+	binder_node_lock(node);
+	binder_inner_proc_lock(proc);
+	list_del_init(&node->work.entry);
+	BUG_ON(!node->tmp_refs);
+	if (hlist_empty(&node->refs) && node->tmp_refs == 1) {
+		binder_inner_proc_unlock(proc);
+		binder_node_unlock(node);
+		binder_free_node(node);
+		return refs;
+	}
+
+	node->proc = NULL;
+	node->local_strong_refs = 0;
+	node->local_weak_refs = 0;
+	binder_inner_proc_unlock(proc);
+
+	spin_lock(&binder_dead_nodes_lock);
+	hlist_add_head(&node->dead_node, &binder_dead_nodes);
+	spin_unlock(&binder_dead_nodes_lock);
+
+	hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
+		refs++;
+		binder_inner_proc_lock(ref->proc);
+		if (!ref->death) {
+			binder_inner_proc_unlock(ref->proc);
+			continue;
+		}
+		death++;
+		BUG_ON(!list_empty(&ref->death->work.entry));
+		ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+		list_add_tail(&ref->death->work.entry, &ref->proc->todo);
+		wake_up_interruptible(&ref->proc->wait);
+		binder_inner_proc_unlock(ref->proc);
+	}
+	binder_debug(BINDER_DEBUG_DEAD_BINDER,
+		     "binder: node %d now dead, "
+		     "refs %d, death %d\n", node->debug_id,
+		     refs, death);
+	binder_node_unlock(node);
+	binder_put_node(node);
+
+	return refs;
+}
+
+static void binder_release_buffer_transaction(struct binder_proc *proc,
+					      struct binder_buffer *buffer)
+{
+	struct binder_transaction *t = buffer->transaction;
+
+	if (t) {
+		t->buffer = NULL;
+		buffer->transaction = NULL;
+		printk(KERN_ERR "binder: release proc %d, "
+		       "transaction %d, not freed\n",
+		       proc->pid, t->debug_id);
+		/*BUG();*/
+	}
+}
+
+static void binder_deferred_release(struct binder_proc *proc)
+{
 	struct rb_node *n;
 	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int i;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
-	hlist_del(&proc->proc_node);
+	mutex_lock(&binder_procs_lock);
+	hlist_del_init(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+
+	mutex_lock(&binder_context_mgr_node_lock);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
 			     proc->pid);
 		binder_context_mgr_node = NULL;
 	}
+	mutex_unlock(&binder_context_mgr_node_lock);
 
+	binder_inner_proc_lock(proc);
+	/* keep proc alive until the end of this function */
+	proc->tmp_ref++;
+	proc->is_dead = 1;
 	threads = 0;
 	active_transactions = 0;
 	while ((n = rb_first(&proc->threads))) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
+		binder_inner_proc_unlock(proc);
 		threads++;
-		active_transactions += binder_free_thread(proc, thread);
+		active_transactions += binder_thread_release(proc, thread);
+		binder_inner_proc_lock(proc);
 	}
 	nodes = 0;
 	incoming_refs = 0;
@@ -2961,71 +4796,63 @@ static void binder_deferred_release(struct binder_proc *proc)
 		struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
 
 		nodes++;
+		binder_inc_node_tmpref_ilocked(node);
 		rb_erase(&node->rb_node, &proc->nodes);
-		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		} else {
-			struct binder_ref *ref;
-			int death = 0;
-
-			node->proc = NULL;
-			node->local_strong_refs = 0;
-			node->local_weak_refs = 0;
-			hlist_add_head(&node->dead_node, &binder_dead_nodes);
-
-			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-				incoming_refs++;
-				if (ref->death) {
-					death++;
-					if (list_empty(&ref->death->work.entry)) {
-						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
-					} else
-						BUG();
-				}
-			}
-			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: node %d now dead, "
-				     "refs %d, death %d\n", node->debug_id,
-				     incoming_refs, death);
-		}
+		binder_inner_proc_unlock(proc);
+		incoming_refs = binder_node_release(node, incoming_refs);
+		binder_inner_proc_lock(proc);
 	}
+	binder_inner_proc_unlock(proc);
+
 	outgoing_refs = 0;
+	binder_proc_lock(proc);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
 		outgoing_refs++;
-		binder_delete_ref(ref);
+		binder_delete_ref_olocked(ref);
 	}
-	binder_release_work(&proc->todo);
+	binder_proc_unlock(proc);
+	binder_release_work(proc, &proc->todo);
 	buffers = 0;
 
+	binder_alloc_lock(proc);
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			printk(KERN_ERR "binder: release proc %d, "
-			       "transaction %d, not freed\n",
-			       proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-		binder_free_buf(proc, buffer);
+		binder_release_buffer_transaction(proc, buffer);
+		binder_free_buf_locked(proc, buffer);
 		buffers++;
 	}
+	/* slab pages are freed with the rest below */
+	for (i = 0; i < proc->slab_pages; i++) {
+		struct binder_slab *slab = proc->slabs[i];
+		size_t slot_size;
+		void *slot;
 
-	binder_stats_deleted(BINDER_STAT_PROC);
+		if (slab == NULL)
+			continue;
+		slot_size = binder_slot_size(slab->size_class);
+		for (slot = slab->page; slot + slot_size <= slab->page + PAGE_SIZE;
+		     slot += slot_size) {
+			struct binder_buffer *buffer = slot;
+
+			if (buffer->free)
+				continue;
+			binder_release_buffer_transaction(proc, buffer);
+			buffers++;
+		}
+		kfree(slab);
+	}
+	/* a /proc/binder reader may still hold a tmp_ref on proc */
+	kfree(proc->slabs);
+	proc->slabs = NULL;
+	proc->slab_pages = 0;
 
 	page_count = 0;
 	if (proc->pages) {
-		int i;
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
@@ -3034,15 +4861,17 @@ static void binder_deferred_release(struct binder_proc *proc)
 					     page_addr);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
+		atomic_sub(proc->lru_count, &binder_lru_count);
+		proc->lru_count = 0;
 		kfree(proc->pages);
+		proc->pages = NULL;
 		vfree(proc->buffer);
 	}
-
-	put_task_struct(proc->tsk);
+	binder_alloc_unlock(proc);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
@@ -3051,7 +4880,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
 		     active_transactions, buffers, page_count);
 
-	kfree(proc);
+	binder_proc_dec_tmpref(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3061,7 +4890,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3077,9 +4905,11 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			mutex_lock(&proc->files_lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			mutex_unlock(&proc->files_lock);
 		}
 
 		if (defer & BINDER_DEFERRED_FLUSH)
@@ -3088,7 +4918,6 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3108,49 +4937,54 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer)
 	mutex_unlock(&binder_deferred_lock);
 }
 
-static char *print_binder_transaction(char *buf, char *end, const char *prefix,
-				      struct binder_transaction *t)
-{
-	buf += snprintf(buf, end - buf,
-			"%s %d: %p from %d:%d to %d:%d code %x "
-			"flags %x pri %ld r%d",
-			prefix, t->debug_id, t,
-			t->from ? t->from->proc->pid : 0,
-			t->from ? t->from->pid : 0,
-			t->to_proc ? t->to_proc->pid : 0,
-			t->to_thread ? t->to_thread->pid : 0,
-			t->code, t->flags, t->priority, t->need_reply);
-	if (buf >= end)
-		return buf;
-	if (t->buffer == NULL) {
-		buf += snprintf(buf, end - buf, " buffer free\n");
-		return buf;
+static void print_binder_transaction(struct seq_file *m, const char *prefix,
+				     struct binder_proc *proc,
+				     struct binder_transaction *t)
+{
+	struct binder_proc *to_proc;
+
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
+	seq_printf(m, "%s %d: %p from %d:%d to %d:%d code %x "
+		   "flags %x pri %d:%d r%d",
+		   prefix, t->debug_id, t,
+		   t->from ? t->from->proc->pid : 0,
+		   t->from ? t->from->pid : 0,
+		   to_proc ? to_proc->pid : 0,
+		   t->to_thread ? t->to_thread->pid : 0,
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
+	spin_unlock(&t->lock);
+	if (proc != to_proc) {
+		/* the buffer is only stable under the inner lock of to_proc */
+		seq_puts(m, "\n");
+		return;
 	}
-	if (t->buffer->target_node) {
-		buf += snprintf(buf, end - buf, " node %d",
-				t->buffer->target_node->debug_id);
-		if (buf >= end)
-			return buf;
+	if (t->buffer == NULL) {
+		seq_puts(m, " buffer free\n");
+		return;
 	}
-	buf += snprintf(buf, end - buf, " size %zd:%zd data %p\n",
-			t->buffer->data_size, t->buffer->offsets_size,
-			t->buffer->data);
-	return buf;
+	if (t->buffer->target_node)
+		seq_printf(m, " node %d", t->buffer->target_node->debug_id);
+	seq_printf(m, " size %zd:%zd data %p\n",
+		   t->buffer->data_size, t->buffer->offsets_size,
+		   t->buffer->data);
 }
 
-static char *print_binder_buffer(char *buf, char *end, const char *prefix,
-				 struct binder_buffer *buffer)
+static void print_binder_buffer(struct seq_file *m, const char *prefix,
+				struct binder_buffer *buffer)
 {
-	buf += snprintf(buf, end - buf, "%s %d: %p size %zd:%zd %s\n",
-			prefix, buffer->debug_id, buffer->data,
-			buffer->data_size, buffer->offsets_size,
-			buffer->transaction ? "active" : "delivered");
-	return buf;
+	seq_printf(m, "%s %d: %p size %zd:%zd %s\n",
+		   prefix, buffer->debug_id, buffer->data,
+		   buffer->data_size, buffer->offsets_size,
+		   buffer->transaction ? "active" : "delivered");
 }
 
-static char *print_binder_work(char *buf, char *end, const char *prefix,
-			       const char *transaction_prefix,
-			       struct binder_work *w)
+static void print_binder_work_ilocked(struct seq_file *m,
+				      struct binder_proc *proc,
+				      const char *prefix,
+				      const char *transaction_prefix,
+				      struct binder_work *w)
 {
 	struct binder_node *node;
 	struct binder_transaction *t;
@@ -3158,79 +4992,79 @@ static char *print_binder_work(char *buf, char *end, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		buf = print_binder_transaction(buf, end, transaction_prefix, t);
+		print_binder_transaction(m, transaction_prefix, proc, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
-		buf += snprintf(buf, end - buf,
-				"%stransaction complete\n", prefix);
+		seq_printf(m, "%stransaction complete\n", prefix);
 		break;
 	case BINDER_WORK_NODE:
 		node = container_of(w, struct binder_node, work);
-		buf += snprintf(buf, end - buf, "%snode work %d: u%p c%p\n",
-				prefix, node->debug_id, node->ptr,
-				node->cookie);
+		seq_printf(m, "%snode work %d: u%p c%p\n",
+			   prefix, node->debug_id, node->ptr, node->cookie);
 		break;
 	case BINDER_WORK_DEAD_BINDER:
-		buf += snprintf(buf, end - buf, "%shas dead binder\n", prefix);
+		seq_printf(m, "%shas dead binder\n", prefix);
 		break;
 	case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
-		buf += snprintf(buf, end - buf,
-				"%shas cleared dead binder\n", prefix);
+		seq_printf(m, "%shas cleared dead binder\n", prefix);
 		break;
 	case BINDER_WORK_CLEAR_DEATH_NOTIFICATION:
-		buf += snprintf(buf, end - buf,
-				"%shas cleared death notification\n", prefix);
+		seq_printf(m, "%shas cleared death notification\n", prefix);
 		break;
 	default:
-		buf += snprintf(buf, end - buf, "%sunknown work: type %d\n",
-				prefix, w->type);
+		seq_printf(m, "%sunknown work: type %d\n", prefix, w->type);
 		break;
 	}
-	return buf;
 }
 
-static char *print_binder_thread(char *buf, char *end,
-				 struct binder_thread *thread,
-				 int print_always)
+/*
+ * Drops everything printed since @start if nothing was added after the
+ * header that ended at @header. A full buffer is left alone so seq_read()
+ * still sees the overflow and retries with a larger one.
+ */
+static void binder_seq_drop_header(struct seq_file *m, size_t start,
+				   size_t header)
+{
+	if (m->count == header && m->count < m->size)
+		m->count = start;
+}
+
+static void print_binder_thread_ilocked(struct seq_file *m,
+					struct binder_thread *thread,
+					int print_always)
 {
 	struct binder_transaction *t;
 	struct binder_work *w;
-	char *start_buf = buf;
-	char *header_buf;
+	size_t start_pos = m->count;
+	size_t header_pos;
 
-	buf += snprintf(buf, end - buf, "  thread %d: l %02x\n",
-			thread->pid, thread->looper);
-	header_buf = buf;
+	seq_printf(m, "  thread %d: l %02x\n", thread->pid, thread->looper);
+	header_pos = m->count;
 	t = thread->transaction_stack;
 	while (t) {
-		if (buf >= end)
-			break;
 		if (t->from == thread) {
-			buf = print_binder_transaction(buf, end,
-						"    outgoing transaction", t);
+			print_binder_transaction(m, "    outgoing transaction",
+						 thread->proc, t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
-			buf = print_binder_transaction(buf, end,
-						"    incoming transaction", t);
+			print_binder_transaction(m, "    incoming transaction",
+						 thread->proc, t);
 			t = t->to_parent;
 		} else {
-			buf = print_binder_transaction(buf, end,
-						"    bad transaction", t);
+			print_binder_transaction(m, "    bad transaction",
+						 thread->proc, t);
 			t = NULL;
 		}
 	}
-	list_for_each_entry(w, &thread->todo, entry) {
-		if (buf >= end)
-			break;
-		buf = print_binder_work(buf, end, "    ",
-					"    pending transaction", w);
-	}
-	if (!print_always && buf == header_buf)
-		buf = start_buf;
-	return buf;
+	list_for_each_entry(w, &thread->todo, entry)
+		print_binder_work_ilocked(m, thread->proc, "    ",
+					  "    pending transaction", w);
+	if (!print_always)
+		binder_seq_drop_header(m, start_pos, header_pos);
 }
 
-static char *print_binder_node(char *buf, char *end, struct binder_node *node)
+static void print_binder_node_nilocked(struct seq_file *m,
+				       struct binder_node *node)
 {
 	struct binder_ref *ref;
 	struct hlist_node *pos;
@@ -3241,100 +5075,115 @@ static char *print_binder_node(char *buf, char *end, struct binder_node *node)
 	hlist_for_each_entry(ref, pos, &node->refs, node_entry)
 		count++;
 
-	buf += snprintf(buf, end - buf,
-			"  node %d: u%p c%p hs %d hw %d ls %d lw %d "
-			"is %d iw %d",
-			node->debug_id, node->ptr, node->cookie,
-			node->has_strong_ref, node->has_weak_ref,
-			node->local_strong_refs, node->local_weak_refs,
-			node->internal_strong_refs, count);
-	if (buf >= end)
-		return buf;
+	seq_printf(m, "  node %d: u%p c%p hs %d hw %d ls %d lw %d "
+		   "is %d iw %d tr %d",
+		   node->debug_id, node->ptr, node->cookie,
+		   node->has_strong_ref, node->has_weak_ref,
+		   node->local_strong_refs, node->local_weak_refs,
+		   node->internal_strong_refs, count, node->tmp_refs);
 	if (count) {
-		buf += snprintf(buf, end - buf, " proc");
-		if (buf >= end)
-			return buf;
-		hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-			buf += snprintf(buf, end - buf, " %d", ref->proc->pid);
-			if (buf >= end)
-				return buf;
-		}
-	}
-	buf += snprintf(buf, end - buf, "\n");
-	list_for_each_entry(w, &node->async_todo, entry) {
-		if (buf >= end)
-			break;
-		buf = print_binder_work(buf, end, "    ",
+		seq_puts(m, " proc");
+		hlist_for_each_entry(ref, pos, &node->refs, node_entry)
+			seq_printf(m, " %d", ref->proc->pid);
+	}
+	seq_puts(m, "\n");
+	if (node->proc) {
+		list_for_each_entry(w, &node->async_todo, entry)
+			print_binder_work_ilocked(m, node->proc, "    ",
 					"    pending async transaction", w);
 	}
-	return buf;
 }
 
-static char *print_binder_ref(char *buf, char *end, struct binder_ref *ref)
+static void print_binder_ref_olocked(struct seq_file *m,
+				     struct binder_ref *ref)
 {
-	buf += snprintf(buf, end - buf,
-			"  ref %d: desc %d %snode %d s %d w %d d %p\n",
-			ref->debug_id, ref->desc,
-			ref->node->proc ? "" : "dead ", ref->node->debug_id,
-			ref->strong, ref->weak, ref->death);
-	return buf;
+	binder_node_lock(ref->node);
+	seq_printf(m, "  ref %d: desc %d %snode %d s %d w %d d %p\n",
+		   ref->debug_id, ref->desc,
+		   ref->node->proc ? "" : "dead ", ref->node->debug_id,
+		   ref->strong, ref->weak, ref->death);
+	binder_node_unlock(ref->node);
 }
 
-static char *print_binder_proc(char *buf, char *end,
-			       struct binder_proc *proc, int print_all)
+static void print_binder_proc(struct seq_file *m,
+			      struct binder_proc *proc, int print_all)
 {
 	struct binder_work *w;
 	struct rb_node *n;
-	char *start_buf = buf;
-	char *header_buf;
-
-	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
-	header_buf = buf;
-
-	for (n = rb_first(&proc->threads);
-	     n != NULL && buf < end;
-	     n = rb_next(n))
-		buf = print_binder_thread(buf, end,
-					  rb_entry(n, struct binder_thread,
-						   rb_node), print_all);
-	for (n = rb_first(&proc->nodes);
-	     n != NULL && buf < end;
-	     n = rb_next(n)) {
+	size_t start_pos = m->count;
+	size_t header_pos;
+	struct binder_node *last_node = NULL;
+	int i;
+
+	seq_printf(m, "proc %d\n", proc->pid);
+	header_pos = m->count;
+
+	binder_inner_proc_lock(proc);
+	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
+		print_binder_thread_ilocked(m, rb_entry(n, struct binder_thread,
+						rb_node), print_all);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
 		struct binder_node *node = rb_entry(n, struct binder_node,
 						    rb_node);
-		if (print_all || node->has_async_transaction)
-			buf = print_binder_node(buf, end, node);
+		if (!print_all && !node->has_async_transaction)
+			continue;
+		/*
+		 * The temporary reference keeps the node in the tree while
+		 * the inner lock is dropped to take node->lock.
+		 */
+		binder_inc_node_tmpref_ilocked(node);
+		binder_inner_proc_unlock(proc);
+		if (last_node)
+			binder_put_node(last_node);
+		binder_node_inner_lock(node);
+		print_binder_node_nilocked(m, node);
+		binder_node_inner_unlock(node);
+		last_node = node;
+		binder_inner_proc_lock(proc);
 	}
+	binder_inner_proc_unlock(proc);
+	if (last_node)
+		binder_put_node(last_node);
 	if (print_all) {
-		for (n = rb_first(&proc->refs_by_desc);
-		     n != NULL && buf < end;
+		binder_proc_lock(proc);
+		for (n = rb_first(&proc->refs_by_desc); n != NULL;
 		     n = rb_next(n))
-			buf = print_binder_ref(buf, end,
-					       rb_entry(n, struct binder_ref,
+			print_binder_ref_olocked(m, rb_entry(n,
+							struct binder_ref,
 							rb_node_desc));
+		binder_proc_unlock(proc);
 	}
-	for (n = rb_first(&proc->allocated_buffers);
-	     n != NULL && buf < end;
-	     n = rb_next(n))
-		buf = print_binder_buffer(buf, end, "  buffer",
-					  rb_entry(n, struct binder_buffer,
-						   rb_node));
-	list_for_each_entry(w, &proc->todo, entry) {
-		if (buf >= end)
-			break;
-		buf = print_binder_work(buf, end, "  ",
-					"  pending transaction", w);
-	}
-	list_for_each_entry(w, &proc->delivered_death, entry) {
-		if (buf >= end)
-			break;
-		buf += snprintf(buf, end - buf,
-				"  has delivered dead binder\n");
-		break;
+	binder_alloc_lock(proc);
+	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
+		print_binder_buffer(m, "  buffer",
+				    rb_entry(n, struct binder_buffer, rb_node));
+	for (i = 0; i < proc->slab_pages; i++) {
+		struct binder_slab *slab = proc->slabs[i];
+		size_t slot_size;
+		void *slot;
+
+		if (slab == NULL)
+			continue;
+		slot_size = binder_slot_size(slab->size_class);
+		for (slot = slab->page;
+		     slot + slot_size <= slab->page + PAGE_SIZE;
+		     slot += slot_size) {
+			struct binder_buffer *buffer = slot;
+
+			if (!buffer->free)
+				print_binder_buffer(m, "  buffer", buffer);
+		}
 	}
-	if (!print_all && buf == header_buf)
-		buf = start_buf;
-	return buf;
+	binder_alloc_unlock(proc);
+	binder_inner_proc_lock(proc);
+	list_for_each_entry(w, &proc->todo, entry)
+		print_binder_work_ilocked(m, proc, "  ",
+					  "  pending transaction", w);
+	if (!list_empty(&proc->delivered_death))
+		seq_puts(m, "  has delivered dead binder\n");
+	binder_inner_proc_unlock(proc);
+	if (!print_all)
+		binder_seq_drop_header(m, start_pos, header_pos);
 }
 
 static const char *binder_return_strings[] = {
@@ -3355,7 +5204,8 @@ static const char *binder_return_strings[] = {
 	"BR_FINISHED",
 	"BR_DEAD_BINDER",
 	"BR_CLEAR_DEATH_NOTIFICATION_DONE",
-	"BR_FAILED_REPLY"
+	"BR_FAILED_REPLY",
+	"BR_RETIRE_LOOPER"
 };
 
 static const char *binder_command_strings[] = {
@@ -3375,7 +5225,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3388,30 +5240,36 @@ static const char *binder_objstat_strings[] = {
 	"transaction_complete"
 };
 
-static char *print_binder_stats(char *buf, char *end, const char *prefix,
-				struct binder_stats *stats)
+static const char *binder_lock_strings[] = {
+	"inner",
+	"outer",
+	"node",
+	"alloc"
+};
+
+static void print_binder_stats(struct seq_file *m, const char *prefix,
+			       struct binder_stats *stats)
 {
 	int i;
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 			ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
-			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_command_strings[i],
-					stats->bc[i]);
-		if (buf >= end)
-			return buf;
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
+			seq_printf(m, "%s%s: %d\n", prefix,
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 			ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
-			buf += snprintf(buf, end - buf, "%s%s: %d\n", prefix,
-					binder_return_strings[i], stats->br[i]);
-		if (buf >= end)
-			return buf;
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
+			seq_printf(m, "%s%s: %d\n", prefix,
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3419,51 +5277,94 @@ static char *print_binder_stats(char *buf, char *end, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 			ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
-			buf += snprintf(buf, end - buf,
-					"%s%s: active %d total %d\n", prefix,
-					binder_objstat_strings[i],
-					stats->obj_created[i] -
-						stats->obj_deleted[i],
-					stats->obj_created[i]);
-		if (buf >= end)
-			return buf;
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
+			seq_printf(m, "%s%s: active %d total %d\n", prefix,
+				   binder_objstat_strings[i],
+				   created - deleted, created);
+	}
+}
+
+static void print_binder_lock_stats(struct seq_file *m)
+{
+	int i, j;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_lock_strings) != BINDER_LOCK_COUNT);
+	seq_puts(m, "lock hold times:\n");
+	for (i = 0; i < BINDER_LOCK_COUNT; i++) {
+		struct binder_lock_stats *ls = &binder_lock_stats[i];
+
+		seq_printf(m, "  %s: contended %d\n", binder_lock_strings[i],
+			   atomic_read(&ls->contended));
+		for (j = 0; j < BINDER_LOCK_HIST_BUCKETS; j++) {
+			int temp = atomic_read(&ls->hold_time[j]);
+
+			if (!temp)
+				continue;
+			if (j == BINDER_LOCK_HIST_BUCKETS - 1)
+				seq_printf(m, "    >=%luns: %d\n",
+					1UL << (BINDER_LOCK_HIST_SHIFT + j - 1),
+					temp);
+			else
+				seq_printf(m, "    <%luns: %d\n",
+					1UL << (BINDER_LOCK_HIST_SHIFT + j),
+					temp);
+		}
 	}
-	return buf;
 }
 
-static char *print_binder_proc_stats(char *buf, char *end,
-				     struct binder_proc *proc)
+static void print_binder_proc_stats(struct seq_file *m,
+				    struct binder_proc *proc)
 {
 	struct binder_work *w;
 	struct rb_node *n;
 	int count, strong, weak;
+	int ready_threads, requested_threads, requested_threads_started;
+	int max_threads;
+	int todo_transactions, max_todo_transactions;
+	int backlog_spawns, retired_threads;
+	int i;
+	size_t free_async_space;
 
-	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
-	if (buf >= end)
-		return buf;
+	seq_printf(m, "proc %d\n", proc->pid);
 	count = 0;
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
-	buf += snprintf(buf, end - buf, "  threads: %d\n", count);
-	if (buf >= end)
-		return buf;
-	buf += snprintf(buf, end - buf, "  requested threads: %d+%d/%d\n"
-			"  ready threads %d\n"
-			"  free async space %zd\n", proc->requested_threads,
-			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
-	if (buf >= end)
-		return buf;
+	ready_threads = proc->ready_threads;
+	requested_threads = proc->requested_threads;
+	requested_threads_started = proc->requested_threads_started;
+	max_threads = proc->max_threads;
+	todo_transactions = proc->todo_transactions;
+	max_todo_transactions = proc->max_todo_transactions;
+	backlog_spawns = proc->backlog_spawns;
+	retired_threads = proc->retired_threads;
+	binder_inner_proc_unlock(proc);
+	binder_alloc_lock(proc);
+	free_async_space = proc->free_async_space;
+	binder_alloc_unlock(proc);
+	seq_printf(m, "  threads: %d\n", count);
+	seq_printf(m, "  requested threads: %d+%d/%d\n"
+		   "  ready threads %d\n"
+		   "  free async space %zd\n", requested_threads,
+		   requested_threads_started, max_threads,
+		   ready_threads, free_async_space);
+	seq_printf(m, "  todo transactions %d max %d\n"
+		   "  backlog spawns %d retired threads %d\n",
+		   todo_transactions, max_todo_transactions,
+		   backlog_spawns, retired_threads);
 	count = 0;
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
-	buf += snprintf(buf, end - buf, "  nodes: %d\n", count);
-	if (buf >= end)
-		return buf;
+	binder_inner_proc_unlock(proc);
+	seq_printf(m, "  nodes: %d\n", count);
 	count = 0;
 	strong = 0;
 	weak = 0;
+	binder_proc_lock(proc);
 	for (n = rb_first(&proc->refs_by_desc); n != NULL; n = rb_next(n)) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
@@ -3471,19 +5372,21 @@ static char *print_binder_proc_stats(char *buf, char *end,
 		strong += ref->strong;
 		weak += ref->weak;
 	}
-	buf += snprintf(buf, end - buf, "  refs: %d s %d w %d\n",
-			count, strong, weak);
-	if (buf >= end)
-		return buf;
+	binder_proc_unlock(proc);
+	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	binder_alloc_lock(proc);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
-	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
-	if (buf >= end)
-		return buf;
+	for (i = 0; i < proc->slab_pages; i++)
+		if (proc->slabs[i])
+			count += proc->slabs[i]->in_use;
+	binder_alloc_unlock(proc);
+	seq_printf(m, "  buffers: %d\n", count);
 
 	count = 0;
+	binder_inner_proc_lock(proc);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3493,223 +5396,374 @@ static char *print_binder_proc_stats(char *buf, char *end,
 			break;
 		}
 	}
-	buf += snprintf(buf, end - buf, "  pending transactions: %d\n", count);
-	if (buf >= end)
-		return buf;
+	binder_inner_proc_unlock(proc);
+	seq_printf(m, "  pending transactions: %d\n", count);
 
-	buf = print_binder_stats(buf, end, "  ", &proc->stats);
-
-	return buf;
+	print_binder_stats(m, "  ", &proc->stats);
 }
 
-
-static int binder_read_proc_state(char *page, char **start, off_t off,
-				  int count, int *eof, void *data)
+static void print_binder_size_classes(struct seq_file *m,
+				      struct binder_proc *proc)
 {
-	struct binder_proc *proc;
-	struct hlist_node *pos;
-	struct binder_node *node;
-	int len = 0;
-	char *buf = page;
-	char *end = page + PAGE_SIZE;
-	int do_lock = !binder_debug_no_lock;
-
-	if (off)
-		return 0;
-
-	if (do_lock)
-		mutex_lock(&binder_lock);
+	int i;
 
-	buf += snprintf(buf, end - buf, "binder state:\n");
+	binder_alloc_lock(proc);
+	for (i = 0; i < BINDER_SIZE_CLASS_COUNT; i++) {
+		struct binder_size_class *sc = &proc->size_classes[i];
 
-	if (!hlist_empty(&binder_dead_nodes))
-		buf += snprintf(buf, end - buf, "dead nodes:\n");
-	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
-		if (buf >= end)
-			break;
-		buf = print_binder_node(buf, end, node);
+		seq_printf(m, "  size class %zd: slabs %d hits %u misses %u\n",
+			   binder_size_classes[i], sc->slabs, sc->hits,
+			   sc->misses);
 	}
+	seq_printf(m, "  lru pages: %d\n", proc->lru_count);
+	binder_alloc_unlock(proc);
+}
 
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
-		if (buf >= end)
-			break;
-		buf = print_binder_proc(buf, end, proc, 1);
+static void print_binder_latency(struct seq_file *m, const char *prefix,
+				 struct binder_latency_stats *ls)
+{
+	int i, j;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_latency_strings) !=
+		     BINDER_LATENCY_COUNT);
+	for (i = 0; i < BINDER_LATENCY_COUNT; i++) {
+		int printed = 0;
+
+		for (j = 0; j < BINDER_LATENCY_HIST_BUCKETS; j++) {
+			int temp = atomic_read(&ls->hist[i][j]);
+
+			if (!temp)
+				continue;
+			if (!printed++)
+				seq_printf(m, "%s%s:", prefix,
+					   binder_latency_strings[i]);
+			if (j == BINDER_LATENCY_HIST_BUCKETS - 1)
+				seq_printf(m, " >=%luns %d",
+					1UL << (BINDER_LATENCY_HIST_SHIFT +
+						j - 1), temp);
+			else
+				seq_printf(m, " <%luns %d",
+					1UL << (BINDER_LATENCY_HIST_SHIFT + j),
+					temp);
+		}
+		if (printed)
+			seq_puts(m, "\n");
 	}
-	if (do_lock)
-		mutex_unlock(&binder_lock);
-	if (buf > page + PAGE_SIZE)
-		buf = page + PAGE_SIZE;
-
-	*start = page + off;
+}
 
-	len = buf - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	struct rb_node *n;
+	size_t start_pos = m->count;
+	size_t header_pos;
+
+	seq_printf(m, "proc %d\n", proc->pid);
+	header_pos = m->count;
+	print_binder_latency(m, "  ", &proc->latency);
+	binder_inner_proc_lock(proc);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
+		size_t node_pos = m->count;
+		size_t node_header_pos;
+
+		seq_printf(m, "  node %d\n", node->debug_id);
+		node_header_pos = m->count;
+		print_binder_latency(m, "    ", &node->latency);
+		/* nodes that have not been called are left out */
+		binder_seq_drop_header(m, node_pos, node_header_pos);
+	}
+	binder_inner_proc_unlock(proc);
+	/* so is a proc that has not seen a transaction */
+	binder_seq_drop_header(m, start_pos, header_pos);
+}
 
-	return len < count ? len  : count;
+/*
+ * state, stats, transactions and the debugfs latency file walk
+ * binder_procs one record per proc. Each proc is pinned with tmp_ref and
+ * binder_procs_lock is only held to step from one proc to the next, so a
+ * reader never blocks binder_open or binder_release for longer than that,
+ * and seq_read() can retry a record that does not fit with a larger
+ * buffer instead of truncating the output. Position 0 is the file header.
+ */
+static struct binder_proc *binder_seq_pin_proc(struct binder_proc *proc)
+{
+	if (proc) {
+		binder_inner_proc_lock(proc);
+		proc->tmp_ref++;
+		binder_inner_proc_unlock(proc);
+	}
+	return proc;
 }
 
-static int binder_read_proc_stats(char *page, char **start, off_t off,
-				  int count, int *eof, void *data)
+static struct binder_proc *binder_seq_get_proc(struct binder_proc *prev,
+					       loff_t index)
 {
-	struct binder_proc *proc;
+	struct binder_proc *proc = NULL;
 	struct hlist_node *pos;
-	int len = 0;
-	char *p = page;
 	int do_lock = !binder_debug_no_lock;
 
-	if (off)
-		return 0;
-
 	if (do_lock)
-		mutex_lock(&binder_lock);
-
-	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
-
-	p = print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
-
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
-		if (p >= page + PAGE_SIZE)
-			break;
-		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
+		mutex_lock(&binder_procs_lock);
+	if (prev && !hlist_unhashed(&prev->proc_node)) {
+		/* the common case, prev is still on the list */
+		pos = prev->proc_node.next;
+		if (pos)
+			proc = hlist_entry(pos, struct binder_proc, proc_node);
+	} else {
+		hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+			if (index-- == 0)
+				break;
+		if (pos == NULL)
+			proc = NULL;
 	}
+	binder_seq_pin_proc(proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
-	if (p > page + PAGE_SIZE)
-		p = page + PAGE_SIZE;
+		mutex_unlock(&binder_procs_lock);
+	if (prev)
+		binder_proc_dec_tmpref(prev);
+	return proc;
+}
 
-	*start = page + off;
+static void *binder_seq_start(struct seq_file *m, loff_t *pos)
+{
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+	return binder_seq_get_proc(NULL, *pos - 1);
+}
 
-	len = p - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
+static void *binder_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	if (v == SEQ_START_TOKEN)
+		return binder_seq_get_proc(NULL, 0);
+	return binder_seq_get_proc(v, *pos - 1);
+}
 
-	return len < count ? len  : count;
+static void binder_seq_stop(struct seq_file *m, void *v)
+{
+	if (v && v != SEQ_START_TOKEN)
+		binder_proc_dec_tmpref(v);
 }
 
-static int binder_read_proc_transactions(char *page, char **start, off_t off,
-					 int count, int *eof, void *data)
+static int binder_state_show(struct seq_file *m, void *v)
 {
-	struct binder_proc *proc;
 	struct hlist_node *pos;
-	int len = 0;
-	char *buf = page;
-	char *end = page + PAGE_SIZE;
-	int do_lock = !binder_debug_no_lock;
+	struct binder_node *node;
+	struct binder_node *last_node = NULL;
 
-	if (off)
+	if (v != SEQ_START_TOKEN) {
+		print_binder_proc(m, v, 1);
 		return 0;
+	}
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
+	seq_puts(m, "binder state:\n");
+	spin_lock(&binder_dead_nodes_lock);
+	if (!hlist_empty(&binder_dead_nodes))
+		seq_puts(m, "dead nodes:\n");
+	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
+		/*
+		 * Pin the node and drop the list lock, node->lock nests
+		 * outside of it.
+		 */
+		node->tmp_refs++;
+		spin_unlock(&binder_dead_nodes_lock);
+		if (last_node)
+			binder_put_node(last_node);
+		binder_node_lock(node);
+		print_binder_node_nilocked(m, node);
+		binder_node_unlock(node);
+		last_node = node;
+		spin_lock(&binder_dead_nodes_lock);
+	}
+	spin_unlock(&binder_dead_nodes_lock);
+	if (last_node)
+		binder_put_node(last_node);
+	return 0;
+}
 
-	buf += snprintf(buf, end - buf, "binder transactions:\n");
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
-		if (buf >= end)
-			break;
-		buf = print_binder_proc(buf, end, proc, 0);
+static int binder_stats_show(struct seq_file *m, void *v)
+{
+	if (v != SEQ_START_TOKEN) {
+		print_binder_proc_stats(m, v);
+		return 0;
 	}
-	if (do_lock)
-		mutex_unlock(&binder_lock);
-	if (buf > page + PAGE_SIZE)
-		buf = page + PAGE_SIZE;
 
-	*start = page + off;
+	seq_puts(m, "binder stats:\n");
+	print_binder_stats(m, "", &binder_stats);
+	print_binder_lock_stats(m);
+	return 0;
+}
 
-	len = buf - page;
-	if (len > off)
-		len -= off;
+static int binder_transactions_show(struct seq_file *m, void *v)
+{
+	if (v != SEQ_START_TOKEN)
+		print_binder_proc(m, v, 0);
 	else
-		len = 0;
+		seq_puts(m, "binder transactions:\n");
+	return 0;
+}
+
+static int binder_latency_show(struct seq_file *m, void *v)
+{
+	if (v != SEQ_START_TOKEN)
+		print_binder_proc_latency(m, v);
+	return 0;
+}
+
+static const struct seq_operations binder_state_seq_ops = {
+	.start = binder_seq_start,
+	.next = binder_seq_next,
+	.stop = binder_seq_stop,
+	.show = binder_state_show,
+};
+
+static const struct seq_operations binder_stats_seq_ops = {
+	.start = binder_seq_start,
+	.next = binder_seq_next,
+	.stop = binder_seq_stop,
+	.show = binder_stats_show,
+};
+
+static const struct seq_operations binder_transactions_seq_ops = {
+	.start = binder_seq_start,
+	.next = binder_seq_next,
+	.stop = binder_seq_stop,
+	.show = binder_transactions_show,
+};
 
-	return len < count ? len  : count;
+static const struct seq_operations binder_latency_seq_ops = {
+	.start = binder_seq_start,
+	.next = binder_seq_next,
+	.stop = binder_seq_stop,
+	.show = binder_latency_show,
+};
+
+static int binder_state_open(struct inode *nodp, struct file *filp)
+{
+	return seq_open(filp, &binder_state_seq_ops);
 }
 
-static int binder_read_proc_proc(char *page, char **start, off_t off,
-				 int count, int *eof, void *data)
+static int binder_stats_open(struct inode *nodp, struct file *filp)
 {
-	struct binder_proc *proc = data;
-	int len = 0;
-	char *p = page;
-	int do_lock = !binder_debug_no_lock;
+	return seq_open(filp, &binder_stats_seq_ops);
+}
 
-	if (off)
-		return 0;
+static int binder_transactions_open(struct inode *nodp, struct file *filp)
+{
+	return seq_open(filp, &binder_transactions_seq_ops);
+}
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
-	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
-	if (do_lock)
-		mutex_unlock(&binder_lock);
+static int binder_latency_open(struct inode *nodp, struct file *filp)
+{
+	return seq_open(filp, &binder_latency_seq_ops);
+}
 
-	if (p > page + PAGE_SIZE)
-		p = page + PAGE_SIZE;
-	*start = page + off;
+static int binder_proc_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc = m->private;
 
-	len = p - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
+	seq_puts(m, "binder proc state:\n");
+	print_binder_proc(m, proc, 1);
+	print_binder_size_classes(m, proc);
+	return 0;
+}
 
-	return len < count ? len  : count;
+/*
+ * proc/<pid> is removed in binder_release() before the proc can go away,
+ * and remove_proc_entry() waits for readers that are inside read().
+ */
+static int binder_proc_open(struct inode *nodp, struct file *filp)
+{
+	return single_open(filp, binder_proc_show, PDE(nodp)->data);
 }
 
-static char *print_binder_transaction_log_entry(char *buf, char *end,
+static void print_binder_transaction_log_entry(struct seq_file *m,
 					struct binder_transaction_log_entry *e)
 {
-	buf += snprintf(buf, end - buf,
-			"%d: %s from %d:%d to %d:%d node %d handle %d "
-			"size %d:%d\n",
-			e->debug_id, (e->call_type == 2) ? "reply" :
-			((e->call_type == 1) ? "async" : "call "), e->from_proc,
-			e->from_thread, e->to_proc, e->to_thread, e->to_node,
-			e->target_handle, e->data_size, e->offsets_size);
-	return buf;
+	seq_printf(m, "%d: %s from %d:%d to %d:%d node %d handle %d "
+		   "size %d:%d\n",
+		   e->debug_id, (e->call_type == 2) ? "reply" :
+		   ((e->call_type == 1) ? "async" : "call "), e->from_proc,
+		   e->from_thread, e->to_proc, e->to_thread, e->to_node,
+		   e->target_handle, e->data_size, e->offsets_size);
 }
 
-static int binder_read_proc_transaction_log(
-	char *page, char **start, off_t off, int count, int *eof, void *data)
+static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
-	struct binder_transaction_log *log = data;
-	int len = 0;
+	struct binder_transaction_log *log = m->private;
+	unsigned int log_cur = atomic_read(&log->cur);
+	unsigned int entries;
+	unsigned int cur;
 	int i;
-	char *buf = page;
-	char *end = page + PAGE_SIZE;
 
-	if (off)
-		return 0;
+	/* cur is the index of the newest entry, -1 while the log is empty */
+	entries = log_cur + 1;
+	if (log->full || entries > ARRAY_SIZE(log->entry)) {
+		cur = entries % ARRAY_SIZE(log->entry);
+		entries = ARRAY_SIZE(log->entry);
+	} else
+		cur = 0;
+	for (i = 0; i < entries; i++)
+		print_binder_transaction_log_entry(m,
+			&log->entry[(cur + i) % ARRAY_SIZE(log->entry)]);
+	return 0;
+}
 
-	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++) {
-			if (buf >= end)
-				break;
-			buf = print_binder_transaction_log_entry(buf, end,
-								&log->entry[i]);
-		}
-	}
-	for (i = 0; i < log->next; i++) {
-		if (buf >= end)
-			break;
-		buf = print_binder_transaction_log_entry(buf, end,
-							 &log->entry[i]);
-	}
+static int binder_transaction_log_open(struct inode *nodp, struct file *filp)
+{
+	return single_open(filp, binder_transaction_log_show,
+			   PDE(nodp)->data);
+}
+
+static const struct file_operations binder_state_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_state_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
 
-	*start = page + off;
+static const struct file_operations binder_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
 
-	len = buf - page;
-	if (len > off)
-		len -= off;
-	else
-		len = 0;
+static const struct file_operations binder_transactions_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_transactions_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
 
-	return len < count ? len  : count;
-}
+static const struct file_operations binder_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
+
+static const struct file_operations binder_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations binder_transaction_log_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_transaction_log_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
 static const struct file_operations binder_fops = {
 	.owner = THIS_MODULE,
@@ -3740,33 +5794,32 @@ static int __init binder_init(void)
 		binder_proc_dir_entry_proc = proc_mkdir("proc",
 						binder_proc_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_proc_dir_entry_root) {
-		create_proc_read_entry("state",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_state,
-				       NULL);
-		create_proc_read_entry("stats",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_stats,
-				       NULL);
-		create_proc_read_entry("transactions",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_transactions,
-				       NULL);
-		create_proc_read_entry("transaction_log",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_transaction_log,
-				       &binder_transaction_log);
-		create_proc_read_entry("failed_transaction_log",
-				       S_IRUGO,
-				       binder_proc_dir_entry_root,
-				       binder_read_proc_transaction_log,
-				       &binder_transaction_log_failed);
+		proc_create("state", S_IRUGO, binder_proc_dir_entry_root,
+			    &binder_state_fops);
+		proc_create("stats", S_IRUGO, binder_proc_dir_entry_root,
+			    &binder_stats_fops);
+		proc_create("transactions", S_IRUGO,
+			    binder_proc_dir_entry_root,
+			    &binder_transactions_fops);
+		proc_create_data("transaction_log", S_IRUGO,
+				 binder_proc_dir_entry_root,
+				 &binder_transaction_log_fops,
+				 &binder_transaction_log);
+		proc_create_data("failed_transaction_log", S_IRUGO,
+				 binder_proc_dir_entry_root,
+				 &binder_transaction_log_fops,
+				 &binder_transaction_log_failed);
 	}
+
+	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
+	if (binder_debugfs_dir_entry_root)
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	return ret;
 }
 
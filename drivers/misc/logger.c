@@ -18,11 +18,15 @@
  */
 
 #include <linux/module.h>
+#include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/srcu.h>
+#include <linux/vmalloc.h>
 #include <linux/logger.h>
 
 #include <asm/ioctls.h>
@@ -31,17 +35,62 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers do not take any lock. All positions are free running byte counts
+ * that wrap at 2^32, kept in unsigned ints also on 64-bit, and
+ * logger_offset() maps them into the buffer. A writer
+ * reserves [pos, pos + len) by advancing 'reserved' with cmpxchg, moves
+ * 'tail' past every entry that the reservation will overwrite, copies its
+ * entry in and then publishes it by advancing 'w_off' from pos to
+ * pos + len, so entries become visible to readers in reservation order.
+ * Everything in [tail, w_off) is a complete entry.
+ *
+ * Readers and the reader list are protected by the mutex 'mutex'. A reader
+ * validates what it copied against 'tail' instead of being fixed up by the
+ * writers.
+ *
+ * Writers run inside an SRCU read section so that logger_resize() can wait
+ * for them to drain. 'buffer' and 'size' only change while 'resizing' keeps
+ * new writers out and 'mutex' keeps readers out.
+ *
+ * 'w_off' and 'tail' live in the control page in front of the buffer, so a
+ * reader that mapped the log sees them without a syscall.
+ *
+ * 'dropped' and 'written' count the entries that fell off the tail and the
+ * entries published so far. A reader compares them with its own position
+ * to tell how many entries it lost to overwrites. 'dropped' is bumped right
+ * after the tail moves, so the counts can be off by the few writers that
+ * are moving the tail at that moment.
+ */
+/*
+ * struct logger_ctl - the control page, what userspace sees as
+ * struct logger_mmap_ctl at the start of a mapped log
  */
+struct logger_ctl {
+	unsigned int		size;	/* size of the log */
+	atomic_t		w_off;	/* end of the published entries */
+	atomic_t		tail;	/* oldest entry not yet overwritten */
+};
+
 struct logger_log {
 	unsigned char *		buffer;	/* the ring buffer itself */
+	struct logger_ctl *	ctl;	/* the page in front of buffer */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	commit_wq; /* writers waiting to publish */
+	wait_queue_head_t	resize_wq; /* writers waiting for a resize */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting readers */
+	struct srcu_struct	srcu;	/* writers in progress */
+	int			resizing; /* keeps new writers out */
+	atomic_t		reserved; /* end of the space claimed by writers */
+	atomic_t		dropped; /* entries that fell off the tail */
+	atomic_t		written; /* entries published */
+	atomic_t		overwritten; /* entries readers lost */
+	atomic_t		mapped;	/* mappings, a mapped log is not resized */
+	unsigned int		head;	/* new readers start here */
+	unsigned int		head_seq; /* entry number of 'head' */
 	size_t			size;	/* size of the log */
 };
 
@@ -54,12 +103,25 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log *	log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	unsigned int		r_off;	/* current read position */
+	unsigned int		r_seq;	/* entry number of r_off */
+	unsigned int		overwritten; /* entries lost to overwrites */
+	int			batched; /* read() returns all entries that fit */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_before - is position 'a' older than position 'b'? */
+#define logger_before(a, b)	((int)((unsigned int)(a) - (unsigned int)(b)) < 0)
+
+/* spins before a writer sleeps waiting for an earlier writer to publish */
+#define LOGGER_COMMIT_SPIN	100
+
+/* bounds for logger_resize(), positions must stay well inside an int */
+#define LOGGER_MIN_LOG_SIZE	(2 * LOGGER_ENTRY_MAX_LEN)
+#define LOGGER_MAX_LOG_SIZE	(16 * 1024 * 1024)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -85,14 +147,16 @@ static inline struct logger_log * file_get_log(struct file *file)
 
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from position 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The entry may be overwritten concurrently, callers check 'tail'
+ * afterwards before trusting the result.
  */
-static __u32 get_entry_len(struct logger_log *log, size_t off)
+static __u32 get_entry_len(struct logger_log *log, unsigned int off)
 {
 	__u16 val;
 
+	off = logger_offset(off);
 	switch (log->size - off) {
 	case 1:
 		memcpy(&val, log->buffer + off, 1);
@@ -109,13 +173,15 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->mutex and check that the reader was not lapped
+ * while the entry was copied.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_off);
 	size_t len;
 
 	/*
@@ -123,8 +189,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -135,11 +201,80 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * fix_up_reader - pulls a reader that was lapped by the writers forward to
+ * the oldest entry that is still in the log.
+ *
+ * Caller must hold log->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	unsigned int tail = atomic_read(&log->ctl->tail);
+	unsigned int dropped;
+	int lost;
+
+	if (!logger_before(reader->r_off, tail))
+		return;
+
+	dropped = atomic_read(&log->dropped);
+	lost = dropped - reader->r_seq;
+	if (lost > 0) {
+		reader->overwritten += lost;
+		atomic_add(lost, &log->overwritten);
+	}
+	reader->r_off = tail;
+	reader->r_seq = dropped;
+}
+
+/*
+ * logger_readable - is there a published entry the reader has not read?
+ */
+static inline int logger_readable(struct logger_log *log,
+				  struct logger_reader *reader)
+{
+	return (unsigned int)atomic_read(&log->ctl->w_off) != reader->r_off;
+}
+
+/*
+ * logger_lapped - has a writer started to overwrite the reader's entry?
+ */
+static inline int logger_lapped(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	return logger_before(reader->r_off, atomic_read(&log->ctl->tail));
+}
+
+/*
+ * get_batch_len - extends the 'len' bytes of entries at 'off' by the
+ * entries that follow while they fit into 'count' bytes, counting them in
+ * 'entries'.
+ *
+ * Caller must hold log->mutex and check that the reader was not lapped.
+ */
+static size_t get_batch_len(struct logger_log *log, unsigned int off,
+			    size_t len, size_t count, unsigned int *entries)
+{
+	unsigned int end = atomic_read(&log->ctl->w_off);
+	unsigned int pos = off + len;
+
+	smp_rmb();
+	while (pos != end) {
+		__u32 next = get_entry_len(log, pos);
+
+		/* a torn length is caught by the caller's tail check */
+		if (len + next > count || end - pos < next)
+			break;
+		len += next;
+		pos += next;
+		(*entries)++;
+	}
+
+	return len;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -147,16 +282,19 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or after
+ * 	  LOGGER_SET_BATCHED_READ as many whole entries as fit
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN, or a multiple of it in batched
+ * mode. Will set errno to EINVAL if read buffer is insufficient to hold next
+ * entry.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	unsigned int entries;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -165,7 +303,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		ret = !logger_readable(log, reader);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -189,21 +327,45 @@ start:
 
 	mutex_lock(&log->mutex);
 
+retry:
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(!logger_readable(log, reader))) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
+	fix_up_reader(log, reader);
+
+	/* pairs with the smp_wmb() in logger_commit() */
+	smp_rmb();
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
+	smp_rmb();
+	if (unlikely(logger_lapped(log, reader)))
+		goto retry;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
+	entries = 1;
+	if (reader->batched)
+		ret = get_batch_len(log, reader->r_off, ret, count, &entries);
+
+	/* get exactly one entry, or all that fit, from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (ret < 0)
+		goto out;
+
+	/*
+	 * A writer may have overwritten the entries while they were copied.
+	 * The oldest is overwritten first, so checking the first is enough.
+	 */
+	smp_rmb();
+	if (unlikely(logger_lapped(log, reader)))
+		goto retry;
+	reader->r_off += ret;
+	reader->r_seq += entries;
 
 out:
 	mutex_unlock(&log->mutex);
@@ -212,108 +374,152 @@ out:
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_make_room - moves the tail past every entry that the reservation
+ * ending at 'end' is going to overwrite.
  *
- * Caller must hold log->mutex.
+ * The entry at the tail is read without a lock. If another writer moved
+ * the tail first, the entry may already be overwritten and the cmpxchg
+ * fails, so a torn length is never used.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void logger_make_room(struct logger_log *log, unsigned int end)
 {
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
+	unsigned int tail;
+
+	while (logger_before(tail = atomic_read(&log->ctl->tail), end - log->size)) {
+		if (tail == atomic_read(&log->ctl->w_off)) {
+			/* the oldest entry is still being written */
+			wait_event(log->commit_wq,
+				   tail != atomic_read(&log->ctl->w_off));
+			continue;
+		}
+		smp_rmb();
+		if (atomic_cmpxchg(&log->ctl->tail, tail,
+				   tail + get_entry_len(log, tail)) == tail)
+			atomic_inc(&log->dropped);
+	}
+	/* no byte of the old entries may be written before the tail moved */
+	smp_mb();
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_reserve - claims 'len' bytes of the log and returns the position
+ * at which the caller writes its entry.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+static unsigned int logger_reserve(struct logger_log *log, size_t len)
+{
+	unsigned int pos;
 
-	return 0;
+	do {
+		pos = atomic_read(&log->reserved);
+	} while (atomic_cmpxchg(&log->reserved, pos, pos + len) != pos);
+
+	logger_make_room(log, pos + len);
+	return pos;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * logger_commit - publishes the entry at [pos, end) once every entry
+ * reserved before it has been published.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log, unsigned int pos,
+			  unsigned int end)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
-
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	int spin;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	for (spin = 0; spin < LOGGER_COMMIT_SPIN; spin++) {
+		if (atomic_read(&log->ctl->w_off) == pos)
+			break;
+		cpu_relax();
+	}
+	/* the earlier writer may be sleeping in copy_from_user() */
+	if (spin == LOGGER_COMMIT_SPIN)
+		wait_event(log->commit_wq, atomic_read(&log->ctl->w_off) == pos);
+
+	atomic_inc(&log->written);
+	smp_wmb();
+	atomic_set(&log->ctl->w_off, end);
+	smp_mb();
+	if (waitqueue_active(&log->commit_wq))
+		wake_up_all(&log->commit_wq);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'pos'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, unsigned int pos,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-	
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log_from_user - writes 'count' bytes from the user-space buffer
+ * 'buf' to the log 'log' at position 'pos'
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, unsigned int pos,
 				      const void __user *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * do_clear_log - zeroes 'count' bytes of the log at position 'pos'
+ */
+static void do_clear_log(struct logger_log *log, unsigned int pos,
+			 size_t count)
+{
+	size_t off = logger_offset(pos);
+	size_t len;
+
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
+
+	if (count != len)
+		memset(log->buffer, 0, count - len);
+}
+
+/*
+ * logger_write_begin - enters the log as a writer, waiting out a resize.
+ * Returns the SRCU index to hand to logger_write_end().
+ */
+static int logger_write_begin(struct logger_log *log)
+{
+	int idx;
+
+	for (;;) {
+		idx = srcu_read_lock(&log->srcu);
+		if (likely(!ACCESS_ONCE(log->resizing)))
+			return idx;
+		srcu_read_unlock(&log->srcu, idx);
+		wait_event(log->resize_wq, !ACCESS_ONCE(log->resizing));
+	}
+}
+
+static inline void logger_write_end(struct logger_log *log, int idx)
+{
+	srcu_read_unlock(&log->srcu, idx);
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -323,10 +529,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	unsigned int pos, off;
 	ssize_t ret = 0;
+	int idx;
 
 	now = current_kernel_time();
 
@@ -340,19 +547,13 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	idx = logger_write_begin(log);
+	pos = logger_reserve(log, sizeof(struct logger_entry) + header.len);
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, pos, &header, sizeof(struct logger_entry));
+	off = pos + sizeof(struct logger_entry);
 
-	while (nr_segs-- > 0) {
+	while (nr_segs-- > 0 && ret < header.len) {
 		size_t len;
 		ssize_t nr;
 
@@ -360,21 +561,28 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off + ret, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * The space cannot be handed back once later writers
+			 * reserved behind it, so the entry is published with
+			 * the rest of its payload zeroed.
+			 */
+			do_clear_log(log, off + ret, header.len - ret);
+			ret = nr;
+			break;
 		}
 
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	logger_commit(log, pos, off + header.len);
+	logger_write_end(log, idx);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -401,6 +609,7 @@ static int logger_open(struct inode *inode, struct file *file)
 
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader;
+		unsigned int tail;
 
 		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
 		if (!reader)
@@ -411,6 +620,19 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		mutex_lock(&log->mutex);
 		reader->r_off = log->head;
+		reader->r_seq = log->head_seq;
+		/*
+		 * Entries that fell off since the last flush were never this
+		 * reader's to lose, so it starts at the tail without counting
+		 * them in 'overwritten'.
+		 */
+		tail = atomic_read(&log->ctl->tail);
+		if (logger_before(reader->r_off, tail)) {
+			reader->r_off = tail;
+			reader->r_seq = atomic_read(&log->dropped);
+		}
+		reader->overwritten = 0;
+		reader->batched = 0;
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -430,7 +652,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		mutex_unlock(&log->mutex);
 		kfree(reader);
 	}
 
@@ -461,13 +687,109 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (logger_readable(log, reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 	
 	return ret;
 }
 
+/*
+ * logger_alloc - allocates the control page and a buffer of 'size' bytes
+ * behind it, both can be mapped to userspace
+ */
+static struct logger_ctl *logger_alloc(size_t size)
+{
+	struct logger_ctl *ctl;
+
+	BUILD_BUG_ON(sizeof(struct logger_ctl) !=
+		     sizeof(struct logger_mmap_ctl));
+	BUILD_BUG_ON(offsetof(struct logger_ctl, w_off) !=
+		     offsetof(struct logger_mmap_ctl, w_off));
+	BUILD_BUG_ON(offsetof(struct logger_ctl, tail) !=
+		     offsetof(struct logger_mmap_ctl, tail));
+
+	ctl = vmalloc_user(PAGE_SIZE + size);
+	if (ctl)
+		ctl->size = size;
+	return ctl;
+}
+
+/*
+ * copy_log - copies the bytes at positions [start, end) of the current
+ * buffer into 'buffer' of 'size' bytes, at the same positions.
+ */
+static void copy_log(struct logger_log *log, unsigned char *buffer,
+		     size_t size, unsigned int start, unsigned int end)
+{
+	while (start != end) {
+		size_t from = logger_offset(start);
+		size_t to = start & (size - 1);
+		size_t len = end - start;
+
+		len = min(len, log->size - from);
+		len = min(len, size - to);
+		memcpy(buffer + to, log->buffer + from, len);
+		start += len;
+	}
+}
+
+/*
+ * logger_resize - replaces the buffer of 'log' with one of 'size' bytes,
+ * keeping the newest entries that fit. Positions do not change, so readers
+ * stay on their entry, or are pulled forward to the new tail on their next
+ * read if their entry did not fit.
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_resize(struct logger_log *log, size_t size)
+{
+	struct logger_ctl *ctl, *old;
+	unsigned char *buffer;
+	unsigned int tail, end;
+
+	if (size < LOGGER_MIN_LOG_SIZE || size > LOGGER_MAX_LOG_SIZE ||
+	    (size & (size - 1)))
+		return -EINVAL;
+	if (size == log->size)
+		return 0;
+	/* mappings cover the old buffer */
+	if (atomic_read(&log->mapped))
+		return -EBUSY;
+
+	ctl = logger_alloc(size);
+	if (!ctl)
+		return -ENOMEM;
+	buffer = (unsigned char *)ctl + PAGE_SIZE;
+
+	/* keep new writers out and wait for the ones in progress */
+	log->resizing = 1;
+	synchronize_srcu(&log->srcu);
+
+	tail = atomic_read(&log->ctl->tail);
+	end = atomic_read(&log->ctl->w_off);
+	while (end - tail > size) {
+		tail += get_entry_len(log, tail);
+		atomic_inc(&log->dropped);
+	}
+	copy_log(log, buffer, size, tail, end);
+	ctl->size = size;
+	atomic_set(&ctl->w_off, end);
+	atomic_set(&ctl->tail, tail);
+
+	old = log->ctl;
+	log->ctl = ctl;
+	log->buffer = buffer;
+	log->size = size;
+
+	smp_mb();
+	log->resizing = 0;
+	wake_up_all(&log->resize_wq);
+
+	vfree(old);
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -486,10 +808,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		ret = (unsigned int)atomic_read(&log->ctl->w_off) -
+			reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -497,19 +818,57 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		ret = 0;
+		while (logger_readable(log, reader)) {
+			fix_up_reader(log, reader);
+			smp_rmb();
 			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+			smp_rmb();
+			if (!logger_lapped(log, reader))
+				break;
+		}
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		log->head_seq = atomic_read(&log->written);
+		smp_rmb();
+		log->head = atomic_read(&log->ctl->w_off);
+		list_for_each_entry(reader, &log->readers, list) {
+			reader->r_off = log->head;
+			reader->r_seq = log->head_seq;
+		}
+		ret = 0;
+		break;
+	case LOGGER_SET_LOG_BUF_SIZE:
+		if (!(file->f_mode & FMODE_WRITE)) {
+			ret = -EBADF;
+			break;
+		}
+		if (!capable(CAP_SYS_ADMIN)) {
+			ret = -EPERM;
+			break;
+		}
+		ret = logger_resize(log, arg);
+		break;
+	case LOGGER_GET_OVERWRITTEN:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		fix_up_reader(log, reader);
+		ret = reader->overwritten;
+		break;
+	case LOGGER_SET_BATCHED_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batched = !!arg;
 		ret = 0;
 		break;
 	}
@@ -519,11 +878,70 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+static void logger_vm_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_inc(&log->mapped);
+}
+
+static void logger_vm_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_dec(&log->mapped);
+}
+
+static struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vm_open,
+	.close = logger_vm_close,
+};
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the control page, struct logger_mmap_ctl, followed by the ring
+ * itself, read only. A reader keeps its own position 'pos': the entry at
+ * pos is complete while pos != w_off, and was copied intact if pos is not
+ * behind tail when checked again after the copy, as in logger_read(). A
+ * mapped log cannot be resized.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_log *log;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	log = reader->log;
+
+	mutex_lock(&log->mutex);
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size) {
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = remap_vmalloc_range(vma, log->ctl, 0);
+	if (ret)
+		goto out;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_private_data = log;
+	vma->vm_ops = &logger_vm_ops;
+	logger_vm_open(vma);
+out:
+	mutex_unlock(&log->mutex);
+	return ret;
+}
+
 static struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -531,14 +949,12 @@ static struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' and an initial size of 'SIZE'
+ * bytes, which must be a power of two between LOGGER_MIN_LOG_SIZE and
+ * LOGGER_MAX_LOG_SIZE. The buffer is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -546,9 +962,15 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
+	.resize_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .resize_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.reserved = ATOMIC_INIT(0), \
+	.dropped = ATOMIC_INIT(0), \
+	.written = ATOMIC_INIT(0), \
+	.overwritten = ATOMIC_INIT(0), \
+	.mapped = ATOMIC_INIT(0), \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -568,17 +990,79 @@ static struct logger_log * get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * /sys/class/misc/log_<name>/size resizes the log, overwritten counts the
+ * entries all readers together lost because the log was too small.
+ */
+static ssize_t logger_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct logger_log *log = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%zu\n", log->size);
+}
+
+static ssize_t logger_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct logger_log *log = dev_get_drvdata(dev);
+	unsigned long size;
+	int ret;
+
+	if (strict_strtoul(buf, 0, &size))
+		return -EINVAL;
+
+	mutex_lock(&log->mutex);
+	ret = logger_resize(log, size);
+	mutex_unlock(&log->mutex);
+
+	return ret ? ret : count;
+}
+
+static ssize_t logger_overwritten_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct logger_log *log = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", atomic_read(&log->overwritten));
+}
+
+static DEVICE_ATTR(size, S_IRUGO | S_IWUSR, logger_size_show,
+		   logger_size_store);
+static DEVICE_ATTR(overwritten, S_IRUGO, logger_overwritten_show, NULL);
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->ctl = logger_alloc(log->size);
+	if (!log->ctl)
+		return -ENOMEM;
+	log->buffer = (unsigned char *)log->ctl + PAGE_SIZE;
+
+	ret = init_srcu_struct(&log->srcu);
+	if (unlikely(ret)) {
+		vfree(log->ctl);
+		return ret;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		cleanup_srcu_struct(&log->srcu);
+		vfree(log->ctl);
 		return ret;
 	}
 
+	dev_set_drvdata(log->misc.this_device, log);
+	if (device_create_file(log->misc.this_device, &dev_attr_size) ||
+	    device_create_file(log->misc.this_device, &dev_attr_overwritten))
+		printk(KERN_WARNING "logger: no sysfs attributes for log "
+		       "'%s'\n", log->misc.name);
+
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
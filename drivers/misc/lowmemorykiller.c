@@ -18,6 +18,10 @@
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/swap.h>
 
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask);
 
@@ -41,22 +45,200 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
+/* processes by oomkilladj, so the shrinker only looks at the processes it
+ * would kill instead of walking every process */
+#define LOWMEM_NR_ADJ (OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_tasks[LOWMEM_NR_ADJ];
+static DEFINE_SPINLOCK(lowmem_tasks_lock);
+
+/* the last process killed, no other one is killed until its mm is torn
+ * down or exit_timeout_ms passes. lowmem_kill_mutex serializes the kills
+ * and protects the victim and the statistics */
+static DEFINE_MUTEX(lowmem_kill_mutex);
+static struct mm_struct *lowmem_victim_mm;
+static int lowmem_victim_adj;
+static int lowmem_victim_size;
+static unsigned long lowmem_victim_timeout;
+static uint32_t lowmem_exit_timeout_ms = 1000;
+
+/* kills by adj of the victim and minfree level that triggered them */
+static unsigned long lowmem_kills[LOWMEM_NR_ADJ][ARRAY_SIZE(lowmem_minfree)];
+/* victims that were still alive when the timeout passed */
+static unsigned long lowmem_kill_timeouts[LOWMEM_NR_ADJ];
+/* shrinker calls that killed nothing as a victim was still exiting */
+static unsigned long lowmem_kills_deferred;
+
+/* with pressure_mode set, a crossed minfree threshold only kills while
+ * reclaim is failing: less than reclaim_efficiency percent of the pages
+ * scanned over the last window_ms were reclaimed. free memory alone is
+ * then compared to minfree, the file cache is judged by how well it is
+ * reclaimed. without swap only the file lists count, anon pages can't be
+ * reclaimed anyway. when too little was scanned to tell, the thresholds
+ * decide alone as without pressure_mode */
+static uint32_t lowmem_pressure_mode;
+static uint32_t lowmem_reclaim_efficiency = 25;
+static uint32_t lowmem_window_ms = 500;
+/* the reclaim counters when the current window started, and the
+ * efficiency over the last one in percent or -1 */
+static DEFINE_SPINLOCK(lowmem_window_lock);
+static unsigned long lowmem_window_start;
+static unsigned long lowmem_window_scanned[2];
+static unsigned long lowmem_window_reclaimed[2];
+static int lowmem_last_efficiency = -1;
+/* shrinker calls that killed nothing as reclaim was still doing well */
+static unsigned long lowmem_kills_spared;
+
 #define lowmem_print(level, x...) do { if(lowmem_debug_level >= (level)) printk(x); } while(0)
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size, S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size, S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(exit_timeout_ms, lowmem_exit_timeout_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_mode, lowmem_pressure_mode, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(reclaim_efficiency, lowmem_reclaim_efficiency, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(window_ms, lowmem_window_ms, uint, S_IRUGO | S_IWUSR);
+
+/* any write resets the statistics */
+static int lowmem_kill_stats_set(const char *val, struct kernel_param *kp)
+{
+	mutex_lock(&lowmem_kill_mutex);
+	memset(lowmem_kills, 0, sizeof(lowmem_kills));
+	memset(lowmem_kill_timeouts, 0, sizeof(lowmem_kill_timeouts));
+	lowmem_kills_deferred = 0;
+	lowmem_kills_spared = 0;
+	mutex_unlock(&lowmem_kill_mutex);
+	return 0;
+}
+
+static int lowmem_kill_stats_get(char *buffer, struct kernel_param *kp)
+{
+	int adj, i, n;
+
+	mutex_lock(&lowmem_kill_mutex);
+	n = sprintf(buffer, "adj");
+	for (i = 0; i < ARRAY_SIZE(lowmem_minfree); i++)
+		n += sprintf(buffer + n, " minfree%d", i);
+	n += sprintf(buffer + n, " timeouts\n");
+	for (adj = OOM_DISABLE; adj <= OOM_ADJUST_MAX; adj++) {
+		unsigned long *kills = lowmem_kills[adj - OOM_DISABLE];
+		unsigned long total = 0;
+
+		for (i = 0; i < ARRAY_SIZE(lowmem_minfree); i++)
+			total += kills[i];
+		if (!total)
+			continue;
+		n += sprintf(buffer + n, "%3d", adj);
+		for (i = 0; i < ARRAY_SIZE(lowmem_minfree); i++)
+			n += sprintf(buffer + n, " %8lu", kills[i]);
+		n += sprintf(buffer + n, " %8lu\n",
+			     lowmem_kill_timeouts[adj - OOM_DISABLE]);
+	}
+	n += sprintf(buffer + n, "deferred %lu\n", lowmem_kills_deferred);
+	n += sprintf(buffer + n, "spared %lu\n", lowmem_kills_spared);
+	n += sprintf(buffer + n, "reclaim efficiency %d", lowmem_last_efficiency);
+	mutex_unlock(&lowmem_kill_mutex);
+	return n;
+}
+
+module_param_call(kill_stats, lowmem_kill_stats_set, lowmem_kill_stats_get,
+		  NULL, S_IRUGO | S_IWUSR);
+
+static struct list_head *lowmem_task_list(int oomkilladj)
+{
+	struct list_head *list = &lowmem_tasks[oomkilladj - OOM_DISABLE];
+
+	/* the lists are set up on first use as processes are forked before
+	 * the initcalls run */
+	if (unlikely(!list->next))
+		INIT_LIST_HEAD(list);
+	return list;
+}
+
+/* lowmem_tasks_lock nests inside tasklist_lock, which interrupts take for
+ * reading, so it is taken with interrupts off. called with tasklist_lock
+ * held for writing, which already disabled them */
+void lowmem_task_add(struct task_struct *p)
+{
+	spin_lock(&lowmem_tasks_lock);
+	list_add(&p->oom_adj_list, lowmem_task_list(p->oomkilladj));
+	spin_unlock(&lowmem_tasks_lock);
+}
+
+/* called with tasklist_lock held for writing */
+void lowmem_task_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_tasks_lock);
+	list_del_init(&p->oom_adj_list);
+	spin_unlock(&lowmem_tasks_lock);
+}
+
+void lowmem_set_oomkilladj(struct task_struct *p, int oomkilladj)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_tasks_lock, flags);
+	p->oomkilladj = oomkilladj;
+	/* threads other than the group leader are not on a list */
+	if (!list_empty(&p->oom_adj_list))
+		list_move(&p->oom_adj_list, lowmem_task_list(oomkilladj));
+	spin_unlock_irqrestore(&lowmem_tasks_lock, flags);
+}
+
+/* the share of the scanned pages that reclaim got back over the last
+ * complete window in percent, -1 if too few pages were scanned. called on
+ * every shrinker call, reclaim calls the shrinkers after each pass */
+static int lowmem_update_efficiency(void)
+{
+	unsigned long scanned = 0, reclaimed = 0;
+	unsigned long window = msecs_to_jiffies(lowmem_window_ms);
+	unsigned long s, r;
+	int lru, ret;
+
+	spin_lock(&lowmem_window_lock);
+	if (time_before(jiffies, lowmem_window_start + window)) {
+		ret = lowmem_last_efficiency;
+		spin_unlock(&lowmem_window_lock);
+		return ret;
+	}
+	for (lru = 0; lru < 2; lru++) {
+		s = atomic_long_read(&vm_reclaim_scanned[lru]);
+		r = atomic_long_read(&vm_reclaim_reclaimed[lru]);
+		if (lru == 1 || total_swap_pages) {
+			scanned += s - lowmem_window_scanned[lru];
+			reclaimed += r - lowmem_window_reclaimed[lru];
+		}
+		lowmem_window_scanned[lru] = s;
+		lowmem_window_reclaimed[lru] = r;
+	}
+	/* after a quiet period the counts are mostly from long ago */
+	if (time_after(jiffies, lowmem_window_start + 2 * window) ||
+	    scanned < SWAP_CLUSTER_MAX)
+		lowmem_last_efficiency = -1;
+	else
+		lowmem_last_efficiency = reclaimed * 100 / scanned;
+	lowmem_window_start = jiffies;
+	ret = lowmem_last_efficiency;
+	spin_unlock(&lowmem_window_lock);
+	return ret;
+}
 
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
+	struct mm_struct *mm, *done_mm = NULL;
+	unsigned long flags;
 	int rem = 0;
+	int level = 0;
 	int tasksize;
-	int i;
+	int i, adj;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
+	int efficiency = lowmem_pressure_mode ? lowmem_update_efficiency() : -1;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
@@ -64,10 +246,15 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		array_size = lowmem_adj_size;
 	if(lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+	/* a large file cache only holds off the killer while reclaim is
+	 * getting pages back from it, which the efficiency tells */
+	if (efficiency >= 0)
+		other_file = 0;
 	for(i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
+			level = i;
 			break;
 		}
 	}
@@ -82,34 +269,95 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		return rem;
 	}
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		if (p->oomkilladj < min_adj || !p->mm)
-			continue;
-		tasksize = get_mm_rss(p->mm);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (p->oomkilladj < selected->oomkilladj)
+	/* another reclaimer is killing already */
+	if (!mutex_trylock(&lowmem_kill_mutex))
+		return rem;
+
+	/* reclaim is still doing its job */
+	if (efficiency >= 0 && efficiency >= (int)lowmem_reclaim_efficiency) {
+		lowmem_kills_spared++;
+		mutex_unlock(&lowmem_kill_mutex);
+		lowmem_print(3, "lowmem_shrink %d, %x, reclaim efficiency %d%%, "
+			     "return %d\n", nr_to_scan, gfp_mask, efficiency, rem);
+		return rem;
+	}
+
+	if (lowmem_victim_mm) {
+		if (atomic_read(&lowmem_victim_mm->mm_users) &&
+		    time_before(jiffies, lowmem_victim_timeout)) {
+			/* its memory is about to be freed, the next shrinker
+			 * call will find it there */
+			lowmem_kills_deferred++;
+			rem -= lowmem_victim_size;
+			mutex_unlock(&lowmem_kill_mutex);
+			lowmem_print(4, "lowmem_shrink %d, %x, victim exiting, "
+				     "return %d\n", nr_to_scan, gfp_mask, rem);
+			return rem;
+		}
+		if (atomic_read(&lowmem_victim_mm->mm_users)) {
+			lowmem_print(2, "victim adj %d, size %d still alive "
+				     "after %u ms\n", lowmem_victim_adj,
+				     lowmem_victim_size, lowmem_exit_timeout_ms);
+			lowmem_kill_timeouts[lowmem_victim_adj - OOM_DISABLE]++;
+		}
+		done_mm = lowmem_victim_mm;
+		lowmem_victim_mm = NULL;
+	}
+
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+	/* the largest process with the highest adj, so stop at the first
+	 * list that has one */
+	spin_lock_irqsave(&lowmem_tasks_lock, flags);
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		list_for_each_entry(p, lowmem_task_list(adj), oom_adj_list) {
+			if (!p->mm)
+				continue;
+			tasksize = get_mm_rss(p->mm);
+			if (tasksize <= 0)
 				continue;
-			if (p->oomkilladj == selected->oomkilladj &&
-			    tasksize <= selected_tasksize)
+			if (selected && tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-		             p->pid, p->comm, p->oomkilladj, tasksize);
 	}
+	if (selected != NULL)
+		get_task_struct(selected);
+	spin_unlock_irqrestore(&lowmem_tasks_lock, flags);
 	if(selected != NULL) {
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+		             selected->pid, selected->comm,
+		             selected->oomkilladj, selected_tasksize);
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 		             selected->pid, selected->comm,
 		             selected->oomkilladj, selected_tasksize);
-		force_sig(SIGKILL, selected);
+		/* it may have been released since it left the lock */
+		read_lock(&tasklist_lock);
+		if (pid_alive(selected))
+			force_sig(SIGKILL, selected);
+		read_unlock(&tasklist_lock);
+
+		/* hold on to the mm to see when it is torn down */
+		task_lock(selected);
+		mm = selected->mm;
+		if (mm)
+			atomic_inc(&mm->mm_count);
+		task_unlock(selected);
+		lowmem_victim_mm = mm;
+		lowmem_victim_adj = selected->oomkilladj;
+		lowmem_victim_size = selected_tasksize;
+		lowmem_victim_timeout = jiffies +
+			msecs_to_jiffies(lowmem_exit_timeout_ms);
+		lowmem_kills[selected->oomkilladj - OOM_DISABLE][level]++;
+
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
+	mutex_unlock(&lowmem_kill_mutex);
+	if (done_mm)
+		mmdrop(done_mm);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n", nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -20,15 +20,22 @@
 #include <linux/mm.h>
 #include <linux/list.h>
 #include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
 #include <linux/pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/workqueue.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
 
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
+/* entries are ints, so no free block can be of a higher order */
+#define PMEM_NUM_ORDERS 31
+/* freed regions kept for reuse, per order */
+#define PMEM_RECYCLE_MAX 4
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -81,7 +88,19 @@ struct pmem_data {
 
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
+	unsigned free:1;		/* 1 if on the free list of its order */
 	unsigned order:7;		/* size of the region in pmem space */
+	/* 1 if a previous owner mapped the region cached and the cpu cache
+	 * may still hold its dirty lines, only set on recycled regions */
+	unsigned dirty:1;
+	/* 1 if the region was allocated with PMEM_ALLOCATE_MOVABLE and nothing
+	 * has pinned it for good since */
+	unsigned movable:1;
+	/* number of get_pmem_addr references, a pinned region is not moved */
+	unsigned pins:16;
+	/* entry in free_list[order] or recycle_list[order], only valid for
+	 * the first entry of a region */
+	struct list_head list;
 };
 
 struct pmem_region_node {
@@ -116,6 +135,29 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* the free regions of each order, and how many there are */
+	struct list_head free_list[PMEM_NUM_ORDERS];
+	unsigned long nr_free[PMEM_NUM_ORDERS];
+	/* regions freed by their owner but kept allocated for the next
+	 * allocation of the same order, most recently freed first */
+	struct list_head recycle_list[PMEM_NUM_ORDERS];
+	unsigned nr_recycled[PMEM_NUM_ORDERS];
+	/* allocation statistics for debugfs */
+	unsigned long nr_allocs;
+	unsigned long nr_alloc_failed;
+	unsigned long nr_recycle_hits;
+	unsigned long nr_compactions;
+	unsigned long nr_moved;
+	/* number of movable allocations */
+	unsigned long nr_movable;
+	/* index of the allocation being moved by compaction or -1, the
+	 * mappings of that allocation are unmapped while it is copied and
+	 * faults on them, get_pmem_addr and PMEM_CONNECT wait on move_wait
+	 * until it is done */
+	int move_index;
+	wait_queue_head_t move_wait;
+	/* moves movable allocations down, scheduled when an allocation fails */
+	struct work_struct compact_work;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -131,7 +173,8 @@ struct pmem_info {
 	 * needed */
 	struct semaphore data_list_sem;
 	struct list_head data_list;
-	/* pmem_sem protects the bitmap array
+	/* pmem_sem protects the bitmap array, the free and recycle lists,
+	 * move_index and the statistics
 	 * a write lock should be held when modifying entries in bitmap
 	 * a read lock should be held when reading data from bits or
 	 * dereferencing a pointer into bitmap
@@ -142,6 +185,10 @@ struct pmem_info {
 	 *
 	 * IF YOU TAKE BOTH LOCKS TAKE THEM IN THIS ORDER:
 	 * down(pmem_data->sem) => down(bitmap_sem)
+	 *
+	 * compaction holds data_list_sem for the whole move, it takes the
+	 * mmap_sem of the mappings it moves with a trylock since a fault in
+	 * them may be waiting for the move
 	 */
 	struct rw_semaphore bitmap_sem;
 
@@ -152,7 +199,7 @@ struct pmem_info {
 static struct pmem_info pmem[PMEM_MAX_DEVICES];
 static int id_count;
 
-#define PMEM_IS_FREE(id, index) !(pmem[id].bitmap[index].allocated)
+#define PMEM_IS_FREE(id, index) (pmem[id].bitmap[index].free)
 #define PMEM_ORDER(id, index) pmem[id].bitmap[index].order
 #define PMEM_BUDDY_INDEX(id, index) (index ^ (1 << PMEM_ORDER(id, index)))
 #define PMEM_NEXT_INDEX(id, index) (index + (1 << PMEM_ORDER(id, index)))
@@ -232,10 +279,37 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static void pmem_add_free(int id, int index, int order)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	PMEM_ORDER(id, index) = order;
+	pmem[id].bitmap[index].free = 1;
+	list_add(&pmem[id].bitmap[index].list, &pmem[id].free_list[order]);
+	pmem[id].nr_free[order]++;
+}
+
+static void pmem_del_free(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	pmem[id].bitmap[index].free = 0;
+	list_del(&pmem[id].bitmap[index].list);
+	pmem[id].nr_free[PMEM_ORDER(id, index)]--;
+}
+
+static void pmem_clear_movable(int id, int index)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	if (pmem[id].bitmap[index].movable) {
+		pmem[id].bitmap[index].movable = 0;
+		pmem[id].nr_movable--;
+	}
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	int buddy, curr = index;
+	int order;
 	DLOG("index %d\n", index);
 
 	if (pmem[id].no_allocator) {
@@ -244,25 +318,102 @@ static int pmem_free(int id, int index)
 	}
 	/* clean up the bitmap, merging any buddies */
 	pmem[id].bitmap[curr].allocated = 0;
+	order = PMEM_ORDER(id, curr);
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
 	 * if the buddy is also free merge them
 	 * repeat until the buddy is not free or end of the bitmap is reached
 	 */
-	do {
-		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
+	while (order < PMEM_NUM_ORDERS - 1) {
+		buddy = curr ^ (1 << order);
+		if (buddy + (1 << order) > pmem[id].num_entries ||
+		    !PMEM_IS_FREE(id, buddy) || PMEM_ORDER(id, buddy) != order)
 			break;
-		}
-	} while (curr < pmem[id].num_entries);
+		pmem_del_free(id, buddy);
+		curr = min(buddy, curr);
+		order++;
+	}
+	pmem_add_free(id, curr, order);
 
 	return 0;
 }
 
+/* keep a freed region for the next allocation of its order instead of
+ * merging it back, camera and video buffers are freed and allocated again
+ * at the same sizes for every session */
+static int pmem_recycle(int id, int index, int dirty)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order;
+
+	if (pmem[id].no_allocator)
+		return pmem_free(id, index);
+	pmem_clear_movable(id, index);
+	order = PMEM_ORDER(id, index);
+	if (pmem[id].nr_recycled[order] >= PMEM_RECYCLE_MAX)
+		return pmem_free(id, index);
+
+	pmem[id].bitmap[index].dirty |= dirty;
+	list_add(&pmem[id].bitmap[index].list, &pmem[id].recycle_list[order]);
+	pmem[id].nr_recycled[order]++;
+	return 0;
+}
+
+static int pmem_recycle_get(int id, int order)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_bits *bits;
+
+	if (list_empty(&pmem[id].recycle_list[order]))
+		return -1;
+	bits = list_first_entry(&pmem[id].recycle_list[order],
+				struct pmem_bits, list);
+	list_del(&bits->list);
+	pmem[id].nr_recycled[order]--;
+	return bits - pmem[id].bitmap;
+}
+
+/* give every recycled region back to the allocator, returns whether there
+ * were any */
+static int pmem_recycle_drain(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int order, index, drained = 0;
+
+	for (order = 0; order < PMEM_NUM_ORDERS; order++) {
+		while ((index = pmem_recycle_get(id, order)) >= 0) {
+			/* whoever gets the space next may not flush it */
+			if (pmem[id].bitmap[index].dirty) {
+				void *vaddr = pmem[id].vbase +
+					PMEM_OFFSET(index);
+
+				dmac_flush_range(vaddr,
+						 vaddr + PMEM_LEN(id, index));
+				pmem[id].bitmap[index].dirty = 0;
+			}
+			pmem_free(id, index);
+			drained = 1;
+		}
+	}
+	return drained;
+}
+
+/* flush the lines a previous owner may have left in the cpu cache before
+ * the region is mapped uncached or handed to hardware, cached users flush
+ * the region themselves */
+static void pmem_flush_recycled(int id, int index)
+{
+	if (pmem[id].no_allocator)
+		return;
+	down_write(&pmem[id].bitmap_sem);
+	if (pmem[id].bitmap[index].dirty) {
+		void *vaddr = pmem[id].vbase + PMEM_OFFSET(index);
+
+		dmac_flush_range(vaddr, vaddr + PMEM_LEN(id, index));
+		pmem[id].bitmap[index].dirty = 0;
+	}
+	up_write(&pmem[id].bitmap_sem);
+}
+
 static void pmem_revoke(struct file *file, struct pmem_data *data);
 
 static int pmem_release(struct inode *inode, struct file *file)
@@ -297,8 +448,11 @@ static int pmem_release(struct inode *inode, struct file *file)
 
 	/* if its not a conencted file and it has an allocation, free it */
 	if (!(PMEM_FLAGS_CONNECTED & data->flags) && has_allocation(file)) {
+		int dirty = (PMEM_FLAGS_MASTERMAP & data->flags) &&
+			pmem[id].cached && !(file->f_flags & O_SYNC);
+
 		down_write(&pmem[id].bitmap_sem);
-		ret = pmem_free(id, data->index);
+		ret = pmem_recycle(id, data->index, dirty);
 		up_write(&pmem[id].bitmap_sem);
 	}
 
@@ -376,12 +530,31 @@ static unsigned long pmem_order(unsigned long len)
 	return i;
 }
 
+static void pmem_take_free(int id, int index, unsigned long order)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	pmem_del_free(id, index);
+
+	/* now partition the region:
+	 * 	split the slot into 2 buddies of order - 1, freeing the upper
+	 * 	one, repeat until the slot is of the correct order
+	 */
+	while (PMEM_ORDER(id, index) > (unsigned char)order) {
+		int buddy;
+		PMEM_ORDER(id, index) -= 1;
+		buddy = PMEM_BUDDY_INDEX(id, index);
+		pmem_add_free(id, buddy, PMEM_ORDER(id, index));
+	}
+	pmem[id].bitmap[index].allocated = 1;
+	pmem[id].bitmap[index].dirty = 0;
+	pmem[id].bitmap[index].pins = 0;
+}
+
 static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
+	int curr;
 	int best_fit = -1;
 	unsigned long order = pmem_order(len);
 
@@ -393,49 +566,68 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (order > PMEM_MAX_ORDER || order >= PMEM_NUM_ORDERS)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
-	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
+	/* reuse a recently freed region of the same order if there is one */
+	best_fit = pmem_recycle_get(id, order);
+	if (best_fit >= 0) {
+		pmem[id].nr_recycle_hits++;
+		pmem[id].nr_allocs++;
+		return best_fit;
+	}
+
+retry:
+	/* take a free slot of the correct order if there is one, otherwise
+	 * one of the smallest order above it */
+	for (curr = order; curr < PMEM_NUM_ORDERS; curr++) {
+		if (!list_empty(&pmem[id].free_list[curr])) {
+			best_fit = list_first_entry(&pmem[id].free_list[curr],
+						    struct pmem_bits, list) -
+				pmem[id].bitmap;
+			break;
 		}
-		curr = PMEM_NEXT_INDEX(id, curr);
 	}
 
 	/* if best_fit < 0, there are no suitable slots,
 	 * return an error
 	 */
 	if (best_fit < 0) {
+		/* the recycled regions may be all that is in the way */
+		if (pmem_recycle_drain(id))
+			goto retry;
+		pmem[id].nr_alloc_failed++;
 		printk("pmem: no space left to allocate!\n");
+		/* the caller can retry once compaction made room */
+		if (pmem[id].nr_movable)
+			schedule_work(&pmem[id].compact_work);
 		return -1;
 	}
+	pmem_take_free(id, best_fit, order);
+	pmem[id].nr_allocs++;
+	return best_fit;
+}
 
-	/* now partition the best fit:
-	 * 	split the slot into 2 buddies of order - 1
-	 * 	repeat until the slot is of the correct order
-	 */
-	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
-		int buddy;
-		PMEM_ORDER(id, best_fit) -= 1;
-		buddy = PMEM_BUDDY_INDEX(id, best_fit);
-		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+/* allocate the lowest free region of the given order below limit, returns
+ * -1 if every such region is above it */
+static int pmem_allocate_below(int id, unsigned long order, int limit)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_bits *bits;
+	int curr, index, lowest = limit;
+
+	for (curr = order; curr < PMEM_NUM_ORDERS; curr++) {
+		list_for_each_entry(bits, &pmem[id].free_list[curr], list) {
+			index = bits - pmem[id].bitmap;
+			if (index < lowest)
+				lowest = index;
+		}
 	}
-	pmem[id].bitmap[best_fit].allocated = 1;
-	return best_fit;
+	if (lowest == limit)
+		return -1;
+	pmem_take_free(id, lowest, order);
+	return lowest;
 }
 
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
@@ -532,6 +724,38 @@ static int pmem_remap_pfn_range(int id, struct vm_area_struct *vma,
 	return pmem_map_pfn_range(id, vma, data, offset, len);
 }
 
+static int pmem_is_moving(int id, struct pmem_data *data)
+{
+	/* caller should hold data->sem */
+	int ret;
+
+	if (pmem[id].no_allocator || data->index < 0)
+		return 0;
+	down_read(&pmem[id].bitmap_sem);
+	ret = data->index == pmem[id].move_index;
+	up_read(&pmem[id].bitmap_sem);
+	return ret;
+}
+
+/* map a range of the allocation, if it is being moved leave it unmapped and
+ * let pmem_vma_fault map it at its new address once the move is done */
+static int pmem_map_or_defer(int id, struct vm_area_struct *vma,
+			     struct pmem_data *data, unsigned long offset,
+			     unsigned long len)
+{
+	if (pmem_is_moving(id, data)) {
+		vma->vm_flags |= VM_IO | VM_RESERVED | VM_PFNMAP;
+		zap_page_range(vma, vma->vm_start + offset, len, NULL);
+		return 0;
+	}
+	return pmem_remap_pfn_range(id, vma, data, offset, len);
+}
+
+static void pmem_wait_move(int id, int index)
+{
+	wait_event(pmem[id].move_wait, pmem[id].move_index != index);
+}
+
 static void pmem_vma_open(struct vm_area_struct *vma)
 {
 	struct file *file = vma->vm_file;
@@ -570,9 +794,55 @@ static void pmem_vma_close(struct vm_area_struct *vma)
 	up_write(&data->sem);
 }
 
+/* pmem mappings are populated when they are made, only ranges unmapped by
+ * compaction fault */
+static int pmem_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct file *file = vma->vm_file;
+	struct pmem_data *data = file->private_data;
+	struct pmem_region_node *region_node;
+	unsigned long addr = (unsigned long)vmf->virtual_address;
+	unsigned long offset = addr - vma->vm_start;
+	int id = get_id(file);
+	unsigned long pfn = pmem[id].garbage_pfn;
+	int index, ret;
+
+	for (;;) {
+		down_read(&data->sem);
+		if (!pmem_is_moving(id, data))
+			break;
+		index = data->index;
+		up_read(&data->sem);
+		pmem_wait_move(id, index);
+	}
+
+	if (data->vma != vma || !has_allocation(file)) {
+		/* not the mapping of this file, forkers get the garbage page */
+	} else if (data->flags & PMEM_FLAGS_MASTERMAP) {
+		pfn = (pmem_start_addr(id, data) + offset) >> PAGE_SHIFT;
+	} else if (PMEM_IS_SUBMAP(data)) {
+		list_for_each_entry(region_node, &data->region_list, list) {
+			if (offset >= region_node->region.offset &&
+			    offset < region_node->region.offset +
+				     region_node->region.len) {
+				pfn = (pmem_start_addr(id, data) + offset) >>
+					PAGE_SHIFT;
+				break;
+			}
+		}
+	}
+	ret = vm_insert_pfn(vma, addr & PAGE_MASK, pfn);
+	up_read(&data->sem);
+
+	if (ret == -ENOMEM)
+		return VM_FAULT_OOM;
+	return VM_FAULT_NOPAGE;
+}
+
 static struct vm_operations_struct vm_ops = {
 	.open = pmem_vma_open,
 	.close = pmem_vma_close,
+	.fault = pmem_vma_fault,
 };
 
 static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
@@ -645,9 +915,9 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 			DLOG("remapping file: %p %lx %lx\n", file,
 				region_node->region.offset,
 				region_node->region.len);
-			if (pmem_remap_pfn_range(id, vma, data,
-						 region_node->region.offset,
-						 region_node->region.len)) {
+			if (pmem_map_or_defer(id, vma, data,
+					      region_node->region.offset,
+					      region_node->region.len)) {
 				ret = -EAGAIN;
 				goto error;
 			}
@@ -662,12 +932,26 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		DLOG("submmapped file %p vma %p pid %u\n", file, vma,
 		     current->pid);
 	} else {
-		if (pmem_map_pfn_range(id, vma, data, 0, vma_size)) {
+		if (!pmem[id].cached || file->f_flags & O_SYNC)
+			pmem_flush_recycled(id, data->index);
+		/* private mappings can't be refaulted after a move */
+		if (!pmem[id].no_allocator && !(vma->vm_flags & VM_SHARED)) {
+			down_write(&pmem[id].bitmap_sem);
+			if (data->index == pmem[id].move_index) {
+				up_write(&pmem[id].bitmap_sem);
+				ret = -EAGAIN;
+				goto error;
+			}
+			pmem_clear_movable(id, data->index);
+			up_write(&pmem[id].bitmap_sem);
+		}
+		if (pmem_map_or_defer(id, vma, data, 0, vma_size)) {
 			printk(KERN_INFO "pmem: mmap failed in kernel!\n");
 			ret = -EAGAIN;
 			goto error;
 		}
 		data->flags |= PMEM_FLAGS_MASTERMAP;
+		data->vma = vma;
 		data->pid = current->pid;
 	}
 	vma->vm_ops = &vm_ops;
@@ -676,6 +960,44 @@ error:
 	return ret;
 }
 
+/* keep the allocation of data where it is, waiting for a move in progress
+ * to finish first. permanent pins are for physical addresses handed to
+ * userspace, which are never given back. returns with data->sem held for
+ * reading */
+static void pmem_pin(int id, struct pmem_data *data, int permanent)
+{
+	int index;
+
+	for (;;) {
+		down_read(&data->sem);
+		if (pmem[id].no_allocator || data->index < 0)
+			return;
+		down_write(&pmem[id].bitmap_sem);
+		if (data->index != pmem[id].move_index)
+			break;
+		index = data->index;
+		up_write(&pmem[id].bitmap_sem);
+		up_read(&data->sem);
+		pmem_wait_move(id, index);
+	}
+	if (permanent)
+		pmem_clear_movable(id, data->index);
+	else
+		pmem[id].bitmap[data->index].pins++;
+	up_write(&pmem[id].bitmap_sem);
+}
+
+static void pmem_unpin(int id, struct pmem_data *data)
+{
+	down_read(&data->sem);
+	if (!pmem[id].no_allocator && data->index >= 0) {
+		down_write(&pmem[id].bitmap_sem);
+		pmem[id].bitmap[data->index].pins--;
+		up_write(&pmem[id].bitmap_sem);
+	}
+	up_read(&data->sem);
+}
+
 /* the following are the api for accessing pmem regions by other drivers
  * from inside the kernel */
 int get_pmem_user_addr(struct file *file, unsigned long *start,
@@ -722,7 +1044,8 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	}
 	id = get_id(file);
 
-	down_read(&data->sem);
+	pmem_pin(id, data, 0);
+	pmem_flush_recycled(id, data->index);
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
@@ -777,6 +1100,7 @@ void put_pmem_file(struct file *file)
 	data->ref--;
 	up_write(&data->sem);
 #endif
+	pmem_unpin(id, data);
 	fput(file);
 }
 
@@ -826,8 +1150,10 @@ static int pmem_connect(unsigned long connect, struct file *file)
 	struct pmem_data *data = (struct pmem_data *)file->private_data;
 	struct pmem_data *src_data;
 	struct file *src_file;
-	int ret = 0, put_needed;
+	int id = get_id(file);
+	int ret = 0, put_needed, index;
 
+retry:
 	down_write(&data->sem);
 	/* retrieve the src file and check it is a pmem file with an alloc */
 	src_file = fget_light(connect, &put_needed);
@@ -851,7 +1177,22 @@ static int pmem_connect(unsigned long connect, struct file *file)
 		ret = -EINVAL;
 		goto err_bad_file;
 	}
-	data->index = src_data->index;
+	/* don't connect to an allocation that is being moved, compaction
+	 * would miss this file */
+	if (!pmem[id].no_allocator) {
+		down_read(&pmem[id].bitmap_sem);
+		index = src_data->index;
+		if (index == pmem[id].move_index) {
+			up_read(&pmem[id].bitmap_sem);
+			fput_light(src_file, put_needed);
+			up_write(&data->sem);
+			pmem_wait_move(id, index);
+			goto retry;
+		}
+		data->index = index;
+		up_read(&pmem[id].bitmap_sem);
+	} else
+		data->index = src_data->index;
 	data->flags |= PMEM_FLAGS_CONNECTED;
 	data->master_fd = connect;
 	data->master_file = src_file;
@@ -1009,8 +1350,8 @@ int pmem_remap(struct pmem_region *region, struct file *file,
 
 	if (data->vma && PMEM_IS_SUBMAP(data)) {
 		if (operation == PMEM_MAP)
-			ret = pmem_remap_pfn_range(id, data->vma, data,
-						   region->offset, region->len);
+			ret = pmem_map_or_defer(id, data->vma, data,
+						region->offset, region->len);
 		else if (operation == PMEM_UNMAP)
 			ret = pmem_unmap_pfn_range(id, data->vma, data,
 						   region->offset, region->len);
@@ -1052,6 +1393,157 @@ static void pmem_revoke(struct file *file, struct pmem_data *data)
 	pmem_unlock_data_and_mm(data, mm);
 }
 
+/* unmap the allocation at index from the mapping of data, if it has one,
+ * accesses fault in pmem_vma_fault and wait for the move to finish.
+ * dropping the last reference to an mm releases its files, which takes
+ * data_list_sem, so that reference is handed back in put_mm instead */
+static int pmem_move_unmap(int id, struct pmem_data *data, int index,
+			   struct mm_struct **put_mm)
+{
+	struct pmem_region_node *region_node;
+	struct vm_area_struct *vma;
+	struct mm_struct *mm = NULL;
+	int ret = 0;
+
+	down_read(&data->sem);
+	if (data->index != index) {
+		up_read(&data->sem);
+		return 0;
+	}
+	/* the vma, and so its mm, can't go away before vma_close clears
+	 * data->vma, but the mm may already be exiting */
+	if (data->vma) {
+		/* only one reference can be handed back, so don't take
+		 * another one that might have to be */
+		if (*put_mm) {
+			up_read(&data->sem);
+			return -EAGAIN;
+		}
+		mm = data->vma->vm_mm;
+		if (!atomic_inc_not_zero(&mm->mm_users))
+			mm = NULL;
+	}
+	up_read(&data->sem);
+
+	/* a fault in this mm may already be waiting for the move */
+	if (mm && !down_write_trylock(&mm->mmap_sem)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	down_write(&data->sem);
+	vma = data->vma;
+	if (vma && vma->vm_mm != mm) {
+		ret = -EAGAIN;
+	} else if (vma && (data->flags & PMEM_FLAGS_MASTERMAP)) {
+		zap_page_range(vma, vma->vm_start, vma->vm_end - vma->vm_start,
+			       NULL);
+	} else if (vma && PMEM_IS_SUBMAP(data)) {
+		list_for_each_entry(region_node, &data->region_list, list)
+			zap_page_range(vma,
+				       vma->vm_start + region_node->region.offset,
+				       region_node->region.len, NULL);
+	}
+	up_write(&data->sem);
+	if (mm)
+		up_write(&mm->mmap_sem);
+out:
+	if (mm && !atomic_add_unless(&mm->mm_users, -1, 1))
+		*put_mm = mm;
+	return ret;
+}
+
+/* move a movable allocation to the lowest free region below it */
+static void pmem_move(int id, struct pmem_data *data, struct mm_struct **put_mm)
+{
+	/* caller should hold data_list_sem */
+	struct pmem_data *sub_data;
+	int index, new;
+	void *from, *to;
+	unsigned long len;
+
+	down_read(&data->sem);
+	index = (data->flags & PMEM_FLAGS_CONNECTED) ? -1 : data->index;
+	up_read(&data->sem);
+	if (index < 0)
+		return;
+
+	down_write(&pmem[id].bitmap_sem);
+	if (!pmem[id].bitmap[index].movable || pmem[id].bitmap[index].pins) {
+		up_write(&pmem[id].bitmap_sem);
+		return;
+	}
+	new = pmem_allocate_below(id, PMEM_ORDER(id, index), index);
+	if (new < 0) {
+		up_write(&pmem[id].bitmap_sem);
+		return;
+	}
+	pmem[id].move_index = index;
+	up_write(&pmem[id].bitmap_sem);
+
+	/* the master and every file connected to it share the index */
+	list_for_each_entry(sub_data, &pmem[id].data_list, list)
+		if (pmem_move_unmap(id, sub_data, index, put_mm))
+			goto abort;
+
+	from = pmem[id].vbase + PMEM_OFFSET(index);
+	to = pmem[id].vbase + PMEM_OFFSET(new);
+	len = PMEM_LEN(id, index);
+	dmac_flush_range(from, from + len);
+	memcpy(to, from, len);
+	dmac_flush_range(to, to + len);
+
+	list_for_each_entry(sub_data, &pmem[id].data_list, list) {
+		down_write(&sub_data->sem);
+		if (sub_data->index == index)
+			sub_data->index = new;
+		up_write(&sub_data->sem);
+	}
+
+	down_write(&pmem[id].bitmap_sem);
+	pmem[id].bitmap[new].movable = 1;
+	pmem[id].bitmap[index].movable = 0;
+	pmem_free(id, index);
+	pmem[id].move_index = -1;
+	pmem[id].nr_moved++;
+	up_write(&pmem[id].bitmap_sem);
+	wake_up_all(&pmem[id].move_wait);
+	return;
+
+abort:
+	down_write(&pmem[id].bitmap_sem);
+	pmem_free(id, new);
+	pmem[id].move_index = -1;
+	up_write(&pmem[id].bitmap_sem);
+	wake_up_all(&pmem[id].move_wait);
+}
+
+/* pack the movable allocations towards the start of the region so the free
+ * space above them merges back into large regions */
+static void pmem_compact(struct work_struct *work)
+{
+	struct pmem_info *info = container_of(work, struct pmem_info,
+					      compact_work);
+	int id = info - pmem;
+	struct pmem_data *data;
+	struct mm_struct *put_mm = NULL;
+
+	down(&pmem[id].data_list_sem);
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		pmem_move(id, data, &put_mm);
+		/* a process went away under us, its files are released when
+		 * the mm is put, leave the rest to the next pass */
+		if (put_mm)
+			break;
+	}
+	up(&pmem[id].data_list_sem);
+	if (put_mm)
+		mmput(put_mm);
+
+	down_write(&pmem[id].bitmap_sem);
+	pmem[id].nr_compactions++;
+	up_write(&pmem[id].bitmap_sem);
+}
+
 static void pmem_get_size(struct pmem_region *region, struct file *file)
 {
 	struct pmem_data *data = (struct pmem_data *)file->private_data;
@@ -1084,8 +1576,11 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				region.len = 0;
 			} else {
 				data = (struct pmem_data *)file->private_data;
+				/* the address escapes, never move it again */
+				pmem_pin(id, data, 1);
 				region.offset = pmem_start_addr(id, data);
 				region.len = pmem_len(id, data);
+				up_read(&data->sem);
 			}
 			printk(KERN_INFO "pmem: request for physical address of pmem region "
 					"from process %d.\n", current->pid);
@@ -1141,7 +1636,25 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
+			down_write(&pmem[id].bitmap_sem);
 			data->index = pmem_allocate(id, arg);
+			up_write(&pmem[id].bitmap_sem);
+			break;
+		}
+	case PMEM_ALLOCATE_MOVABLE:
+		{
+			if (has_allocation(file))
+				return -EINVAL;
+			data = (struct pmem_data *)file->private_data;
+			down_write(&data->sem);
+			down_write(&pmem[id].bitmap_sem);
+			data->index = pmem_allocate(id, arg);
+			if (data->index >= 0 && !pmem[id].no_allocator) {
+				pmem[id].bitmap[data->index].movable = 1;
+				pmem[id].nr_movable++;
+			}
+			up_write(&pmem[id].bitmap_sem);
+			up_write(&data->sem);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1206,6 +1719,54 @@ static struct file_operations debug_fops = {
 	.read = debug_read,
 	.open = debug_open,
 };
+
+static int debug_stats_show(struct seq_file *m, void *unused)
+{
+	int id = (int)m->private;
+	unsigned long free = 0, largest = 0, recycled;
+	int i;
+
+	down_read(&pmem[id].bitmap_sem);
+	seq_printf(m, "order  free regions\n");
+	for (i = 0; i < PMEM_NUM_ORDERS; i++) {
+		if (!pmem[id].nr_free[i])
+			continue;
+		seq_printf(m, "%5d  %lu\n", i, pmem[id].nr_free[i]);
+		free += pmem[id].nr_free[i] << i;
+		largest = 1UL << i;
+	}
+	seq_printf(m, "entries: %lu\n", pmem[id].num_entries);
+	seq_printf(m, "free entries: %lu\n", free);
+	seq_printf(m, "largest free region: %lu\n", largest);
+	/* the share of the free space outside the largest free region */
+	seq_printf(m, "fragmentation: %lu%%\n",
+		   free ? (free - largest) * 100 / free : 0);
+	seq_printf(m, "allocations: %lu\n", pmem[id].nr_allocs);
+	seq_printf(m, "failed allocations: %lu\n", pmem[id].nr_alloc_failed);
+	for (i = 0, recycled = 0; i < PMEM_NUM_ORDERS; i++)
+		recycled += pmem[id].nr_recycled[i] << i;
+	seq_printf(m, "recycled entries: %lu\n", recycled);
+	seq_printf(m, "recycle hits: %lu (%lu%%)\n", pmem[id].nr_recycle_hits,
+		   pmem[id].nr_allocs ?
+		   pmem[id].nr_recycle_hits * 100 / pmem[id].nr_allocs : 0);
+	seq_printf(m, "movable allocations: %lu\n", pmem[id].nr_movable);
+	seq_printf(m, "compactions: %lu\n", pmem[id].nr_compactions);
+	seq_printf(m, "moved allocations: %lu\n", pmem[id].nr_moved);
+	up_read(&pmem[id].bitmap_sem);
+	return 0;
+}
+
+static int debug_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, debug_stats_show, inode->i_private);
+}
+
+static struct file_operations debug_stats_fops = {
+	.open = debug_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 #endif
 
 #if 0
@@ -1234,6 +1795,9 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	init_rwsem(&pmem[id].bitmap_sem);
 	init_MUTEX(&pmem[id].data_list_sem);
 	INIT_LIST_HEAD(&pmem[id].data_list);
+	pmem[id].move_index = -1;
+	init_waitqueue_head(&pmem[id].move_wait);
+	INIT_WORK(&pmem[id].compact_work, pmem_compact);
 	pmem[id].dev.name = pdata->name;
 	pmem[id].dev.minor = id;
 	pmem[id].dev.fops = &pmem_fops;
@@ -1246,17 +1810,23 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	}
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
-	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
-				  sizeof(struct pmem_bits), GFP_KERNEL);
+	/* with the free list links an entry is too large for one kmalloc of
+	 * a big region */
+	pmem[id].bitmap = vmalloc(pmem[id].num_entries *
+				  sizeof(struct pmem_bits));
 	if (!pmem[id].bitmap)
 		goto err_no_mem_for_metadata;
 
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
 
-	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
+	for (i = 0; i < PMEM_NUM_ORDERS; i++) {
+		INIT_LIST_HEAD(&pmem[id].free_list[i]);
+		INIT_LIST_HEAD(&pmem[id].recycle_list[i]);
+	}
+	for (i = PMEM_NUM_ORDERS - 1; i >= 0; i--) {
 		if ((pmem[id].num_entries) &  1<<i) {
-			PMEM_ORDER(id, index) = i;
+			pmem_add_free(id, index, i);
 			index = PMEM_NEXT_INDEX(id, index);
 		}
 	}
@@ -1282,10 +1852,17 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #if PMEM_DEBUG
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
+	if (!pmem[id].no_allocator) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s_stats", pdata->name);
+		debugfs_create_file(name, S_IFREG | S_IRUGO, NULL, (void *)id,
+				    &debug_stats_fops);
+	}
 #endif
 	return 0;
 error_cant_remap:
-	kfree(pmem[id].bitmap);
+	vfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
 	misc_deregister(&pmem[id].dev);
 err_cant_register_device:
@@ -1308,6 +1885,7 @@ static int pmem_probe(struct platform_device *pdev)
 static int pmem_remove(struct platform_device *pdev)
 {
 	int id = pdev->id;
+	cancel_work_sync(&pmem[id].compact_work);
 	__free_page(pfn_to_page(pmem[id].garbage_pfn));
 	misc_deregister(&pmem[id].dev);
 	return 0;
@@ -1013,7 +1013,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 		put_task_struct(task);
 		return -EACCES;
 	}
-	task->oomkilladj = oom_adjust;
+	lowmem_set_oomkilladj(task, oom_adjust);
 	put_task_struct(task);
 	if (end - buffer == 0)
 		return -EIO;
@@ -27,11 +27,22 @@
 #define ASHMEM_IS_UNPINNED	0
 #define ASHMEM_IS_PINNED	1
 
+/* Purge cost hints: under memory pressure the cheapest ranges go first */
+#define ASHMEM_PURGE_COST_LOW		0
+#define ASHMEM_PURGE_COST_NORMAL	1	/* the default when unpinned */
+#define ASHMEM_PURGE_COST_HIGH		2
+
 struct ashmem_pin {
 	__u32 offset;	/* offset into region, in bytes, page-aligned */
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+struct ashmem_purge_cost {
+	__u32 offset;	/* offset into region, in bytes, page-aligned */
+	__u32 len;	/* length forward from offset, in bytes, page-aligned */
+	__u32 cost;	/* ASHMEM_PURGE_COST_* */
+};
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -44,5 +55,7 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_SET_PURGE_COST	_IOW(__ASHMEMIOC, 11, struct ashmem_purge_cost)
+#define ASHMEM_SET_PURGE_EVENTFD	_IO(__ASHMEMIOC, 12)
 
 #endif	/* _LINUX_ASHMEM_H */
@@ -35,8 +35,18 @@ enum {
 };
 
 enum {
+	/*
+	 * Minimum priority of the threads handling transactions for a node,
+	 * a nice value for SCHED_NORMAL/SCHED_BATCH or an rt priority for
+	 * SCHED_FIFO/SCHED_RR.
+	 */
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/* scheduling policy of the minimum priority above */
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
+	/* let callers with an rt policy pass it on to the node */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -84,6 +94,20 @@ struct binder_version {
 /* This is the current protocol version. */
 #define BINDER_CURRENT_PROTOCOL_VERSION 7
 
+/*
+ * Use with BINDER_VERSION_FEATURES, driver fills in fields. Drivers that
+ * only know the plain BINDER_VERSION fail it with EINVAL.
+ */
+struct binder_version_features {
+	signed long	protocol_version;
+	unsigned long	features;	/* BINDER_FEATURE_* */
+};
+
+/* BC_TRANSACTION_SG and BC_REPLY_SG are supported. */
+#define BINDER_FEATURE_TRANSACTION_SG	0x01
+/* BINDER_SET_IDLE_TIMEOUT is honoured with BR_RETIRE_LOOPER. */
+#define BINDER_FEATURE_RETIRE_LOOPER	0x02
+
 #define BINDER_WRITE_READ   		_IOWR('b', 1, struct binder_write_read)
 #define	BINDER_SET_IDLE_TIMEOUT		_IOW('b', 3, int64_t)
 #define	BINDER_SET_MAX_THREADS		_IOW('b', 5, size_t)
@@ -91,6 +115,7 @@ struct binder_version {
 #define	BINDER_SET_CONTEXT_MGR		_IOW('b', 7, int)
 #define	BINDER_THREAD_EXIT		_IOW('b', 8, int)
 #define BINDER_VERSION			_IOWR('b', 9, struct binder_version)
+#define BINDER_VERSION_FEATURES		_IOWR('b', 10, struct binder_version_features)
 
 /*
  * NOTE: Two special error codes you should check for when calling
@@ -147,6 +172,17 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Used with BC_TRANSACTION_SG and BC_REPLY_SG. The data is gathered from
+ * 'data_iov' instead of transaction_data.data.ptr.buffer; the lengths of
+ * the iovecs must add up to transaction_data.data_size.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	const void	*data_iov;	/* const struct iovec * */
+	size_t		data_iov_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -249,6 +285,14 @@ enum BinderDriverReturnProtocol {
 	 * The the last transaction (either a bcTRANSACTION or
 	 * a bcATTEMPT_ACQUIRE) failed (e.g. out of memory).  No parameters.
 	 */
+
+	BR_RETIRE_LOOPER = _IO('r', 18),
+	/*
+	 * No parameters.  The looper thread spawned for this process has
+	 * been idle for longer than the timeout set with
+	 * BINDER_SET_IDLE_TIMEOUT and should exit with BC_EXIT_LOOPER and
+	 * BINDER_THREAD_EXIT.  Only sent after an idle timeout was set.
+	 */
 };
 
 enum BinderDriverCommandProtocol {
@@ -324,6 +368,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the data
+	 * gathered from a list of iovecs.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -17,7 +17,9 @@
 #define _LINUX_EARLYSUSPEND_H
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/workqueue.h>
 #endif
 
 /* The early_suspend structure defines suspend and resume hooks to be called
@@ -29,18 +31,37 @@
  * the suspend handlers have already been called without a matching call to the
  * resume handlers, the suspend handler will be called directly from
  * register_early_suspend. This direct call can violate the normal level order.
+ * Handlers of the same level may be called in parallel. If a handler has to
+ * be suspended before, and resumed after, another handler of the same level,
+ * set depends_on to that handler. depends_on is ignored if the handler it
+ * points to has another level, the level order applies then.
  */
 enum {
 	EARLY_SUSPEND_LEVEL_BLANK_SCREEN = 50,
 	EARLY_SUSPEND_LEVEL_STOP_DRAWING = 100,
 	EARLY_SUSPEND_LEVEL_DISABLE_FB = 150,
 };
+#ifdef CONFIG_HAS_EARLYSUSPEND
+struct early_suspend_stat {
+	unsigned int count;
+	ktime_t last_time;
+	ktime_t max_time;
+	ktime_t total_time;
+};
+#endif
+
 struct early_suspend {
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	struct list_head link;
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	struct early_suspend *depends_on;
+	/* private to kernel/power/earlysuspend.c */
+	struct work_struct work;
+	int state;
+	struct early_suspend_stat suspend_stat;
+	struct early_suspend_stat resume_stat;
 #endif
 };
 
@@ -30,6 +30,17 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_ctl - the first page of a mapped log, the ring
+ * follows on the next page. w_off and tail are free running byte
+ * positions, the ring offset of a position is pos & (size - 1).
+ */
+struct logger_mmap_ctl {
+	__u32		size;	/* size of the ring */
+	__u32		w_off;	/* end of the published entries */
+	__u32		tail;	/* oldest entry not yet overwritten */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_MAIN		"log_main"	/* everything else */
@@ -44,5 +55,8 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_LOG_BUF_SIZE		_IO(__LOGGERIO, 5) /* resize log */
+#define LOGGER_GET_OVERWRITTEN		_IO(__LOGGERIO, 6) /* entries lost */
+#define LOGGER_SET_BATCHED_READ		_IO(__LOGGERIO, 7) /* read() batches */
 
 #endif /* _LINUX_LOGGER_H */
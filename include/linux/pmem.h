@@ -33,6 +33,13 @@
  * struct (with offset set to 0). 
  */
 #define PMEM_GET_TOTAL_SIZE	_IOW(PMEM_IOCTL_MAGIC, 7, unsigned int)
+/* Like PMEM_ALLOCATE, but pmem may move the allocation to another physical
+ * address to defragment the region, the mappings of the file and of the
+ * files connected to it follow the move. The allocation stays where it is
+ * while it is held with get_pmem_file, and for good once its physical
+ * address is read with PMEM_GET_PHYS or it is mapped private.
+ */
+#define PMEM_ALLOCATE_MOVABLE	_IOW(PMEM_IOCTL_MAGIC, 8, unsigned int)
 
 struct android_pmem_platform_data
 {
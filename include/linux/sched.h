@@ -1108,6 +1108,10 @@ struct task_struct {
 	 */
 	unsigned char fpu_counter;
 	s8 oomkilladj; /* OOM kill score adjustment (bit shift). */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* entry in the lowmemorykiller list of processes with this oomkilladj */
+	struct list_head oom_adj_list;
+#endif
 #ifdef CONFIG_BLK_DEV_IO_TRACE
 	unsigned int btrace_seq;
 #endif
@@ -234,6 +234,10 @@ extern unsigned long shrink_all_memory(unsigned long nr_pages);
 extern int vm_swappiness;
 extern int remove_mapping(struct address_space *mapping, struct page *page);
 extern long vm_total_pages;
+/* pages scanned and reclaimed off the inactive anon [0] and file [1] lists
+ * by global reclaim since boot */
+extern atomic_long_t vm_reclaim_scanned[2];
+extern atomic_long_t vm_reclaim_reclaimed[2];
 
 #ifdef CONFIG_NUMA
 extern int zone_reclaim_mode;
@@ -18,6 +18,8 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
  * states when active. If the type is set to WAKE_LOCK_SUSPEND, the wake_lock
@@ -38,6 +40,10 @@ struct wake_lock {
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
+	/* protects flags, expires and stat of this lock */
+	spinlock_t          state_lock;
+	/* expires the lock when it was taken with a timeout */
+	struct timer_list   timer;
 #ifdef CONFIG_WAKELOCK_STAT
 	struct {
 		int             count;
@@ -45,6 +51,13 @@ struct wake_lock {
 		int             wakeup_count;
 		ktime_t         total_time;
 		ktime_t         prevent_suspend_time;
+		ktime_t         prevent_suspend_start;
+		/* time this was the only suspend lock keeping the system
+		 * from suspending */
+		ktime_t         sole_blocker_time;
+		/* time held with the screen off ([0]) and on ([1]) */
+		ktime_t         screen_time[2];
+		ktime_t         screen_time_start;
 		ktime_t         max_time;
 		ktime_t         last_time;
 	} stat;
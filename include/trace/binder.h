@@ -0,0 +1,28 @@
+#ifndef _TRACE_BINDER_H
+#define _TRACE_BINDER_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Transaction phases. The latency passed to the wakeup, read and reply
+ * probes is the time in ns since the transaction was sent.
+ */
+DEFINE_TRACE(binder_transaction_send,
+	TPPROTO(int debug_id, int reply, int from_pid, int to_pid,
+		int to_node),
+		TPARGS(debug_id, reply, from_pid, to_pid, to_node));
+
+DEFINE_TRACE(binder_transaction_wakeup,
+	TPPROTO(int debug_id, int pid, u64 latency),
+		TPARGS(debug_id, pid, latency));
+
+DEFINE_TRACE(binder_transaction_read,
+	TPPROTO(int debug_id, int pid, u64 latency),
+		TPARGS(debug_id, pid, latency));
+
+DEFINE_TRACE(binder_transaction_reply,
+	TPPROTO(int debug_id, int pid, u64 latency),
+		TPARGS(debug_id, pid, latency));
+
+#endif
@@ -46,6 +46,7 @@
 #include <linux/blkdev.h>
 #include <linux/task_io_accounting_ops.h>
 #include <linux/tracehook.h>
+#include <linux/oom.h>
 #include <trace/sched.h>
 
 #include <asm/uaccess.h>
@@ -69,6 +70,7 @@ static void __unhash_process(struct task_struct *p)
 		detach_pid(p, PIDTYPE_SID);
 
 		list_del_rcu(&p->tasks);
+		lowmem_task_del(p);
 		__get_cpu_var(process_counts)--;
 	}
 	list_del_rcu(&p->thread_group);
@@ -13,10 +13,13 @@
  *
  */
 
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -30,6 +33,15 @@ enum {
 static int debug_mask = DEBUG_USER_STATE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+#define MAX_HANDLER_THREADS 8
+/* number of threads handlers of the same level are spread over, 0 calls
+ * them one after the other from the suspend workqueue. off by default as
+ * handlers may expect to be called in registration order, boards whose
+ * handlers are safe to run together set earlysuspend.handler_threads on
+ * the command line */
+static int handler_threads;
+module_param_named(handler_threads, handler_threads, int, S_IRUGO);
+
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
 static void early_suspend(struct work_struct *work);
@@ -44,10 +56,182 @@ enum {
 };
 static int state;
 
+/* handler workers, and the handlers of the batch running on them. all of
+ * this is only used with early_suspend_lock held */
+static struct workqueue_struct *handler_wq[MAX_HANDLER_THREADS];
+static int nr_handler_wq;
+static int calling_resume;
+static atomic_t batch_pending;
+static DECLARE_COMPLETION(batch_done);
+static ktime_t last_suspend_time;
+static ktime_t last_resume_time;
+enum {
+	HANDLER_IDLE,
+	HANDLER_QUEUED,
+	HANDLER_DONE,
+};
+
+static void call_handler(struct early_suspend *h, int resume)
+{
+	struct early_suspend_stat *stat;
+	ktime_t start, duration;
+
+	start = ktime_get();
+	if (resume) {
+		h->resume(h);
+		stat = &h->resume_stat;
+	} else {
+		h->suspend(h);
+		stat = &h->suspend_stat;
+	}
+	duration = ktime_sub(ktime_get(), start);
+	stat->count++;
+	stat->last_time = duration;
+	stat->total_time = ktime_add(stat->total_time, duration);
+	if (ktime_to_ns(duration) > ktime_to_ns(stat->max_time))
+		stat->max_time = duration;
+	if (debug_mask & DEBUG_SUSPEND)
+		pr_info("%s: %pF took %lld ns\n",
+			resume ? "late_resume" : "early_suspend",
+			resume ? (void *)h->resume : (void *)h->suspend,
+			ktime_to_ns(duration));
+}
+
+static void handler_work(struct work_struct *work)
+{
+	struct early_suspend *h = container_of(work, struct early_suspend,
+					       work);
+
+	call_handler(h, calling_resume);
+	if (atomic_dec_and_test(&batch_pending))
+		complete(&batch_done);
+}
+
+static struct early_suspend *next_handler(struct early_suspend *h,
+					  int resume)
+{
+	struct list_head *next = resume ? h->link.prev : h->link.next;
+
+	if (next == &early_suspend_handlers)
+		return NULL;
+	return list_entry(next, struct early_suspend, link);
+}
+
+/* a handler is suspended before the handlers of its level it depends on, and
+ * resumed after them */
+static int handler_ready(struct early_suspend *h, struct early_suspend *first,
+			 struct early_suspend *end, int resume)
+{
+	struct early_suspend *pos;
+
+	if (resume)
+		return !h->depends_on || h->depends_on->level != h->level ||
+			h->depends_on->state == HANDLER_DONE;
+	for (pos = first; pos != end; pos = next_handler(pos, resume))
+		if (pos->depends_on == h && pos->state != HANDLER_DONE)
+			return 0;
+	return 1;
+}
+
+/* calls the handlers from first up to end, which all have the same level.
+ * each round queues every handler whose dependencies are done and waits for
+ * them */
+static void call_handler_batch(struct early_suspend *first,
+			       struct early_suspend *end, int resume)
+{
+	struct early_suspend *pos;
+	int left = 0;
+	int queued;
+	int i;
+
+	for (pos = first; pos != end; pos = next_handler(pos, resume)) {
+		if (resume ? pos->resume : pos->suspend) {
+			pos->state = HANDLER_IDLE;
+			left++;
+		} else
+			pos->state = HANDLER_DONE;
+	}
+
+	calling_resume = resume;
+	while (left) {
+		queued = 0;
+		for (pos = first; pos != end; pos = next_handler(pos, resume)) {
+			if (pos->state == HANDLER_IDLE &&
+			    handler_ready(pos, first, end, resume)) {
+				pos->state = HANDLER_QUEUED;
+				queued++;
+			}
+		}
+		if (!queued) {
+			pr_warning("%s: dependency loop at level %d\n",
+				   resume ? "late_resume" : "early_suspend",
+				   first->level);
+			for (pos = first; pos != end;
+			     pos = next_handler(pos, resume))
+				if (pos->state == HANDLER_IDLE)
+					pos->state = HANDLER_QUEUED;
+			queued = left;
+		}
+		if (queued == 1 || !nr_handler_wq) {
+			for (pos = first; pos != end;
+			     pos = next_handler(pos, resume))
+				if (pos->state == HANDLER_QUEUED)
+					call_handler(pos, resume);
+		} else {
+			INIT_COMPLETION(batch_done);
+			atomic_set(&batch_pending, queued);
+			i = 0;
+			for (pos = first; pos != end;
+			     pos = next_handler(pos, resume)) {
+				if (pos->state != HANDLER_QUEUED)
+					continue;
+				queue_work(handler_wq[i++ % nr_handler_wq],
+					   &pos->work);
+			}
+			wait_for_completion(&batch_done);
+		}
+		for (pos = first; pos != end; pos = next_handler(pos, resume))
+			if (pos->state == HANDLER_QUEUED)
+				pos->state = HANDLER_DONE;
+		left -= queued;
+	}
+}
+
+/* calls the suspend handlers from low to high level, or the resume handlers
+ * from high to low level */
+static void call_handlers(int resume)
+{
+	struct early_suspend *first, *end;
+	ktime_t start = ktime_get();
+
+	if (list_empty(&early_suspend_handlers))
+		return;
+	if (resume)
+		first = list_entry(early_suspend_handlers.prev,
+				   struct early_suspend, link);
+	else
+		first = list_entry(early_suspend_handlers.next,
+				   struct early_suspend, link);
+	while (first) {
+		end = next_handler(first, resume);
+		while (end && end->level == first->level)
+			end = next_handler(end, resume);
+		call_handler_batch(first, end, resume);
+		first = end;
+	}
+	if (resume)
+		last_resume_time = ktime_sub(ktime_get(), start);
+	else
+		last_suspend_time = ktime_sub(ktime_get(), start);
+}
+
 void register_early_suspend(struct early_suspend *handler)
 {
 	struct list_head *pos;
 
+	INIT_WORK(&handler->work, handler_work);
+	memset(&handler->suspend_stat, 0, sizeof(handler->suspend_stat));
+	memset(&handler->resume_stat, 0, sizeof(handler->resume_stat));
 	mutex_lock(&early_suspend_lock);
 	list_for_each(pos, &early_suspend_handlers) {
 		struct early_suspend *e;
@@ -72,7 +256,6 @@ EXPORT_SYMBOL(unregister_early_suspend);
 
 static void early_suspend(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
 
@@ -93,10 +276,7 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL)
-			pos->suspend(pos);
-	}
+	call_handlers(0);
 	mutex_unlock(&early_suspend_lock);
 
 	if (debug_mask & DEBUG_SUSPEND)
@@ -112,7 +292,6 @@ abort:
 
 static void late_resume(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
 
@@ -131,9 +310,7 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
-		if (pos->resume != NULL)
-			pos->resume(pos);
+	call_handlers(1);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -162,9 +339,11 @@ void request_suspend_state(suspend_state_t new_state)
 	}
 	if (!old_sleep && new_state != PM_SUSPEND_ON) {
 		state |= SUSPEND_REQUESTED;
+		wake_lock_set_screen_state(0);
 		queue_work(suspend_work_queue, &early_suspend_work);
 	} else if (old_sleep && new_state == PM_SUSPEND_ON) {
 		state &= ~SUSPEND_REQUESTED;
+		wake_lock_set_screen_state(1);
 		wake_lock(&main_wake_lock);
 		queue_work(suspend_work_queue, &late_resume_work);
 	}
@@ -176,3 +355,74 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+static void print_handler_stat(struct seq_file *m,
+			       struct early_suspend_stat *stat)
+{
+	seq_printf(m, "\t%u\t%lld\t%lld\t%lld", stat->count,
+		   ktime_to_ns(stat->last_time), ktime_to_ns(stat->max_time),
+		   ktime_to_ns(stat->total_time));
+}
+
+static int early_suspend_stats_show(struct seq_file *m, void *unused)
+{
+	struct early_suspend *pos;
+
+	mutex_lock(&early_suspend_lock);
+	seq_printf(m, "handler\tlevel\tsuspend_count\tsuspend_last"
+		   "\tsuspend_max\tsuspend_total\tresume_count\tresume_last"
+		   "\tresume_max\tresume_total\n");
+	list_for_each_entry(pos, &early_suspend_handlers, link) {
+		seq_printf(m, "%pF\t%d", pos->suspend ? (void *)pos->suspend :
+			   (void *)pos->resume, pos->level);
+		print_handler_stat(m, &pos->suspend_stat);
+		print_handler_stat(m, &pos->resume_stat);
+		seq_printf(m, "\n");
+	}
+	seq_printf(m, "\nlast early_suspend\t%lld\n",
+		   ktime_to_ns(last_suspend_time));
+	seq_printf(m, "last late_resume\t%lld\n",
+		   ktime_to_ns(last_resume_time));
+	mutex_unlock(&early_suspend_lock);
+	return 0;
+}
+
+static int early_suspend_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_stats_show, NULL);
+}
+
+static const struct file_operations early_suspend_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = early_suspend_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init early_suspend_init(void)
+{
+	char name[sizeof("early_suspend/") + 4];
+	int i;
+
+	if (handler_threads > MAX_HANDLER_THREADS)
+		handler_threads = MAX_HANDLER_THREADS;
+	for (i = 0; i < handler_threads; i++) {
+		snprintf(name, sizeof(name), "early_suspend/%d", i);
+		handler_wq[i] = create_singlethread_workqueue(name);
+		if (!handler_wq[i]) {
+			pr_err("early_suspend_init: only %d handler threads\n",
+			       i);
+			break;
+		}
+	}
+	mutex_lock(&early_suspend_lock);
+	nr_handler_wq = i;
+	mutex_unlock(&early_suspend_lock);
+
+	debugfs_create_file("early_suspend", S_IFREG | S_IRUGO, NULL, NULL,
+			    &early_suspend_stats_fops);
+	return 0;
+}
+
+late_initcall(early_suspend_init);
@@ -229,6 +229,11 @@ static inline void suspend_thaw_processes(void)
 extern struct workqueue_struct *suspend_work_queue;
 extern struct wake_lock main_wake_lock;
 extern suspend_state_t requested_suspend_state;
+#ifdef CONFIG_WAKELOCK_STAT
+void wake_lock_set_screen_state(int on);
+#else
+static inline void wake_lock_set_screen_state(int on) {}
+#endif
 #endif
 
 #ifdef CONFIG_USER_WAKELOCK
@@ -14,8 +14,11 @@
  */
 
 #include <linux/ctype.h>
+#include <linux/dcache.h>
+#include <linux/hash.h>
 #include <linux/module.h>
 #include <linux/wakelock.h>
+#include <linux/workqueue.h>
 
 #include "power.h"
 
@@ -29,20 +32,106 @@ enum {
 static int debug_mask = DEBUG_FAILURE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/* seconds a wake lock has to be unlocked and unused before it is destroyed,
+ * 0 keeps them forever */
+static int reap_idle_secs = 300;
+module_param_named(reap_idle_secs, reap_idle_secs, int,
+		   S_IRUGO | S_IWUSR | S_IWGRP);
+
+/* tree_lock protects the tree, the hash and the statistics */
 static DEFINE_MUTEX(tree_lock);
 
+#define USER_WAKE_LOCK_HASH_BITS 8
+
+/* the tree and the hash each hold a reference to the wake lock, shared by
+ * both, lookup_wake_lock_name returns another one */
 struct user_wake_lock {
 	struct rb_node		node;
+	struct hlist_node	hash;
+	atomic_t		refcount;
+	unsigned long		last_used;
 	struct wake_lock	wake_lock;
 	char			name[0];
 };
 struct rb_root user_wake_locks;
+static struct hlist_head user_wake_lock_hash[1 << USER_WAKE_LOCK_HASH_BITS];
+static int user_wake_lock_count;
+
+static unsigned long lookup_count;
+static unsigned long create_count;
+static unsigned long reap_count;
+/* counts at the last reap, to report the rates since then */
+static unsigned long last_lookup_count;
+static unsigned long last_create_count;
+static unsigned long last_stats_time = INITIAL_JIFFIES;
+
+static void reap_wake_locks(struct work_struct *work);
+static DECLARE_DELAYED_WORK(reap_work, reap_wake_locks);
+
+/* reap_idle_secs in jiffies, longer idle times are cut to a day */
+#define REAP_IDLE_SECS_MAX	(24 * 60 * 60)
+static unsigned long reap_idle_jiffies(void)
+{
+	return (unsigned long)min(reap_idle_secs, REAP_IDLE_SECS_MAX) * HZ;
+}
+
+static struct hlist_head *wake_lock_hash_head(const char *name, int name_len)
+{
+	unsigned int hash = full_name_hash((const unsigned char *)name,
+					   name_len);
+	return &user_wake_lock_hash[hash_long(hash, USER_WAKE_LOCK_HASH_BITS)];
+}
+
+static void put_user_wake_lock(struct user_wake_lock *l)
+{
+	if (!atomic_dec_and_test(&l->refcount))
+		return;
+	if (debug_mask & DEBUG_NEW)
+		pr_info("put_user_wake_lock: destroy wake lock %s\n", l->name);
+	wake_lock_destroy(&l->wake_lock);
+	kfree(l);
+}
+
+static void reap_wake_locks(struct work_struct *work)
+{
+	struct rb_node *n, *next;
+	struct user_wake_lock *l;
+	unsigned long idle;
+
+	mutex_lock(&tree_lock);
+	last_lookup_count = lookup_count;
+	last_create_count = create_count;
+	last_stats_time = jiffies;
+	if (reap_idle_secs <= 0)
+		goto out;
+	idle = reap_idle_jiffies();
+	for (n = rb_first(&user_wake_locks); n != NULL; n = next) {
+		next = rb_next(n);
+		l = rb_entry(n, struct user_wake_lock, node);
+		/* skip locks that are held or being written to */
+		if (wake_lock_active(&l->wake_lock) ||
+		    atomic_read(&l->refcount) != 1 ||
+		    time_before(jiffies, l->last_used + idle))
+			continue;
+		rb_erase(&l->node, &user_wake_locks);
+		hlist_del(&l->hash);
+		user_wake_lock_count--;
+		reap_count++;
+		put_user_wake_lock(l);
+	}
+	if (user_wake_lock_count)
+		schedule_delayed_work(&reap_work, idle);
+out:
+	mutex_unlock(&tree_lock);
+}
 
 static struct user_wake_lock *lookup_wake_lock_name(
 	const char *buf, int allocate, long *timeoutptr)
 {
 	struct rb_node **p = &user_wake_locks.rb_node;
 	struct rb_node *parent = NULL;
+	struct hlist_head *head;
+	struct hlist_node *pos;
 	struct user_wake_lock *l;
 	int diff;
 	u64 timeout;
@@ -77,31 +166,35 @@ static struct user_wake_lock *lookup_wake_lock_name(
 	else if (timeoutptr)
 		*timeoutptr = 0;
 
-	/* Lookup wake lock in rbtree */
+	/* Lookup wake lock in hash */
+	lookup_count++;
+	head = wake_lock_hash_head(buf, name_len);
+	hlist_for_each_entry(l, pos, head, hash) {
+		if (!strncmp(buf, l->name, name_len) && !l->name[name_len]) {
+			if (debug_mask & DEBUG_LOOKUP)
+				pr_info("lookup_wake_lock_name: found %s\n",
+					l->name);
+			goto found;
+		}
+	}
+
+	/* Allocate and add new wakelock to rbtree and hash */
+	if (!allocate) {
+		if (debug_mask & DEBUG_ERROR)
+			pr_info("lookup_wake_lock_name: %.*s not found\n",
+				name_len, buf);
+		return ERR_PTR(-EINVAL);
+	}
 	while (*p) {
 		parent = *p;
 		l = rb_entry(parent, struct user_wake_lock, node);
 		diff = strncmp(buf, l->name, name_len);
 		if (!diff && l->name[name_len])
 			diff = -1;
-		if (debug_mask & DEBUG_ERROR)
-			pr_info("lookup_wake_lock_name: compare %.*s %s %d\n",
-				name_len, buf, l->name, diff);
-
 		if (diff < 0)
 			p = &(*p)->rb_left;
-		else if (diff > 0)
-			p = &(*p)->rb_right;
 		else
-			return l;
-	}
-
-	/* Allocate and add new wakelock to rbtree */
-	if (!allocate) {
-		if (debug_mask & DEBUG_ERROR)
-			pr_info("lookup_wake_lock_name: %.*s not found\n",
-				name_len, buf);
-		return ERR_PTR(-EINVAL);
+			p = &(*p)->rb_right;
 	}
 	l = kzalloc(sizeof(*l) + name_len + 1, GFP_KERNEL);
 	if (l == NULL) {
@@ -114,8 +207,18 @@ static struct user_wake_lock *lookup_wake_lock_name(
 	if (debug_mask & DEBUG_NEW)
 		pr_info("lookup_wake_lock_name: new wake lock %s\n", l->name);
 	wake_lock_init(&l->wake_lock, WAKE_LOCK_SUSPEND, l->name);
+	atomic_set(&l->refcount, 1);
 	rb_link_node(&l->node, parent, p);
 	rb_insert_color(&l->node, &user_wake_locks);
+	hlist_add_head(&l->hash, head);
+	create_count++;
+	user_wake_lock_count++;
+	/* does nothing if the reaper is already pending */
+	if (reap_idle_secs > 0)
+		schedule_delayed_work(&reap_work, reap_idle_jiffies());
+found:
+	atomic_inc(&l->refcount);
+	l->last_used = jiffies;
 	return l;
 
 bad_arg:
@@ -155,10 +258,9 @@ ssize_t wake_lock_store(
 
 	mutex_lock(&tree_lock);
 	l = lookup_wake_lock_name(buf, 1, &timeout);
-	if (IS_ERR(l)) {
-		n = PTR_ERR(l);
-		goto bad_name;
-	}
+	mutex_unlock(&tree_lock);
+	if (IS_ERR(l))
+		return PTR_ERR(l);
 
 	if (debug_mask & DEBUG_ACCESS)
 		pr_info("wake_lock_store: %s, timeout %ld\n", l->name, timeout);
@@ -167,8 +269,7 @@ ssize_t wake_lock_store(
 		wake_lock_timeout(&l->wake_lock, timeout);
 	else
 		wake_lock(&l->wake_lock);
-bad_name:
-	mutex_unlock(&tree_lock);
+	put_user_wake_lock(l);
 	return n;
 }
 
@@ -202,17 +303,36 @@ ssize_t wake_unlock_store(
 
 	mutex_lock(&tree_lock);
 	l = lookup_wake_lock_name(buf, 0, NULL);
-	if (IS_ERR(l)) {
-		n = PTR_ERR(l);
-		goto not_found;
-	}
+	mutex_unlock(&tree_lock);
+	if (IS_ERR(l))
+		return PTR_ERR(l);
 
 	if (debug_mask & DEBUG_ACCESS)
 		pr_info("wake_unlock_store: %s\n", l->name);
 
 	wake_unlock(&l->wake_lock);
-not_found:
+	put_user_wake_lock(l);
+	return n;
+}
+
+static int user_wake_lock_stats_get(char *buffer, struct kernel_param *kp)
+{
+	unsigned long secs;
+	int n;
+
+	mutex_lock(&tree_lock);
+	secs = (jiffies - last_stats_time) / HZ;
+	if (!secs)
+		secs = 1;
+	n = sprintf(buffer, "locks %d\n", user_wake_lock_count);
+	n += sprintf(buffer + n, "lookups %lu (%lu/s)\n", lookup_count,
+		     (lookup_count - last_lookup_count) / secs);
+	n += sprintf(buffer + n, "creations %lu (%lu/s)\n", create_count,
+		     (create_count - last_create_count) / secs);
+	n += sprintf(buffer + n, "reaped %lu", reap_count);
 	mutex_unlock(&tree_lock);
 	return n;
 }
 
+module_param_call(stats, NULL, user_wake_lock_stats_get, NULL, S_IRUGO);
+
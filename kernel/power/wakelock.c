@@ -20,7 +20,9 @@
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
+#include <linux/debugfs.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #endif
 #include "power.h"
 
@@ -40,21 +42,37 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
 #define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
-#define TOO_MAY_LOCKS_WARNING		"\n\ntoo many wakelocks!!!\n"
-
+/* list_lock protects the list of all wake locks, it is only taken to add
+ * or remove a lock and by the slow paths that look at every lock. locking
+ * and unlocking only take the state_lock of the lock itself. if both are
+ * needed take list_lock first */
 static DEFINE_SPINLOCK(list_lock);
-static LIST_HEAD(inactive_locks);
-static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
-static int current_event_num;
+static LIST_HEAD(wake_locks);
+/* number of active locks of each type, and how many of them have no
+ * timeout */
+static atomic_t active_count[WAKE_LOCK_TYPE_COUNT];
+static atomic_t active_no_timeout[WAKE_LOCK_TYPE_COUNT];
+static atomic_t current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
 suspend_state_t requested_suspend_state = PM_SUSPEND_MEM;
 static struct wake_lock unknown_wakeup;
+static void suspend(struct work_struct *work);
+static DECLARE_WORK(suspend_work, suspend);
 
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
-static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
+/* the suspend lock that alone keeps the system from suspending, and since
+ * when, protected by list_lock as is stat.sole_blocker_time of all locks */
+static struct wake_lock *sole_blocker;
+static ktime_t sole_blocker_start;
+/* set from earlysuspend, stays on without it */
+static int screen_on = 1;
+static int suspend_count;
+static int suspend_failed_count;
+static int wakeup_count;
+static struct dentry *wakelock_stats_dentry;
 
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
@@ -83,21 +101,26 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 }
 
 
-static int print_lock_stat(char *buf, int len, struct wake_lock *lock)
+static void print_lock_stat(struct seq_file *m, struct wake_lock *lock,
+			    int verbose)
 {
 	int lock_count = lock->stat.count;
 	int expire_count = lock->stat.expire_count;
 	ktime_t active_time = ktime_set(0, 0);
 	ktime_t total_time = lock->stat.total_time;
 	ktime_t max_time = lock->stat.max_time;
-	int n;
+	ktime_t sole_blocker_time = lock->stat.sole_blocker_time;
+	ktime_t screen_time[2];
+	ktime_t now = ktime_get();
 
 	ktime_t prevent_suspend_time = lock->stat.prevent_suspend_time;
+	screen_time[0] = lock->stat.screen_time[0];
+	screen_time[1] = lock->stat.screen_time[1];
 	if (lock->flags & WAKE_LOCK_ACTIVE) {
-		ktime_t now, add_time;
-		int expired = get_expired_time(lock, &now);
-		if (!expired)
-			now = ktime_get();
+		ktime_t etime, add_time;
+		int expired = get_expired_time(lock, &etime);
+		if (expired)
+			now = etime;
 		add_time = ktime_sub(now, lock->stat.last_time);
 		lock_count++;
 		if (!expired)
@@ -107,53 +130,119 @@ static int print_lock_stat(char *buf, int len, struct wake_lock *lock)
 		total_time = ktime_add(total_time, add_time);
 		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
 			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+					ktime_sub(now,
+						  lock->stat.prevent_suspend_start));
+		screen_time[screen_on] = ktime_add(screen_time[screen_on],
+				ktime_sub(now, lock->stat.screen_time_start));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
-
-	n = snprintf(buf, len,
-		     "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",
-		     lock->name, lock_count, expire_count,
-		     lock->stat.wakeup_count, ktime_to_ns(active_time),
-		     ktime_to_ns(total_time),
-		     ktime_to_ns(prevent_suspend_time), ktime_to_ns(max_time),
-		     ktime_to_ns(lock->stat.last_time));
-
-	return n > len ? len : n;
+	if (lock == sole_blocker)
+		sole_blocker_time = ktime_add(sole_blocker_time,
+				ktime_sub(ktime_get(), sole_blocker_start));
+
+	if (!verbose) {
+		seq_printf(m, "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+			   lock->name, lock_count, expire_count,
+			   lock->stat.wakeup_count, ktime_to_ns(active_time),
+			   ktime_to_ns(total_time),
+			   ktime_to_ns(prevent_suspend_time),
+			   ktime_to_ns(max_time),
+			   ktime_to_ns(lock->stat.last_time));
+		return;
+	}
+	seq_printf(m, "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld"
+		   "\t%lld\t%lld\n",
+		   lock->name, lock_count, expire_count,
+		   lock->stat.wakeup_count, ktime_to_ns(active_time),
+		   ktime_to_ns(total_time), ktime_to_ns(prevent_suspend_time),
+		   ktime_to_ns(sole_blocker_time),
+		   ktime_to_ns(screen_time[1]), ktime_to_ns(screen_time[0]),
+		   ktime_to_ns(max_time), ktime_to_ns(lock->stat.last_time));
 }
 
-
-static int wakelocks_read_proc(char *page, char **start, off_t off,
-			       int count, int *eof, void *data)
+static int wakelocks_show(struct seq_file *m, void *unused)
 {
 	unsigned long irqflags;
 	struct wake_lock *lock;
-	int len = 0;
-	int type;
+	int verbose = (long)m->private;
 
 	spin_lock_irqsave(&list_lock, irqflags);
 
-	len += snprintf(page + len, count - len,
-			"name\tcount\texpire_count\twake_count\tactive_since"
-			"\ttotal_time\tsleep_time\tmax_time\tlast_change\n");
-	list_for_each_entry(lock, &inactive_locks, link) {
-		len += print_lock_stat(page + len, count - len, lock);
+	if (verbose)
+		seq_printf(m, "name\tcount\texpire_count\twake_count"
+			   "\tactive_since\ttotal_time\tsleep_time"
+			   "\tsole_blocker_time\tscreen_on_time"
+			   "\tscreen_off_time\tmax_time\tlast_change\n");
+	else
+		seq_printf(m, "name\tcount\texpire_count\twake_count"
+			   "\tactive_since\ttotal_time\tsleep_time\tmax_time"
+			   "\tlast_change\n");
+	list_for_each_entry(lock, &wake_locks, link) {
+		spin_lock(&lock->state_lock);
+		print_lock_stat(m, lock, verbose);
+		spin_unlock(&lock->state_lock);
 	}
-	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
-		list_for_each_entry(lock, &active_wake_locks[type], link)
-			len += print_lock_stat(page + len, count - len, lock);
+	if (verbose) {
+		seq_printf(m, "\nsuspends\t%d\n", suspend_count);
+		seq_printf(m, "failed suspends\t%d\n", suspend_failed_count);
+		seq_printf(m, "wakeups\t%d\n", wakeup_count);
+		seq_printf(m, "unknown wakeups\t%d\n",
+			   unknown_wakeup.stat.wakeup_count);
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
+	return 0;
+}
 
-	if (len == count)
-		memcpy(page + len - strlen(TOO_MAY_LOCKS_WARNING),
-		       TOO_MAY_LOCKS_WARNING,
-		       strlen(TOO_MAY_LOCKS_WARNING));
+static int wakelocks_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wakelocks_show, PDE(inode)->data);
+}
 
-	*eof = 1;
+static const struct file_operations wakelocks_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelocks_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	return len;
+static int wakelock_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wakelocks_show, inode->i_private);
+}
+
+static const struct file_operations wakelock_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelock_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* a suspend lock prevents suspend while it is active and the main lock is
+ * not, from prevent_suspend_start on */
+static void start_preventing_suspend_locked(struct wake_lock *lock,
+					    ktime_t now)
+{
+	lock->stat.prevent_suspend_start = now;
+	lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+}
+
+static void stop_preventing_suspend_locked(struct wake_lock *lock,
+					   ktime_t now)
+{
+	ktime_t etime;
+
+	if (!(lock->flags & WAKE_LOCK_PREVENTING_SUSPEND))
+		return;
+	if (get_expired_time(lock, &etime))
+		now = etime;
+	if (ktime_to_ns(now) > ktime_to_ns(lock->stat.prevent_suspend_start))
+		lock->stat.prevent_suspend_time = ktime_add(
+			lock->stat.prevent_suspend_time,
+			ktime_sub(now, lock->stat.prevent_suspend_start));
+	lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 }
 
 static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
@@ -174,62 +263,164 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
 	lock->stat.last_time = ktime_get();
-	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
-		lock->stat.prevent_suspend_time = ktime_add(
-			lock->stat.prevent_suspend_time, duration);
-		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
+	lock->stat.screen_time[screen_on] = ktime_add(
+		lock->stat.screen_time[screen_on],
+		ktime_sub(now, lock->stat.screen_time_start));
+	stop_preventing_suspend_locked(lock, now);
+}
+
+static void update_sole_blocker_locked(ktime_t now)
+{
+	struct wake_lock *lock, *sole = NULL;
+	ktime_t etime;
+	int count = 0;
+
+	if (!wake_lock_active(&main_wake_lock) &&
+	    atomic_read(&active_count[WAKE_LOCK_SUSPEND])) {
+		list_for_each_entry(lock, &wake_locks, link) {
+			if (lock == &main_wake_lock ||
+			    (lock->flags & WAKE_LOCK_TYPE_MASK) !=
+			    WAKE_LOCK_SUSPEND ||
+			    !(lock->flags & WAKE_LOCK_ACTIVE) ||
+			    get_expired_time(lock, &etime))
+				continue;
+			if (++count > 1)
+				break;
+			sole = lock;
+		}
+		if (count != 1)
+			sole = NULL;
 	}
+	if (sole == sole_blocker)
+		return;
+	if (sole_blocker)
+		sole_blocker->stat.sole_blocker_time = ktime_add(
+			sole_blocker->stat.sole_blocker_time,
+			ktime_sub(now, sole_blocker_start));
+	sole_blocker = sole;
+	sole_blocker_start = now;
+}
+
+/* called after a suspend lock changed state, there can only be a sole
+ * blocker while the main lock is released and at most two suspend locks
+ * are active */
+static void update_sole_blocker(struct wake_lock *lock)
+{
+	unsigned long irqflags;
+
+	if ((lock->flags & WAKE_LOCK_TYPE_MASK) != WAKE_LOCK_SUSPEND ||
+	    lock == &main_wake_lock || wake_lock_active(&main_wake_lock) ||
+	    atomic_read(&active_count[WAKE_LOCK_SUSPEND]) > 2)
+		return;
+	spin_lock_irqsave(&list_lock, irqflags);
+	update_sole_blocker_locked(ktime_get());
+	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 
-static void update_sleep_wait_stats_locked(int done)
+void wake_lock_set_screen_state(int on)
 {
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
+	unsigned long irqflags;
+	ktime_t now, etime;
+	int old;
 
+	spin_lock_irqsave(&list_lock, irqflags);
+	old = screen_on;
+	if (old == !!on)
+		goto out;
+	screen_on = !!on;
 	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
+	list_for_each_entry(lock, &wake_locks, link) {
+		spin_lock(&lock->state_lock);
+		if ((lock->flags & WAKE_LOCK_ACTIVE) &&
+		    !get_expired_time(lock, &etime)) {
+			lock->stat.screen_time[old] = ktime_add(
+				lock->stat.screen_time[old],
+				ktime_sub(now, lock->stat.screen_time_start));
+			lock->stat.screen_time_start = now;
 		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+		spin_unlock(&lock->state_lock);
 	}
-	last_sleep_time_update = now;
+out:
+	spin_unlock_irqrestore(&list_lock, irqflags);
 }
-#endif
 
+/* called when the main lock is taken (done) or released, the suspend locks
+ * active at that point stop or start preventing suspend */
+static void update_sleep_wait_stats(int done)
+{
+	struct wake_lock *lock;
+	unsigned long irqflags;
+	ktime_t now, etime;
 
-static void expire_wake_lock(struct wake_lock *lock)
+	spin_lock_irqsave(&list_lock, irqflags);
+	now = ktime_get();
+	list_for_each_entry(lock, &wake_locks, link) {
+		if (lock == &main_wake_lock ||
+		    (lock->flags & WAKE_LOCK_TYPE_MASK) != WAKE_LOCK_SUSPEND)
+			continue;
+		spin_lock(&lock->state_lock);
+		if (done)
+			stop_preventing_suspend_locked(lock, now);
+		else if ((lock->flags & WAKE_LOCK_ACTIVE) &&
+			 !(lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) &&
+			 !get_expired_time(lock, &etime))
+			start_preventing_suspend_locked(lock, now);
+		spin_unlock(&lock->state_lock);
+	}
+	update_sole_blocker_locked(now);
+	spin_unlock_irqrestore(&list_lock, irqflags);
+}
+#endif
+
+/* returns 1 if this was the last active suspend lock */
+static int wake_lock_deactivate_locked(struct wake_lock *lock, int expired)
 {
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return 0;
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 1);
+	wake_unlock_stat_locked(lock, expired);
 #endif
+	if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE))
+		atomic_dec(&active_no_timeout[type]);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
-	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
-		pr_info("expired wake lock %s\n", lock->name);
+	return atomic_dec_and_test(&active_count[type]) &&
+		type == WAKE_LOCK_SUSPEND;
+}
+
+static void expire_wake_lock(unsigned long data)
+{
+	struct wake_lock *lock = (struct wake_lock *)data;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&lock->state_lock, irqflags);
+	/* it may have been unlocked or taken again since the timer fired */
+	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
+	    (long)(lock->expires - jiffies) <= 0) {
+		if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
+			pr_info("expired wake lock %s\n", lock->name);
+		if (wake_lock_deactivate_locked(lock, 1))
+			queue_work(suspend_work_queue, &suspend_work);
+	}
+	spin_unlock_irqrestore(&lock->state_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	update_sole_blocker(lock);
+#endif
 }
 
-/* Caller must acquire the list_lock spinlock */
 static void print_active_locks(int type)
 {
 	unsigned long irqflags;
 	struct wake_lock *lock;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry(lock, &active_wake_locks[type], link) {
+	spin_lock_irqsave(&list_lock, irqflags);
+	list_for_each_entry(lock, &wake_locks, link) {
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) != type ||
+		    !(lock->flags & WAKE_LOCK_ACTIVE))
+			continue;
 		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
 			long timeout = lock->expires - jiffies;
 			if (timeout <= 0)
@@ -240,35 +431,35 @@ static void print_active_locks(int type)
 		} else
 			pr_info("active wake lock %s\n", lock->name);
 	}
+	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 
-static long has_wake_lock_locked(int type)
+long has_wake_lock(int type)
 {
-	struct wake_lock *lock, *n;
+	struct wake_lock *lock;
+	unsigned long irqflags;
 	long max_timeout = 0;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
-	}
-	return max_timeout;
-}
+	if (!atomic_read(&active_count[type]))
+		return 0;
+	if (atomic_read(&active_no_timeout[type]))
+		return -1;
 
-long has_wake_lock(int type)
-{
-	long ret;
-	unsigned long irqflags;
+	/* only locks with a timeout are held, find the last to expire */
 	spin_lock_irqsave(&list_lock, irqflags);
-	ret = has_wake_lock_locked(type);
+	list_for_each_entry(lock, &wake_locks, link) {
+		long timeout;
+
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) != type ||
+		    !(lock->flags & WAKE_LOCK_AUTO_EXPIRE))
+			continue;
+		timeout = lock->expires - jiffies;
+		if (timeout > max_timeout)
+			max_timeout = timeout;
+	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
-	return ret;
+	return max_timeout;
 }
 
 static void suspend(struct work_struct *work)
@@ -282,7 +473,7 @@ static void suspend(struct work_struct *work)
 		return;
 	}
 
-	entry_event_num = current_event_num;
+	entry_event_num = atomic_read(&current_event_num);
 	sys_sync();
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("suspend: enter suspend\n");
@@ -297,37 +488,27 @@ static void suspend(struct work_struct *work)
 			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
 			tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec);
 	}
-	if (current_event_num == entry_event_num) {
+#ifdef CONFIG_WAKELOCK_STAT
+	/* only blame a wakeup on the lock that ended an actual suspend */
+	if (ret) {
+		suspend_failed_count++;
+		wait_for_wakeup = 0;
+	} else
+		suspend_count++;
+#endif
+	if (atomic_read(&current_event_num) == entry_event_num) {
 		if (debug_mask & DEBUG_SUSPEND)
 			pr_info("suspend: pm_suspend returned with no event\n");
 		wake_lock_timeout(&unknown_wakeup, HZ / 2);
 	}
 }
-static DECLARE_WORK(suspend_work, suspend);
-
-static void expire_wake_locks(unsigned long data)
-{
-	long has_lock;
-	unsigned long irqflags;
-	if (debug_mask & DEBUG_EXPIRE)
-		pr_info("expire_wake_locks: start\n");
-	spin_lock_irqsave(&list_lock, irqflags);
-	if (debug_mask & DEBUG_SUSPEND)
-		print_active_locks(WAKE_LOCK_SUSPEND);
-	has_lock = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
-	if (debug_mask & DEBUG_EXPIRE)
-		pr_info("expire_wake_locks: done, has_lock %ld\n", has_lock);
-	if (has_lock == 0)
-		queue_work(suspend_work_queue, &suspend_work);
-	spin_unlock_irqrestore(&list_lock, irqflags);
-}
-static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
 
 static int power_suspend_late(struct platform_device *pdev, pm_message_t state)
 {
 	int ret = has_wake_lock(WAKE_LOCK_SUSPEND) ? -EAGAIN : 0;
 #ifdef CONFIG_WAKELOCK_STAT
-	wait_for_wakeup = 1;
+	if (!ret)
+		wait_for_wakeup = 1;
 #endif
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("power_suspend_late return %d\n", ret);
@@ -358,14 +539,21 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.wakeup_count = 0;
 	lock->stat.total_time = ktime_set(0, 0);
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
+	lock->stat.prevent_suspend_start = ktime_set(0, 0);
+	lock->stat.sole_blocker_time = ktime_set(0, 0);
+	lock->stat.screen_time[0] = ktime_set(0, 0);
+	lock->stat.screen_time[1] = ktime_set(0, 0);
+	lock->stat.screen_time_start = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
 	lock->stat.last_time = ktime_set(0, 0);
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
+	spin_lock_init(&lock->state_lock);
+	setup_timer(&lock->timer, expire_wake_lock, (unsigned long)lock);
 
 	INIT_LIST_HEAD(&lock->link);
 	spin_lock_irqsave(&list_lock, irqflags);
-	list_add(&lock->link, &inactive_locks);
+	list_add(&lock->link, &wake_locks);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
@@ -375,9 +563,16 @@ void wake_lock_destroy(struct wake_lock *lock)
 	unsigned long irqflags;
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
+	del_timer_sync(&lock->timer);
 	spin_lock_irqsave(&list_lock, irqflags);
+	spin_lock(&lock->state_lock);
+	/* a lock destroyed while active must not keep the system awake */
+	if (wake_lock_deactivate_locked(lock, 0))
+		queue_work(suspend_work_queue, &suspend_work);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
 #ifdef CONFIG_WAKELOCK_STAT
+	if (lock == sole_blocker)
+		update_sole_blocker_locked(ktime_get());
 	if (lock->stat.count) {
 		deleted_wake_locks.stat.count += lock->stat.count;
 		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
@@ -387,11 +582,21 @@ void wake_lock_destroy(struct wake_lock *lock)
 		deleted_wake_locks.stat.prevent_suspend_time =
 			ktime_add(deleted_wake_locks.stat.prevent_suspend_time,
 				  lock->stat.prevent_suspend_time);
+		deleted_wake_locks.stat.sole_blocker_time =
+			ktime_add(deleted_wake_locks.stat.sole_blocker_time,
+				  lock->stat.sole_blocker_time);
+		deleted_wake_locks.stat.screen_time[0] =
+			ktime_add(deleted_wake_locks.stat.screen_time[0],
+				  lock->stat.screen_time[0]);
+		deleted_wake_locks.stat.screen_time[1] =
+			ktime_add(deleted_wake_locks.stat.screen_time[1],
+				  lock->stat.screen_time[1]);
 		deleted_wake_locks.stat.max_time =
 			ktime_add(deleted_wake_locks.stat.max_time,
 				  lock->stat.max_time);
 	}
 #endif
+	spin_unlock(&lock->state_lock);
 	list_del(&lock->link);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
@@ -402,32 +607,40 @@ static void wake_lock_internal(
 {
 	int type;
 	unsigned long irqflags;
-	long expire_in;
 
-	spin_lock_irqsave(&list_lock, irqflags);
+	spin_lock_irqsave(&lock->state_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
 #ifdef CONFIG_WAKELOCK_STAT
-	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup) {
+	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup &&
+	    xchg(&wait_for_wakeup, 0)) {
 		if (debug_mask & DEBUG_WAKEUP)
 			pr_info("wakeup wake lock: %s\n", lock->name);
-		wait_for_wakeup = 0;
 		lock->stat.wakeup_count++;
+		wakeup_count++;
 	}
+	/* account for an expiry the timer has not got to yet without letting
+	 * the active count drop, the lock stays active */
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
 	    (long)(lock->expires - jiffies) <= 0) {
-		wake_unlock_stat_locked(lock, 0);
+		wake_unlock_stat_locked(lock, 1);
 		lock->stat.last_time = ktime_get();
+		lock->stat.screen_time_start = lock->stat.last_time;
 	}
 #endif
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
+		atomic_inc(&active_count[type]);
+		atomic_inc(&active_no_timeout[type]);
 #ifdef CONFIG_WAKELOCK_STAT
 		lock->stat.last_time = ktime_get();
+		lock->stat.screen_time_start = lock->stat.last_time;
 #endif
-	}
-	list_del(&lock->link);
+	} else if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		atomic_inc(&active_no_timeout[type]);
+	/* active_no_timeout now counts this lock, it is dropped again below
+	 * if the lock has a timeout */
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -435,41 +648,31 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		atomic_dec(&active_no_timeout[type]);
+		mod_timer(&lock->timer, lock->expires);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
-		list_add(&lock->link, &active_wake_locks[type]);
+		del_timer(&lock->timer);
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
-		current_event_num++;
+		atomic_inc(&current_event_num);
 #ifdef CONFIG_WAKELOCK_STAT
-		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
-		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+		if (lock != &main_wake_lock &&
+		    !wake_lock_active(&main_wake_lock) &&
+		    !(lock->flags & WAKE_LOCK_PREVENTING_SUSPEND))
+			start_preventing_suspend_locked(lock, ktime_get());
 #endif
-		if (has_timeout)
-			expire_in = has_wake_lock_locked(type);
-		else
-			expire_in = -1;
-		if (expire_in > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_lock: %s, start expire timer, "
-					"%ld\n", lock->name, expire_in);
-			mod_timer(&expire_timer, jiffies + expire_in);
-		} else {
-			if (del_timer(&expire_timer))
-				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_lock: %s, stop expire timer\n",
-						lock->name);
-			if (expire_in == 0)
-				queue_work(suspend_work_queue, &suspend_work);
-		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock_irqrestore(&lock->state_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	if (lock == &main_wake_lock)
+		update_sleep_wait_stats(1);
+	else
+		update_sole_blocker(lock);
+#endif
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -486,42 +689,25 @@ EXPORT_SYMBOL(wake_lock_timeout);
 
 void wake_unlock(struct wake_lock *lock)
 {
-	int type;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
-	type = lock->flags & WAKE_LOCK_TYPE_MASK;
-#ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
-#endif
+	spin_lock_irqsave(&lock->state_lock, irqflags);
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
-	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
-	if (type == WAKE_LOCK_SUSPEND) {
-		long has_lock = has_wake_lock_locked(type);
-		if (has_lock > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_unlock: %s, start expire timer, "
-					"%ld\n", lock->name, has_lock);
-			mod_timer(&expire_timer, jiffies + has_lock);
-		} else {
-			if (del_timer(&expire_timer))
-				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_unlock: %s, stop expire "
-						"timer\n", lock->name);
-			if (has_lock == 0)
-				queue_work(suspend_work_queue, &suspend_work);
-		}
-		if (lock == &main_wake_lock) {
-			if (debug_mask & DEBUG_SUSPEND)
-				print_active_locks(WAKE_LOCK_SUSPEND);
+	del_timer(&lock->timer);
+	if (wake_lock_deactivate_locked(lock, 0))
+		queue_work(suspend_work_queue, &suspend_work);
+	spin_unlock_irqrestore(&lock->state_lock, irqflags);
+	if (lock == &main_wake_lock) {
+		if (debug_mask & DEBUG_SUSPEND)
+			print_active_locks(WAKE_LOCK_SUSPEND);
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+		update_sleep_wait_stats(0);
 #endif
-		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	else
+		update_sole_blocker(lock);
+#endif
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -534,10 +720,6 @@ EXPORT_SYMBOL(wake_lock_active);
 static int __init wakelocks_init(void)
 {
 	int ret;
-	int i;
-
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
-		INIT_LIST_HEAD(&active_wake_locks[i]);
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -565,8 +747,7 @@ static int __init wakelocks_init(void)
 	}
 
 #ifdef CONFIG_WAKELOCK_STAT
-	create_proc_read_entry("wakelocks", S_IRUGO, NULL,
-				wakelocks_read_proc, NULL);
+	proc_create("wakelocks", S_IRUGO, NULL, &wakelocks_fops);
 #endif
 
 	return 0;
@@ -587,6 +768,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	debugfs_remove(wakelock_stats_dentry);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
@@ -599,5 +781,17 @@ static void  __exit wakelocks_exit(void)
 #endif
 }
 
+#ifdef CONFIG_WAKELOCK_STAT
+/* debugfs is not registered yet when wakelocks_init runs */
+static int __init wakelocks_debugfs_init(void)
+{
+	wakelock_stats_dentry = debugfs_create_file("wakelocks",
+			S_IFREG | S_IRUGO, NULL, (void *)1,
+			&wakelock_stats_fops);
+	return 0;
+}
+late_initcall(wakelocks_debugfs_init);
+#endif
+
 core_initcall(wakelocks_init);
 module_exit(wakelocks_exit);
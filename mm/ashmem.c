@@ -18,6 +18,8 @@
 
 #include <linux/module.h>
 #include <linux/file.h>
+#include <linux/err.h>
+#include <linux/eventfd.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/security.h>
@@ -27,6 +29,9 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -36,44 +41,68 @@
 
 /*
  * ashmem_area - anonymous shared memory area
- * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Lifecycle: From our parent file's open() until its release(), or until
+ *	the shrinker drops its reference if it is purging the area then
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct rb_root unpinned;	/* unpinned ranges, by pgstart */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct file *purge_event;	/* eventfd signalled on purge, or NULL */
+	struct mutex mutex;		/* protects all of the above */
+	atomic_t refcount;		/* the file, and the shrinker */
+	atomic_t purging;		/* ranges being truncated */
+	wait_queue_head_t purge_wait;	/* pinners waiting for purging */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex', `lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* node in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
+	unsigned int cost;		/* ASHMEM_PURGE_COST_*, picks the LRU */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
-static LIST_HEAD(ashmem_lru_list);
+#define ASHMEM_PURGE_COSTS	(ASHMEM_PURGE_COST_HIGH + 1)
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/*
+ * LRU lists of unpinned pages, one per purge cost, protected by
+ * ashmem_lru_lock. The shrinker empties the cheapest list first.
+ */
+static struct list_head ashmem_lru_list[ASHMEM_PURGE_COSTS] = {
+	LIST_HEAD_INIT(ashmem_lru_list[ASHMEM_PURGE_COST_LOW]),
+	LIST_HEAD_INIT(ashmem_lru_list[ASHMEM_PURGE_COST_NORMAL]),
+	LIST_HEAD_INIT(ashmem_lru_list[ASHMEM_PURGE_COST_HIGH]),
+};
+
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list, only held to add, remove or pick
+ * a range
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *		  asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker takes an area's mutex with mutex_trylock() after dropping
+ * ashmem_lru_lock, and holds neither while it truncates.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* the shrinker gives up after this many areas in a row were busy */
+#define ASHMEM_SHRINK_BUSY_MAX	16
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -104,31 +133,66 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
-	list_add_tail(&range->lru, &ashmem_lru_list);
+	spin_lock(&ashmem_lru_lock);
+	list_add_tail(&range->lru, &ashmem_lru_list[range->cost]);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_del(&range->lru);
 	lru_count -= range_size(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+/*
+ * lru_first - the least-recently-unpinned range of the cheapest non-empty
+ * LRU list, or NULL if there is none
+ *
+ * Caller must hold ashmem_lru_lock.
+ */
+static struct ashmem_range *lru_first(void)
+{
+	unsigned int cost;
+
+	for (cost = 0; cost < ASHMEM_PURGE_COSTS; cost++)
+		if (!list_empty(&ashmem_lru_list[cost]))
+			return list_first_entry(&ashmem_lru_list[cost],
+						struct ashmem_range, lru);
+	return NULL;
+}
+
+static inline void asma_get(struct ashmem_area *asma)
+{
+	atomic_inc(&asma->refcount);
+}
+
+static void asma_put(struct ashmem_area *asma)
+{
+	if (atomic_dec_and_test(&asma->refcount))
+		kmem_cache_free(ashmem_area_cachep, asma);
 }
 
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
+ * 'cost' - purge cost hint (ASHMEM_PURGE_COST_*)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * The new range must not overlap any existing range of 'asma'.
+ *
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
-		       size_t start, size_t end)
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
+		       unsigned int cost, size_t start, size_t end)
 {
+	struct rb_node **p = &asma->unpinned.rb_node;
+	struct rb_node *parent = NULL;
 	struct ashmem_range *range;
 
 	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
@@ -139,8 +203,20 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgstart = start;
 	range->pgend = end;
 	range->purged = purged;
+	range->cost = cost;
+
+	while (*p) {
+		struct ashmem_range *entry;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+		parent = *p;
+		entry = rb_entry(parent, struct ashmem_range, node);
+		if (start < entry->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned);
 
 	if (range_on_lru(range))
 		lru_add(range);
@@ -150,16 +226,63 @@ static int range_alloc(struct ashmem_area *asma,
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->node, &range->asma->unpinned);
 	if (range_on_lru(range))
 		lru_del(range);
 	kmem_cache_free(ashmem_range_cachep, range);
 }
 
+/*
+ * range_first - returns the first unpinned range of 'asma' that ends at or
+ * after 'page', or NULL. The ranges of an area never overlap, so they are
+ * ordered by their end as well as by their start.
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma, size_t page)
+{
+	struct rb_node *n = asma->unpinned.rb_node;
+	struct ashmem_range *first = NULL;
+
+	while (n) {
+		struct ashmem_range *range;
+
+		range = rb_entry(n, struct ashmem_range, node);
+		if (range_before_page(range, page)) {
+			n = n->rb_right;
+		} else {
+			first = range;
+			n = n->rb_left;
+		}
+	}
+
+	return first;
+}
+
+static struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *n = rb_next(&range->node);
+
+	return n ? rb_entry(n, struct ashmem_range, node) : NULL;
+}
+
+/*
+ * range_find - is 'range', which started at 'pgstart' when it was last seen,
+ * still one of the unpinned ranges of 'asma'? 'range' may have been freed,
+ * so it is only compared, never dereferenced.
+ *
+ * Caller must hold asma->mutex.
+ */
+static int range_find(struct ashmem_area *asma, struct ashmem_range *range,
+		      size_t pgstart)
+{
+	return range_first(asma, pgstart) == range;
+}
+
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +292,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -186,9 +312,13 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned = RB_ROOT;
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
+	mutex_init(&asma->mutex);
+	atomic_set(&asma->refcount, 1);
+	atomic_set(&asma->purging, 0);
+	init_waitqueue_head(&asma->purge_wait);
 	file->private_data = asma;
 
 	return 0;
@@ -197,16 +327,18 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *n;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	while ((n = rb_first(&asma->unpinned)))
+		range_del(rb_entry(n, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
-	kmem_cache_free(ashmem_area_cachep, asma);
+	if (asma->purge_event)
+		fput(asma->purge_event);
+	asma_put(asma);
 
 	return 0;
 }
@@ -217,7 +349,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -232,7 +364,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	ret = asma->file->f_op->read(asma->file, buf, len, pos);
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -249,7 +381,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -292,7 +424,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -309,11 +441,13 @@ out:
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
  * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * pages freed. Ranges hinted as cheaper to regenerate go before all others.
+ * An area's purge eventfd, if any, is signalled once per purged range.
  */
 static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	int busy = 0;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
@@ -321,22 +455,71 @@ static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	if (!nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+	while (nr_to_scan > 0 && (range = lru_first())) {
+		struct ashmem_area *asma;
+		struct file *file, *event;
+		loff_t start, end;
+		size_t pgstart;
+
+		asma = range->asma;
+		pgstart = range->pgstart;
+		asma_get(asma);
+		/* a busy area goes to the back instead of being retried */
+		list_move_tail(&range->lru, &ashmem_lru_list[range->cost]);
+		spin_unlock(&ashmem_lru_lock);
 
-		vmtruncate_range(inode, start, end);
+		/*
+		 * Pinning can allocate memory with the mutex held, so only
+		 * try it. The range may be gone once we have the mutex.
+		 */
+		if (!mutex_trylock(&asma->mutex)) {
+			asma_put(asma);
+			if (++busy >= ASHMEM_SHRINK_BUSY_MAX)
+				goto out;
+			spin_lock(&ashmem_lru_lock);
+			continue;
+		}
+		busy = 0;
+		if (!range_find(asma, range, pgstart) || !range_on_lru(range)) {
+			mutex_unlock(&asma->mutex);
+			asma_put(asma);
+			spin_lock(&ashmem_lru_lock);
+			continue;
+		}
+
+		/*
+		 * Mark the range purged before dropping the mutex, a pin
+		 * waits for 'purging' so it never sees pages that are about
+		 * to be truncated.
+		 */
 		range->purged = ASHMEM_WAS_PURGED;
 		lru_del(range);
-
 		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
-	}
-	mutex_unlock(&ashmem_mutex);
+		start = range->pgstart * PAGE_SIZE;
+		end = (range->pgend + 1) * PAGE_SIZE - 1;
+		file = asma->file;
+		get_file(file);
+		event = asma->purge_event;
+		if (event)
+			get_file(event);
+		atomic_inc(&asma->purging);
+		mutex_unlock(&asma->mutex);
+
+		vmtruncate_range(file->f_dentry->d_inode, start, end);
+		fput(file);
+		if (event) {
+			eventfd_signal(event, 1);
+			fput(event);
+		}
 
+		if (atomic_dec_and_test(&asma->purging))
+			wake_up_all(&asma->purge_wait);
+		asma_put(asma);
+		spin_lock(&ashmem_lru_lock);
+	}
+	spin_unlock(&ashmem_lru_lock);
+out:
 	return lru_count;
 }
 
@@ -349,7 +532,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -364,7 +547,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -372,7 +555,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -386,7 +569,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -395,7 +578,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -412,25 +595,52 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
 
+/*
+ * set_purge_eventfd - the eventfd 'fd' is signalled each time the shrinker
+ * purges one of our ranges; a negative 'fd' removes it
+ */
+static int set_purge_eventfd(struct ashmem_area *asma, int fd)
+{
+	struct file *event = NULL, *old;
+
+	if (fd >= 0) {
+		event = eventfd_fget(fd);
+		if (IS_ERR(event))
+			return PTR_ERR(event);
+	}
+
+	mutex_lock(&asma->mutex);
+	old = asma->purge_event;
+	asma->purge_event = event;
+	mutex_unlock(&asma->mutex);
+
+	if (old)
+		fput(old);
+
+	return 0;
+}
+
 /*
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
+	for (range = range_first(asma, pgstart); range; range = next) {
+		next = range_next(range);
+
 		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
+		if (range->pgstart > pgend)
 			break;
 
 		/*
@@ -474,7 +684,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
+			range_alloc(asma, range->purged, range->cost,
 				    pgend + 1, range->pgend);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
@@ -487,74 +697,101 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
+	unsigned int cost = ASHMEM_PURGE_COST_NORMAL;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
+	for (range = range_first(asma, pgstart); range; range = next) {
+		next = range_next(range);
+
+		/* short circuit: no later range can overlap */
+		if (range->pgstart > pgend)
 			break;
 
 		/*
 		 * The user can ask us to unpin pages that are already entirely
-		 * or partially pinned. We handle those two cases here.
+		 * or partially unpinned. We handle those two cases here.
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+		pgstart = min_t(size_t, range->pgstart, pgstart),
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		/* a merged range is as costly as its most costly part */
+		cost = max(cost, range->cost);
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, purged, cost, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
+{
+	struct ashmem_range *range = range_first(asma, pgstart);
+
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
+
+	return ASHMEM_IS_PINNED;
+}
+
+/*
+ * ashmem_set_purge_cost - set the purge cost hint of every unpinned range
+ * that overlaps the given interval. Pages unpinned later get the default.
+ *
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_set_purge_cost(struct ashmem_area *asma, size_t pgstart,
+				 size_t pgend, unsigned int cost)
 {
 	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = range_next(range)) {
+		if (range->cost == cost)
+			continue;
+		if (range_on_lru(range)) {
+			lru_del(range);
+			range->cost = cost;
+			lru_add(range);
+		} else
+			range->cost = cost;
 	}
 
-	return ret;
+	return 0;
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 			    void __user *p)
 {
-	struct ashmem_pin pin;
+	struct ashmem_purge_cost pin;
 	size_t pgstart, pgend;
+	size_t len = sizeof(struct ashmem_pin);
 	int ret = -EINVAL;
 
 	if (unlikely(!asma->file))
 		return -EINVAL;
 
-	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
+	/* the purge cost is a struct ashmem_pin followed by the cost */
+	if (cmd == ASHMEM_SET_PURGE_COST)
+		len = sizeof(pin);
+	if (unlikely(copy_from_user(&pin, p, len)))
 		return -EFAULT;
 
+	if (cmd == ASHMEM_SET_PURGE_COST && pin.cost >= ASHMEM_PURGE_COSTS)
+		return -EINVAL;
+
 	/* per custom, you can pass zero for len to mean "everything onward" */
 	if (!pin.len)
 		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
@@ -571,7 +808,14 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+
+	/* a range the shrinker is still truncating must not be reused yet */
+	while (cmd == ASHMEM_PIN && atomic_read(&asma->purging)) {
+		mutex_unlock(&asma->mutex);
+		wait_event(asma->purge_wait, !atomic_read(&asma->purging));
+		mutex_lock(&asma->mutex);
+	}
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -583,9 +827,12 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_get_pin_status(asma, pgstart, pgend);
 		break;
+	case ASHMEM_SET_PURGE_COST:
+		ret = ashmem_set_purge_cost(asma, pgstart, pgend, pin.cost);
+		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -604,10 +851,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -621,8 +870,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_PIN:
 	case ASHMEM_UNPIN:
 	case ASHMEM_GET_PIN_STATUS:
+	case ASHMEM_SET_PURGE_COST:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_SET_PURGE_EVENTFD:
+		ret = set_purge_eventfd(asma, (int) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
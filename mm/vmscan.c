@@ -117,6 +117,8 @@ struct scan_control {
  */
 int vm_swappiness = 60;
 long vm_total_pages;	/* The total number of pages which the VM controls */
+atomic_long_t vm_reclaim_scanned[2];
+atomic_long_t vm_reclaim_reclaimed[2];
 
 static LIST_HEAD(shrinker_list);
 static DECLARE_RWSEM(shrinker_rwsem);
@@ -1110,6 +1112,10 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 		}
 
 		nr_reclaimed += nr_freed;
+		if (scan_global_lru(sc)) {
+			atomic_long_add(nr_scan, &vm_reclaim_scanned[file]);
+			atomic_long_add(nr_freed, &vm_reclaim_reclaimed[file]);
+		}
 		local_irq_disable();
 		if (current_is_kswapd()) {
 			__count_zone_vm_events(PGSCAN_KSWAPD, zone, nr_scan);